@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License
+#
+
+"""ctypes binding of src/libbench-engine.so (see src/bench-engine.h).
+
+Python describes the scenario - which flows, on which router, at which
+rate - and the C engine threads do all the per-message work, so a
+scripted scenario runs at the speed of the C clients:
+
+    from bench_engine import Engine
+
+    with Engine(threads=4) as engine:
+        rx = [engine.receiver("127.0.0.1:5672", f"q{i}", count=100000) for i in range(8)]
+        tx = [engine.sender("127.0.0.1:5672", f"q{i}", count=100000, rate=5000) for i in range(8)]
+        engine.start()
+        while not engine.wait(1.0):
+            print(sum(f.stats()['msgs_in'] for f in rx))
+    print(rx[0].stats()['latency_p99_usec'])
+
+Run as a script it is a command line scenario runner, see -h.
+
+The library is looked up in $BENCH_ENGINE_LIB, then next to this file
+in src/.  Build it with "make libbench-engine.so" in src/.
+"""
+
+import argparse
+import ctypes
+import os
+import sys
+
+VERSION = 1
+SUB_BITS = 3
+SUB = 1 << SUB_BITS
+BUCKETS = (64 - SUB_BITS + 1) * SUB
+
+COUNTERS = ('msgs_out', 'bytes_out', 'msgs_in', 'bytes_in', 'accepted',
+            'released', 'rejected', 'modified', 'credit_stalls', 'stall_usec',
+            'first_usec', 'last_usec', 'done', 'failed',
+            'latency_count', 'latency_sum_usec', 'latency_max_usec')
+
+
+class FlowStats(ctypes.Structure):
+    """Must match bench_flow_stats_t in src/bench-engine.h"""
+    _fields_ = [(name, ctypes.c_uint64) for name in COUNTERS] + \
+        [('latency_hist', ctypes.c_uint64 * BUCKETS)]
+
+
+def bucket_range(bucket):
+    """[low, high) usecs covered by a histogram bucket, see live_stats_bucket()"""
+    if bucket < SUB:
+        return bucket, bucket + 1
+    shift = bucket // SUB - 1
+    low = (SUB + bucket % SUB) << shift
+    return low, low + (1 << shift)
+
+
+def percentile(hist, pct):
+    """Percentile (usecs) interpolated within the bucket holding it"""
+    total = sum(hist)
+    if not total:
+        return 0
+    target = total * pct / 100.0
+    seen = 0
+    for bucket, count in enumerate(hist):
+        if count and seen + count >= target:
+            low, high = bucket_range(bucket)
+            return int(low + (high - low) * (target - seen) / count)
+        seen += count
+    return bucket_range(len(hist) - 1)[0]
+
+
+def load_library(path=None):
+    path = path or os.environ.get("BENCH_ENGINE_LIB") or \
+        os.path.join(os.path.dirname(os.path.abspath(__file__)), "src", "libbench-engine.so")
+    lib = ctypes.CDLL(path)
+    lib.bench_engine_version.restype = ctypes.c_int
+    if lib.bench_engine_version() != VERSION:
+        raise RuntimeError(f"{path}: engine version {lib.bench_engine_version()}, expected {VERSION}")
+
+    lib.bench_engine.restype = ctypes.c_void_p
+    lib.bench_engine.argtypes = [ctypes.c_char_p, ctypes.c_int]
+    lib.bench_engine_sender.restype = ctypes.c_int
+    lib.bench_engine_sender.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p,
+                                        ctypes.c_uint64, ctypes.c_int, ctypes.c_double, ctypes.c_int]
+    lib.bench_engine_receiver.restype = ctypes.c_int
+    lib.bench_engine_receiver.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p,
+                                          ctypes.c_uint64, ctypes.c_int, ctypes.c_int]
+    lib.bench_engine_start.restype = ctypes.c_int
+    lib.bench_engine_start.argtypes = [ctypes.c_void_p]
+    lib.bench_engine_wait.restype = ctypes.c_int
+    lib.bench_engine_wait.argtypes = [ctypes.c_void_p, ctypes.c_double]
+    lib.bench_engine_stop.restype = None
+    lib.bench_engine_stop.argtypes = [ctypes.c_void_p]
+    lib.bench_engine_flows.restype = ctypes.c_int
+    lib.bench_engine_flows.argtypes = [ctypes.c_void_p]
+    lib.bench_engine_flow_stats.restype = None
+    lib.bench_engine_flow_stats.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.POINTER(FlowStats)]
+    lib.bench_engine_flow_error.restype = ctypes.c_char_p
+    lib.bench_engine_flow_error.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.bench_engine_free.restype = None
+    lib.bench_engine_free.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+class Flow(object):
+    def __init__(self, engine, flow_id, role, host, address):
+        self._engine = engine
+        self.id = flow_id
+        self.role = role
+        self.host = host
+        self.address = address
+
+    @property
+    def error(self):
+        error = self._engine._lib.bench_engine_flow_error(self._engine._handle, self.id)
+        return error.decode(errors='replace') if error else None
+
+    def stats(self):
+        """Snapshot of the flow's counters, rates and latency percentiles"""
+        raw = FlowStats()
+        self._engine._lib.bench_engine_flow_stats(self._engine._handle, self.id, ctypes.byref(raw))
+        stats = {name: getattr(raw, name) for name in COUNTERS}
+        hist = list(raw.latency_hist)
+        secs = (stats['last_usec'] - stats['first_usec']) / 1e6
+        stats['duration_sec'] = secs
+        stats['msgs_out_per_sec'] = stats['msgs_out'] / secs if secs > 0 else 0.0
+        stats['msgs_in_per_sec'] = stats['msgs_in'] / secs if secs > 0 else 0.0
+        if stats['latency_count']:
+            # same names as bench-run's metrics so the two line up in bench-compare
+            stats['latency_mean_usec'] = stats['latency_sum_usec'] / stats['latency_count']
+            for pct in (50, 90, 99, 99.9):
+                stats[f"latency_p{pct:g}_usec"] = min(percentile(hist, pct), stats['latency_max_usec'])
+        stats['latency_hist'] = hist
+        return stats
+
+
+class Engine(object):
+    """A pool of C threads running senders and receivers, one connection each"""
+
+    def __init__(self, threads=1, container="BenchEngine", library=None):
+        self._lib = load_library(library)
+        self._handle = self._lib.bench_engine(container.encode(), threads)
+        self.flows = []
+
+    def sender(self, host, address, count=0, body_size=100, rate=0.0, presettle=False):
+        """count 0 == until stop(), rate in msgs/sec 0 == as fast as credit allows"""
+        flow_id = self._lib.bench_engine_sender(self._handle, host.encode(), address.encode(),
+                                                count, body_size, rate, int(presettle))
+        return self._add(flow_id, 'sender', host, address)
+
+    def receiver(self, host, address, count=0, credit_window=1000, latency=True):
+        flow_id = self._lib.bench_engine_receiver(self._handle, host.encode(), address.encode(),
+                                                  count, credit_window, int(latency))
+        return self._add(flow_id, 'receiver', host, address)
+
+    def _add(self, flow_id, role, host, address):
+        if flow_id < 0:
+            raise ValueError(f"cannot add {role} for {address} on {host}")
+        flow = Flow(self, flow_id, role, host, address)
+        self.flows.append(flow)
+        return flow
+
+    def start(self):
+        if self._lib.bench_engine_start(self._handle) != 0:
+            raise RuntimeError("engine cannot start (no flows, or already started)")
+
+    def wait(self, timeout=None):
+        """True once every flow is done, False on timeout"""
+        return bool(self._lib.bench_engine_wait(self._handle, -1.0 if timeout is None else timeout))
+
+    def stop(self):
+        self._lib.bench_engine_stop(self._handle)
+
+    def close(self):
+        if self._handle:
+            self._lib.bench_engine_free(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+def parse_flow(spec, default_host):
+    """ADDRESS[,key=value...] -> (host, address, {key: value})"""
+    address, *options = spec.split(',')
+    params = {}
+    for option in options:
+        key, _, value = option.partition('=')
+        params[key] = value if value else True
+    host = params.pop('host', default_host)
+    return host, address, params
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        description="Run senders and receivers on the C benchmark engine",
+        epilog="Flow options: count=N (0 == until --duration), size=BYTES, rate=MSGS/SEC, "
+               "presettle, window=CREDIT, nolatency, host=HOST:PORT.  Example: "
+               "-R q0,count=100000 -S q0,count=100000,rate=20000")
+    parser.add_argument("-a", "--address", default="127.0.0.1:5672",
+                        help="Default router host:port [%(default)s]")
+    parser.add_argument("-t", "--threads", type=int, default=1,
+                        help="Engine threads [%(default)s]")
+    parser.add_argument("-S", "--sender", action="append", default=[],
+                        help="Sender flow ADDRESS[,options], may be repeated")
+    parser.add_argument("-R", "--receiver", action="append", default=[],
+                        help="Receiver flow ADDRESS[,options], may be repeated")
+    parser.add_argument("-d", "--duration", type=float, default=0.0,
+                        help="Stop after N seconds, 0 == when every flow is done [%(default)s]")
+    parser.add_argument("-i", "--interval", type=float, default=1.0,
+                        help="Progress report interval in seconds [%(default)s]")
+    parser.add_argument("--lib",
+                        help="Path of libbench-engine.so")
+    args = parser.parse_args(argv[1:])
+
+    if not args.sender and not args.receiver:
+        parser.error("no flows, use -S and/or -R")
+
+    with Engine(args.threads, library=args.lib) as engine:
+        # receivers first so they are attached before the senders get credit
+        for spec in args.receiver:
+            host, address, p = parse_flow(spec, args.address)
+            engine.receiver(host, address, int(p.get('count', 0)), int(p.get('window', 1000)),
+                            not p.get('nolatency'))
+        for spec in args.sender:
+            host, address, p = parse_flow(spec, args.address)
+            engine.sender(host, address, int(p.get('count', 0)), int(p.get('size', 100)),
+                          float(p.get('rate', 0)), bool(p.get('presettle')))
+
+        engine.start()
+        elapsed = 0.0
+        last_out = last_in = 0
+        try:
+            while not engine.wait(args.interval):
+                elapsed += args.interval
+                snaps = [f.stats() for f in engine.flows]
+                out = sum(s['msgs_out'] for s in snaps)
+                rcvd = sum(s['msgs_in'] for s in snaps)
+                print(f"{elapsed:8.1f}s  sent {out:>12} ({(out - last_out) / args.interval:>10.0f}/s)"
+                      f"  received {rcvd:>12} ({(rcvd - last_in) / args.interval:>10.0f}/s)")
+                last_out, last_in = out, rcvd
+                if args.duration and elapsed >= args.duration:
+                    engine.stop()
+        except KeyboardInterrupt:
+            engine.stop()
+        engine.wait()
+
+        print(f"\n{'flow':>4} {'role':<8} {'address':<20} {'msgs':>12} {'msgs/sec':>12} "
+              f"{'stalls':>7} {'p50 usec':>9} {'p99 usec':>9} {'max usec':>9}")
+        failed = 0
+        for flow in engine.flows:
+            s = flow.stats()
+            msgs = s['msgs_out'] if flow.role == 'sender' else s['msgs_in']
+            rate = s['msgs_out_per_sec'] if flow.role == 'sender' else s['msgs_in_per_sec']
+            print(f"{flow.id:>4} {flow.role:<8} {flow.address[:20]:<20} {msgs:>12} {rate:>12.1f} "
+                  f"{s['credit_stalls']:>7} {s.get('latency_p50_usec', '-'):>9} "
+                  f"{s.get('latency_p99_usec', '-'):>9} "
+                  f"{s['latency_max_usec'] if s['latency_count'] else '-':>9}")
+            if flow.error:
+                print(f"     error: {flow.error}")
+                failed += 1
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
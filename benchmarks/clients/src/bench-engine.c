@@ -0,0 +1,677 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+/* Multi-threaded send/receive engine, see bench-engine.h
+ *
+ * Senders encode their message once and only patch the transmit
+ * timestamp in place before each pn_link_send().  Rate limited senders
+ * are paced by a proactor timeout that wakes them every
+ * BENCH_TICK_MSEC, each wakeup sends what the flow is behind its
+ * schedule (bounded by credit).
+ */
+
+#define _GNU_SOURCE   // memmem
+
+#include <proton/condition.h>
+#include <proton/connection.h>
+#include <proton/delivery.h>
+#include <proton/event.h>
+#include <proton/link.h>
+#include <proton/message.h>
+#include <proton/proactor.h>
+#include <proton/session.h>
+#include <proton/transport.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench-engine.h"
+
+#define BENCH_TICK_MSEC 1
+
+// placeholder for the transmit timestamp, located in the encoded message
+#define TIMESTAMP_MARK  0x0123456789ABCDEFLL
+
+#define USECS_PER_SECOND 1000000
+
+#define FLOW_SET(F, FIELD, VALUE) __atomic_store_n(&(F)->stats.FIELD, (VALUE), __ATOMIC_RELAXED)
+#define FLOW_ADD(F, FIELD, VALUE) FLOW_SET(F, FIELD, (F)->stats.FIELD + (VALUE))
+
+typedef struct flow_t {
+    bench_engine_t  *engine;
+    int              id;
+    bool             is_sender;
+    char            *host_port;
+    char            *address;
+    uint64_t         count;
+    double           rate;
+    bool             presettle;
+    bool             latency;
+    int              credit_window;
+
+    pn_connection_t *conn;
+    pn_link_t       *link;
+    bool             closed;         // transport closed, conn is gone (engine lock)
+    bool             finished;       // count reached, closing
+    char             error[256];
+
+    // sender
+    char            *encoded;
+    size_t           encoded_size;
+    size_t           stamp_offset;   // of the big endian timestamp in encoded
+    uint64_t         tag;
+    uint64_t         settled;
+    uint64_t         pace_start;
+    uint64_t         stall_start;
+
+    // receiver
+    char            *rx_buffer;
+    size_t           rx_buffer_size;
+    pn_message_t    *rx_message;
+
+    bench_flow_stats_t stats;
+} flow_t;
+
+struct bench_engine_t {
+    char            *container_name;
+    int              nthreads;
+    pthread_t       *threads;
+    int              running_threads;
+    bool             started;
+    bool             joined;
+    bool             stopping;
+    bool             paced;          // has rate limited senders
+    pn_proactor_t   *proactor;
+    flow_t         **flows;
+    int              nflows;
+    pthread_mutex_t  lock;
+    pthread_cond_t   idle;
+};
+
+
+// wallclock, comparable with the timestamps of sender.c/receiver.c
+static int64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (USECS_PER_SECOND * (int64_t)ts.tv_sec) + (ts.tv_nsec / 1000);
+}
+
+static uint64_t mono_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (USECS_PER_SECOND * (uint64_t)ts.tv_sec) + (ts.tv_nsec / 1000);
+}
+
+static void flow_activity(flow_t *f)
+{
+    uint64_t now = _live_stats_now();
+    if (!f->stats.first_usec)
+        FLOW_SET(f, first_usec, now);
+    FLOW_SET(f, last_usec, now);
+}
+
+static void flow_error(flow_t *f, const char *what, pn_condition_t *cond)
+{
+    if (f->stats.failed || !pn_condition_is_set(cond))
+        return;
+    snprintf(f->error, sizeof(f->error), "%s: %s: %s", what,
+             pn_condition_get_name(cond),
+             pn_condition_get_description(cond) ? pn_condition_get_description(cond) : "");
+    // publish the text before the flag, see bench_engine_flow_error()
+    __atomic_store_n(&f->stats.failed, 1, __ATOMIC_RELEASE);
+}
+
+static void flow_close(flow_t *f)
+{
+    f->finished = true;
+    if (f->conn)
+        pn_connection_close(f->conn);
+}
+
+
+// Encode the message once, the body is [timestamp, binary] as built by
+// sender.c.  Returns the offset of the timestamp or -1.
+static int encode_payload(flow_t *f, int body_size)
+{
+    pn_message_t *msg = pn_message();
+    pn_message_set_address(msg, f->address);
+
+    size_t zeros = body_size > 8 ? body_size - 8 : 0;
+    char *payload = calloc(1, zeros + 1);
+    pn_data_t *body = pn_message_body(msg);
+    pn_data_put_list(body);
+    pn_data_enter(body);
+    pn_data_put_long(body, TIMESTAMP_MARK);
+    pn_data_put_binary(body, pn_bytes(zeros, payload));
+    pn_data_exit(body);
+
+    size_t size = body_size + 512;
+    int rc;
+    do {
+        free(f->encoded);
+        f->encoded = malloc(size);
+        f->encoded_size = size;
+        rc = pn_message_encode(msg, f->encoded, &f->encoded_size);
+        size *= 2;
+    } while (rc == PN_OVERFLOW);
+
+    free(payload);
+    pn_message_free(msg);
+
+    unsigned char mark[8];
+    for (int i = 0; i < 8; ++i)
+        mark[i] = (unsigned char) ((uint64_t) TIMESTAMP_MARK >> (56 - 8 * i));
+    char *where = rc ? NULL : memmem(f->encoded, f->encoded_size, mark, sizeof(mark));
+    if (!where) {
+        free(f->encoded);
+        f->encoded = NULL;
+        f->encoded_size = 0;
+        return -1;
+    }
+    f->stamp_offset = where - f->encoded;
+    return 0;
+}
+
+static inline void stamp_payload(flow_t *f)
+{
+    uint64_t now = (uint64_t) now_usec();
+    unsigned char *p = (unsigned char *) f->encoded + f->stamp_offset;
+    for (int i = 0; i < 8; ++i)
+        p[i] = (unsigned char) (now >> (56 - 8 * i));
+}
+
+
+static void sender_pump(flow_t *f)
+{
+    pn_link_t *link = f->link;
+    if (!link || f->finished || (pn_link_state(link) & PN_LOCAL_CLOSED))
+        return;
+
+    uint64_t sent = f->stats.msgs_out;
+    uint64_t budget = f->count ? f->count - sent : UINT64_MAX;
+    if (budget == 0)
+        return;
+
+    uint64_t now = mono_usec();
+    if (f->stall_start && pn_link_credit(link) > 0) {
+        FLOW_ADD(f, stall_usec, now - f->stall_start);
+        f->stall_start = 0;
+    }
+    if (f->rate > 0) {
+        // keep the average rate: a flow that fell behind catches up
+        if (!f->pace_start)
+            f->pace_start = now;
+        uint64_t due = (uint64_t) ((now - f->pace_start) * f->rate / USECS_PER_SECOND) + 1;
+        uint64_t behind = due > sent ? due - sent : 0;
+        if (behind < budget)
+            budget = behind;
+    }
+
+    while (budget > 0 && pn_link_credit(link) > 0) {
+        pn_delivery_t *dlv = pn_delivery(link, pn_dtag((const char *) &f->tag, sizeof(f->tag)));
+        ++f->tag;
+        stamp_payload(f);
+        pn_link_send(link, f->encoded, f->encoded_size);
+        pn_link_advance(link);
+        if (f->presettle)
+            pn_delivery_settle(dlv);
+        flow_activity(f);
+        FLOW_ADD(f, msgs_out, 1);
+        FLOW_ADD(f, bytes_out, f->encoded_size);
+        --budget;
+    }
+
+    sent = f->stats.msgs_out;
+    if (f->presettle && f->count && sent == f->count) {
+        flow_close(f);
+    } else if (pn_link_credit(link) == 0 && (f->count == 0 || sent < f->count) && !f->stall_start) {
+        f->stall_start = now;
+        FLOW_ADD(f, credit_stalls, 1);
+    }
+}
+
+
+static void sender_outcome(flow_t *f, pn_delivery_t *dlv)
+{
+    uint64_t rs = pn_delivery_remote_state(dlv);
+    switch (rs) {
+    case PN_RECEIVED:
+        // not terminal, the peer is still processing the message
+        return;
+    case PN_ACCEPTED: FLOW_ADD(f, accepted, 1); break;
+    case PN_RELEASED: FLOW_ADD(f, released, 1); break;
+    case PN_REJECTED: FLOW_ADD(f, rejected, 1); break;
+    default:          FLOW_ADD(f, modified, 1); break;
+    }
+    pn_delivery_settle(dlv);
+    if (f->count && ++f->settled == f->count)
+        flow_close(f);
+}
+
+
+static void receiver_deliver(flow_t *f, pn_delivery_t *dlv)
+{
+    pn_link_t *link = pn_delivery_link(dlv);
+
+    size_t pending = pn_delivery_pending(dlv);
+    if (pending > f->rx_buffer_size) {
+        free(f->rx_buffer);
+        f->rx_buffer_size = pending;
+        f->rx_buffer = malloc(f->rx_buffer_size);
+    }
+    size_t len = 0;
+    ssize_t rc;
+    while (len < f->rx_buffer_size
+           && (rc = pn_link_recv(link, f->rx_buffer + len, f->rx_buffer_size - len)) > 0)
+        len += rc;
+
+    if (f->latency && pn_message_decode(f->rx_message, f->rx_buffer, len) == PN_OK) {
+        // expect a list, first element long usec transmit timestamp
+        pn_data_t *body = pn_message_body(f->rx_message);
+        pn_data_rewind(body);
+        if (pn_data_next(body) && pn_data_type(body) == PN_LIST && pn_data_get_list(body) >= 2) {
+            pn_data_enter(body);
+            pn_data_next(body);
+            if (pn_data_type(body) == PN_LONG) {
+                int64_t latency = now_usec() - pn_data_get_long(body);
+                if (latency < 0) latency = 0;
+                FLOW_ADD(f, latency_hist[live_stats_bucket((uint64_t) latency)], 1);
+                FLOW_ADD(f, latency_count, 1);
+                FLOW_ADD(f, latency_sum_usec, (uint64_t) latency);
+                if ((uint64_t) latency > f->stats.latency_max_usec)
+                    FLOW_SET(f, latency_max_usec, (uint64_t) latency);
+            }
+        }
+    }
+
+    if (!pn_delivery_settled(dlv))
+        pn_delivery_update(dlv, PN_ACCEPTED);
+    pn_delivery_settle(dlv);  // dlv is now freed
+    flow_activity(f);
+    FLOW_ADD(f, msgs_in, 1);
+    FLOW_ADD(f, bytes_in, len);
+
+    uint64_t received = f->stats.msgs_in;
+    if (f->count && received == f->count) {
+        flow_close(f);
+        return;
+    }
+
+    // top the credit back up to the window, never beyond what is left
+    int credit = pn_link_credit(link);
+    if (credit <= f->credit_window / 2) {
+        uint64_t want = f->credit_window;
+        if (f->count && f->count - received < want)
+            want = f->count - received;
+        if (want > (uint64_t) credit)
+            pn_link_flow(link, (int) (want - credit));
+    }
+}
+
+
+static void connection_init(flow_t *f)
+{
+    char container[256];
+    snprintf(container, sizeof(container), "%s-%d", f->engine->container_name, f->id);
+    pn_connection_set_container(f->conn, container);
+    pn_connection_set_hostname(f->conn, f->host_port);
+    pn_connection_open(f->conn);
+
+    pn_session_t *ssn = pn_session(f->conn);
+    pn_session_open(ssn);
+    if (f->is_sender) {
+        f->link = pn_sender(ssn, "BenchEngineSender");
+        pn_terminus_set_address(pn_link_target(f->link), f->address);
+    } else {
+        f->link = pn_receiver(ssn, "BenchEngineReceiver");
+        pn_terminus_set_address(pn_link_source(f->link), f->address);
+        int window = f->credit_window;
+        if (f->count && f->count < (uint64_t) window)
+            window = (int) f->count;
+        pn_link_flow(f->link, window);
+    }
+    pn_link_open(f->link);
+}
+
+
+// Wake every open rate limited sender, returns false when none is left
+static bool pace_tick(bench_engine_t *e)
+{
+    bool active = false;
+    pthread_mutex_lock(&e->lock);
+    for (int i = 0; i < e->nflows; ++i) {
+        flow_t *f = e->flows[i];
+        if (f->is_sender && f->rate > 0 && !f->closed) {
+            pn_connection_wake(f->conn);
+            active = true;
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+    return active;
+}
+
+
+// Returns false when the calling thread should exit
+static bool handle(bench_engine_t *e, pn_event_t *event)
+{
+    pn_connection_t *conn = pn_event_connection(event);
+    flow_t *f = conn ? (flow_t *) pn_connection_get_context(conn) : NULL;
+
+    switch (pn_event_type(event)) {
+
+    case PN_CONNECTION_INIT:
+        connection_init(f);
+        break;
+
+    case PN_CONNECTION_WAKE:
+        if (__atomic_load_n(&e->stopping, __ATOMIC_RELAXED))
+            flow_close(f);
+        else if (f->is_sender)
+            sender_pump(f);
+        break;
+
+    case PN_LINK_FLOW:
+        if (f->is_sender)
+            sender_pump(f);
+        break;
+
+    case PN_DELIVERY: {
+        pn_delivery_t *dlv = pn_event_delivery(event);
+        if (f->is_sender) {
+            if (pn_delivery_updated(dlv))
+                sender_outcome(f, dlv);
+        } else if (pn_delivery_readable(dlv) && !pn_delivery_partial(dlv)) {
+            receiver_deliver(f, dlv);
+        }
+    } break;
+
+    case PN_LINK_REMOTE_CLOSE:
+        flow_error(f, "link closed", pn_link_remote_condition(pn_event_link(event)));
+        flow_close(f);
+        break;
+
+    case PN_CONNECTION_REMOTE_CLOSE:
+        flow_error(f, "connection closed", pn_connection_remote_condition(conn));
+        flow_close(f);
+        break;
+
+    case PN_TRANSPORT_CLOSED:
+        if (!f->finished && !__atomic_load_n(&e->stopping, __ATOMIC_RELAXED))
+            flow_error(f, "transport closed", pn_transport_condition(pn_event_transport(event)));
+        pthread_mutex_lock(&e->lock);
+        f->closed = true;
+        f->conn = NULL;
+        f->link = NULL;
+        pthread_mutex_unlock(&e->lock);
+        FLOW_SET(f, done, 1);
+        break;
+
+    case PN_PROACTOR_TIMEOUT:
+        if (pace_tick(e))
+            pn_proactor_set_timeout(e->proactor, BENCH_TICK_MSEC);
+        break;
+
+    case PN_PROACTOR_INACTIVE:
+        // every connection is closed, release the other threads
+        for (int i = 1; i < e->nthreads; ++i)
+            pn_proactor_interrupt(e->proactor);
+        return false;
+
+    case PN_PROACTOR_INTERRUPT:
+        return false;
+
+    default:
+        break;
+    }
+    return true;
+}
+
+
+static void *engine_thread(void *arg)
+{
+    bench_engine_t *e = (bench_engine_t *) arg;
+    bool running = true;
+    while (running) {
+        pn_event_batch_t *events = pn_proactor_wait(e->proactor);
+        pn_event_t *event;
+        while ((event = pn_event_batch_next(events))) {
+            if (!handle(e, event))
+                running = false;
+        }
+        pn_proactor_done(e->proactor, events);
+    }
+
+    pthread_mutex_lock(&e->lock);
+    if (--e->running_threads == 0)
+        pthread_cond_broadcast(&e->idle);
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+
+int bench_engine_version(void)
+{
+    return BENCH_ENGINE_VERSION;
+}
+
+
+bench_engine_t *bench_engine(const char *container_name, int threads)
+{
+    bench_engine_t *e = calloc(1, sizeof(bench_engine_t));
+    e->container_name = strdup(container_name ? container_name : "BenchEngine");
+    e->nthreads = threads > 0 ? threads : 1;
+    e->proactor = pn_proactor();
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->idle, NULL);
+    return e;
+}
+
+
+static flow_t *add_flow(bench_engine_t *e, const char *host_port, const char *address, uint64_t count)
+{
+    if (e->started || !host_port || !address)
+        return NULL;
+    flow_t *f = calloc(1, sizeof(flow_t));
+    f->engine = e;
+    f->id = e->nflows;
+    f->host_port = strdup(host_port);
+    f->address = strdup(address);
+    f->count = count;
+    e->flows = realloc(e->flows, (e->nflows + 1) * sizeof(flow_t *));
+    e->flows[e->nflows++] = f;
+    return f;
+}
+
+
+int bench_engine_sender(bench_engine_t *e, const char *host_port, const char *address,
+                        uint64_t count, int body_size, double rate, int presettle)
+{
+    flow_t *f = add_flow(e, host_port, address, count);
+    if (!f)
+        return -1;
+    f->is_sender = true;
+    f->rate = rate > 0 ? rate : 0;
+    f->presettle = !!presettle;
+    if (encode_payload(f, body_size > 0 ? body_size : 0)) {
+        fprintf(stderr, "bench-engine: cannot encode the message for %s\n", address);
+        return -1;  // stays in the table, never started
+    }
+    if (f->rate > 0)
+        e->paced = true;
+    return f->id;
+}
+
+
+int bench_engine_receiver(bench_engine_t *e, const char *host_port, const char *address,
+                          uint64_t count, int credit_window, int latency)
+{
+    flow_t *f = add_flow(e, host_port, address, count);
+    if (!f)
+        return -1;
+    f->credit_window = credit_window > 0 ? credit_window : 1000;
+    f->latency = !!latency;
+    f->rx_buffer_size = 64 * 1024;
+    f->rx_buffer = malloc(f->rx_buffer_size);
+    f->rx_message = pn_message();
+    return f->id;
+}
+
+
+int bench_engine_start(bench_engine_t *e)
+{
+    if (e->started || e->nflows == 0)
+        return -1;
+    for (int i = 0; i < e->nflows; ++i) {
+        if (e->flows[i]->is_sender && !e->flows[i]->encoded_size)
+            return -1;
+    }
+
+    e->started = true;
+    for (int i = 0; i < e->nflows; ++i) {
+        flow_t *f = e->flows[i];
+        f->conn = pn_connection();
+        pn_connection_set_context(f->conn, f);
+        pn_proactor_connect2(e->proactor, f->conn, NULL, f->host_port);
+    }
+    if (e->paced)
+        pn_proactor_set_timeout(e->proactor, BENCH_TICK_MSEC);
+
+    e->threads = calloc(e->nthreads, sizeof(pthread_t));
+    e->running_threads = e->nthreads;
+    for (int i = 0; i < e->nthreads; ++i) {
+        int rc = pthread_create(&e->threads[i], NULL, engine_thread, e);
+        if (rc) {
+            fprintf(stderr, "bench-engine: pthread_create failed: %s\n", strerror(rc));
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+
+int bench_engine_wait(bench_engine_t *e, double timeout)
+{
+    if (!e->started)
+        return 1;
+
+    pthread_mutex_lock(&e->lock);
+    if (timeout < 0) {
+        while (e->running_threads > 0)
+            pthread_cond_wait(&e->idle, &e->lock);
+    } else {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) timeout;
+        deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (e->running_threads > 0) {
+            if (pthread_cond_timedwait(&e->idle, &e->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+    bool done = e->running_threads == 0;
+    pthread_mutex_unlock(&e->lock);
+
+    if (done && !e->joined) {
+        for (int i = 0; i < e->nthreads; ++i)
+            pthread_join(e->threads[i], NULL);
+        e->joined = true;
+    }
+    return done;
+}
+
+
+void bench_engine_stop(bench_engine_t *e)
+{
+    pthread_mutex_lock(&e->lock);
+    __atomic_store_n(&e->stopping, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < e->nflows; ++i) {
+        flow_t *f = e->flows[i];
+        if (e->started && !f->closed)
+            pn_connection_wake(f->conn);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+
+int bench_engine_flows(const bench_engine_t *e)
+{
+    return e->nflows;
+}
+
+
+void bench_engine_flow_stats(const bench_engine_t *e, int flow, bench_flow_stats_t *out)
+{
+    if (flow < 0 || flow >= e->nflows) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    const uint64_t *src = (const uint64_t *) &e->flows[flow]->stats;
+    uint64_t *dst = (uint64_t *) out;
+    for (size_t i = 0; i < sizeof(bench_flow_stats_t) / sizeof(uint64_t); ++i)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+
+const char *bench_engine_flow_error(const bench_engine_t *e, int flow)
+{
+    if (flow < 0 || flow >= e->nflows)
+        return NULL;
+    flow_t *f = e->flows[flow];
+    return __atomic_load_n(&f->stats.failed, __ATOMIC_ACQUIRE) ? f->error : NULL;
+}
+
+
+void bench_engine_free(bench_engine_t *e)
+{
+    if (!e)
+        return;
+    if (e->started) {
+        bench_engine_stop(e);
+        bench_engine_wait(e, -1);
+    }
+    for (int i = 0; i < e->nflows; ++i) {
+        flow_t *f = e->flows[i];
+        free(f->host_port);
+        free(f->address);
+        free(f->encoded);
+        free(f->rx_buffer);
+        if (f->rx_message)
+            pn_message_free(f->rx_message);
+        free(f);
+    }
+    pn_proactor_free(e->proactor);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->idle);
+    free(e->flows);
+    free(e->threads);
+    free(e->container_name);
+    free(e);
+}
@@ -0,0 +1,113 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+/* Send/receive engine of the benchmark clients as a library
+ * (libbench-engine.so), driven from Python by ../bench_engine.py.
+ *
+ * An engine owns a proactor and a pool of threads.  Each flow - a
+ * sender or a receiver - has its own connection, so every flow is only
+ * ever serviced by one thread at a time and its counters have a single
+ * writer.  All per-message work (pre-encoded payload, timestamping,
+ * credit, outcomes, latency histogram) happens in the engine threads;
+ * the caller only sets up the flows and reads the counters.
+ *
+ * Usage:
+ *   bench_engine_t *e = bench_engine("Scenario", 4);
+ *   int rx = bench_engine_receiver(e, "127.0.0.1:5672", "q1", 100000, 1000, 1);
+ *   int tx = bench_engine_sender(e, "127.0.0.1:5672", "q1", 100000, 100, 0.0, 0);
+ *   bench_engine_start(e);
+ *   while (!bench_engine_wait(e, 1.0))
+ *       bench_engine_flow_stats(e, rx, &stats);
+ *   bench_engine_free(e);
+ *
+ * The bench_flow_stats_t layout is shared with the Python binding,
+ * bump BENCH_ENGINE_VERSION if it changes.
+ */
+
+#ifndef BENCH_ENGINE_H
+#define BENCH_ENGINE_H
+
+#include <stdint.h>
+
+#include "live-stats.h"
+
+#define BENCH_ENGINE_VERSION 1
+
+typedef struct bench_engine_t bench_engine_t;
+
+// every field is a uint64_t so snapshots can be copied word by word
+typedef struct bench_flow_stats_t {
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t accepted;
+    uint64_t released;
+    uint64_t rejected;
+    uint64_t modified;
+    uint64_t credit_stalls;
+    uint64_t stall_usec;            // total time without credit
+    uint64_t first_usec;            // first message sent/received (monotonic)
+    uint64_t last_usec;             // last message sent/received (monotonic)
+    uint64_t done;                  // flow has finished and its connection closed
+    uint64_t failed;                // flow ended with an error
+
+    uint64_t latency_count;
+    uint64_t latency_sum_usec;
+    uint64_t latency_max_usec;
+    uint64_t latency_hist[LIVE_STATS_BUCKETS];  // same buckets as live-stats.h
+} bench_flow_stats_t;
+
+int bench_engine_version(void);
+
+// threads: number of proactor threads servicing the flows
+bench_engine_t *bench_engine(const char *container_name, int threads);
+
+// Add flows before bench_engine_start().  Both return the flow id or -1.
+//
+// count:     messages to send/receive, 0 == until bench_engine_stop()
+// body_size: payload bytes, the message body is [timestamp, binary]
+//            like sender.c so receiver.c can measure latency too
+// rate:      msgs/sec, 0 == as fast as credit allows
+// latency:   decode each message for its timestamp
+int bench_engine_sender(bench_engine_t *e, const char *host_port, const char *address,
+                        uint64_t count, int body_size, double rate, int presettle);
+int bench_engine_receiver(bench_engine_t *e, const char *host_port, const char *address,
+                          uint64_t count, int credit_window, int latency);
+
+int bench_engine_start(bench_engine_t *e);
+
+// Wait up to timeout seconds (< 0 forever) for every flow to finish.
+// Returns 1 when all flows are done, 0 on timeout.
+int bench_engine_wait(bench_engine_t *e, double timeout);
+
+// Ask every flow to close its connection, bench_engine_wait() for it.
+void bench_engine_stop(bench_engine_t *e);
+
+int bench_engine_flows(const bench_engine_t *e);
+void bench_engine_flow_stats(const bench_engine_t *e, int flow, bench_flow_stats_t *out);
+
+// NULL unless the flow failed
+const char *bench_engine_flow_error(const bench_engine_t *e, int flow);
+
+// stops the engine if it is still running
+void bench_engine_free(bench_engine_t *e);
+
+#endif
@@ -40,6 +40,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 #define BOOL2STR(b) ((b)?"true":"false")
 
 #define BODY_SIZE_SMALL  100
@@ -294,6 +296,7 @@ static bool send_msg(pn_link_t *sender)
             now_timespec(&end);
             int64_t diff = diff_timespec_usec(&start_stall, &end);
             if (diff > 0) {
+                live_stats_stall();
                 stall_count += 1;
                 total_stall += (uint64_t)diff;
                 sum_of_squares += (uint64_t)(diff * diff);
@@ -323,6 +326,9 @@ static bool send_msg(pn_link_t *sender)
         } else {
             pn_delivery_settle(delivery);
         }
+        live_stats_sent(encoded_data_size);
+        live_stats_credit(pn_link_credit(sender));
+        live_stats_outstanding(pending_ack ? 1 : 0);
 
         if (limit && count == limit) {
             stop_ts = now_usec();
@@ -403,6 +409,10 @@ static void event_handler(pn_handler_t *handler,
                 // fprintf(stderr, "Message not accepted - code: 0x%lX\n", (unsigned long)rs);
                 break;
             }
+            if (rs != PN_RECEIVED) {
+                live_stats_outcome(rs);
+                live_stats_outstanding(0);
+            }
 
             if (!limit || count < limit) {
                 if (!pending_ack)
@@ -477,6 +487,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("sender", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
@@ -45,6 +45,8 @@
 #include "proton/handlers.h"
 #include "proton/transport.h"
 
+#include "live-stats.h"
+
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
 const size_t write_size = 64;
@@ -246,6 +248,7 @@ static void event_handler(pn_handler_t *handler,
             }
         }
 
+        live_stats_credit(pn_link_credit(sender));
         if (dlv && pn_session_outgoing_bytes(pn_link_session(sender)) < 1024) {
             //fprintf(stdout, "Sending chunk on link %s\n", pn_link_name(sender));
 
@@ -264,6 +267,8 @@ static void event_handler(pn_handler_t *handler,
             if (ctx->offset == encoded_data_size) {
                 fprintf(stdout, "Message send finished on link %s\n", pn_link_name(sender));
                 pn_link_advance(sender);
+                live_stats_sent(encoded_data_size);
+                live_stats_outstanding(count - acked);
             }
         }
     } break;
@@ -293,6 +298,8 @@ static void event_handler(pn_handler_t *handler,
                 else
                     ++not_accepted;
                 pn_delivery_settle(dlv);
+                live_stats_outcome(rs);
+                live_stats_outstanding(count - acked);
                 break;
             }
 
@@ -359,6 +366,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("sender", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
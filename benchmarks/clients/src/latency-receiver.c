@@ -37,6 +37,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 /* Message latency receiver for use with latency-sender */
 
 #define MAX_SIZE (1048576 * 2)  // large enough to buffer max message from latency-sender
@@ -161,6 +163,7 @@ static void event_handler(pn_handler_t *handler,
                     avail -= len;
                 }
             } while (len > 0);
+            live_stats_received(MAX_SIZE - avail);
 
             if (len != PN_EOS) {
                 fprintf(stderr,
@@ -211,6 +214,7 @@ static void event_handler(pn_handler_t *handler,
             if (latency > max_latency) max_latency = latency;
             total_latency += latency;
             sum_of_squares += (latency * latency);
+            live_stats_latency(latency);
 
             if (limit && count == limit) {
                 stop = true;
@@ -227,6 +231,7 @@ static void event_handler(pn_handler_t *handler,
                     pn_link_flow(pn_link, credit_window - pn_link_credit(pn_link));
                 }
             }
+            live_stats_credit(pn_link_credit(pn_link));
         }
     } break;
 
@@ -278,6 +283,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("receiver", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
@@ -41,6 +41,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 #define BOOL2STR(b) ((b)?"true":"false")
 
 #define BODY_SIZE_SMALL  100
@@ -218,6 +220,9 @@ static bool send_msg(pn_link_t *sender)
         }
         pn_link_advance(sender);
         pending_ack = true;
+        live_stats_sent(encoded_data_size);
+        live_stats_credit(pn_link_credit(sender));
+        live_stats_outstanding(1);
         return true;
     }
 
@@ -276,6 +281,8 @@ static void event_handler(pn_handler_t *handler,
                 else
                     ++not_accepted;
                 pn_delivery_settle(dlv);
+                live_stats_outcome(rs);
+                live_stats_outstanding(0);
 
                 // update statistics
                 const uint64_t latency = ack_ts - send_ts;
@@ -283,6 +290,7 @@ static void event_handler(pn_handler_t *handler,
                 if (latency > latency_max) latency_max = latency;
                 latency_total += latency;
                 latency_sum_of_squares += latency * latency;
+                live_stats_latency(latency);
 
                 // check if done or send more
                 if (!limit || count < limit) {
@@ -353,6 +361,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("sender", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
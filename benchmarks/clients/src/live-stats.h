@@ -0,0 +1,281 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+/* Live counters for long running benchmark clients.
+ *
+ * When the BENCH_LIVE_STATS environment variable is set the client
+ * publishes its counters in the POSIX shared memory segment
+ * /bench-stats.<pid> (i.e. /dev/shm/bench-stats.<pid>) so an external
+ * monitor (see ../live-monitor) can watch many clients at once while
+ * they run. Otherwise the counters live in private memory and nothing
+ * is published.
+ *
+ * The client thread is the only writer. Updates are plain relaxed
+ * atomic stores into the mapped segment - no locks and no system calls
+ * on the send/receive path. A reader may see counters from slightly
+ * different instants, which is fine for rate graphs.
+ *
+ * If BENCH_RESULT_FILE is set the final counters, rates and latency
+ * histogram are also written there as JSON when the client exits.
+ * ../bench-run uses this to build its results store.
+ *
+ * The layout is fixed (see live-monitor), bump LIVE_STATS_VERSION if
+ * it changes.
+ */
+
+#ifndef LIVE_STATS_H
+#define LIVE_STATS_H
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proton/disposition.h"
+
+#define LIVE_STATS_MAGIC   0x42535453  // "STSB"
+#define LIVE_STATS_VERSION 2
+
+// Latency histogram: values below 8 usecs get their own bucket, above
+// that each power of two is split in 8 linear sub-buckets (max 12.5%
+// error) so percentiles are usable for run to run comparisons.
+#define LIVE_STATS_SUB_BITS 3
+#define LIVE_STATS_SUB      (1 << LIVE_STATS_SUB_BITS)
+#define LIVE_STATS_BUCKETS  ((64 - LIVE_STATS_SUB_BITS + 1) * LIVE_STATS_SUB)
+
+typedef struct live_stats_t {
+    uint32_t magic;
+    uint32_t version;
+    int32_t  pid;
+    int32_t  running;               // cleared at exit
+    char     name[64];              // container name
+    char     role[16];              // "sender", "receiver", ...
+    uint64_t start_usec;            // wallclock
+    uint64_t first_usec;            // first message sent/received (monotonic)
+    uint64_t last_usec;             // last message sent/received (monotonic)
+
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t accepted;
+    uint64_t released;
+    uint64_t rejected;
+    uint64_t modified;
+    uint64_t credit_stalls;
+
+    int64_t  credit;                // current link credit
+    int64_t  outstanding;           // unsettled deliveries
+
+    uint64_t latency_count;
+    uint64_t latency_sum_usec;
+    uint64_t latency_max_usec;
+    uint64_t latency_hist[LIVE_STATS_BUCKETS];
+} live_stats_t;
+
+static live_stats_t  _live_stats_private;
+static live_stats_t *live_stats = &_live_stats_private;
+static char          _live_stats_shm_name[64];
+static const char   *_live_stats_result_file;
+
+#define LIVE_STATS_SET(FIELD, VALUE) __atomic_store_n(&live_stats->FIELD, (VALUE), __ATOMIC_RELAXED)
+#define LIVE_STATS_ADD(FIELD, VALUE) LIVE_STATS_SET(FIELD, live_stats->FIELD + (VALUE))
+
+
+static inline int live_stats_bucket(uint64_t usec)
+{
+    if (usec < LIVE_STATS_SUB)
+        return (int) usec;
+    int msb = 63 - __builtin_clzll(usec);
+    int sub = (int) (usec >> (msb - LIVE_STATS_SUB_BITS)) & (LIVE_STATS_SUB - 1);
+    return (msb - LIVE_STATS_SUB_BITS + 1) * LIVE_STATS_SUB + sub;
+}
+
+// coarse clock is read from the vDSO, no system call
+static inline uint64_t _live_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void _live_stats_activity(void)
+{
+    uint64_t now = _live_stats_now();
+    if (!live_stats->first_usec)
+        LIVE_STATS_SET(first_usec, now);
+    LIVE_STATS_SET(last_usec, now);
+}
+
+
+// a JSON string: container names come from the command line
+static void _live_stats_write_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char *) str; *c; ++c) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+static void _live_stats_write_result(void)
+{
+    FILE *f = fopen(_live_stats_result_file, "w");
+    if (!f) {
+        perror("cannot write BENCH_RESULT_FILE");
+        return;
+    }
+    const live_stats_t *s = live_stats;
+    double secs = (s->last_usec - s->first_usec) / 1000000.0;
+    fprintf(f, "{\"version\": %d, \"pid\": %d, \"name\": ", LIVE_STATS_VERSION, s->pid);
+    _live_stats_write_string(f, s->name);
+    fprintf(f, ", \"role\": ");
+    _live_stats_write_string(f, s->role);
+    fprintf(f, ",\n");
+    fprintf(f, " \"duration_sec\": %.6f,\n", secs);
+    fprintf(f, " \"msgs_out\": %"PRIu64", \"bytes_out\": %"PRIu64", \"msgs_in\": %"PRIu64", \"bytes_in\": %"PRIu64",\n",
+            s->msgs_out, s->bytes_out, s->msgs_in, s->bytes_in);
+    fprintf(f, " \"msgs_out_per_sec\": %.3f, \"msgs_in_per_sec\": %.3f,\n",
+            secs > 0 ? s->msgs_out / secs : 0.0, secs > 0 ? s->msgs_in / secs : 0.0);
+    fprintf(f, " \"accepted\": %"PRIu64", \"released\": %"PRIu64", \"rejected\": %"PRIu64", \"modified\": %"PRIu64", \"credit_stalls\": %"PRIu64",\n",
+            s->accepted, s->released, s->rejected, s->modified, s->credit_stalls);
+    fprintf(f, " \"latency_count\": %"PRIu64", \"latency_sum_usec\": %"PRIu64", \"latency_max_usec\": %"PRIu64",\n",
+            s->latency_count, s->latency_sum_usec, s->latency_max_usec);
+    // sparse: {"bucket": count}
+    fprintf(f, " \"latency_hist\": {");
+    const char *sep = "";
+    for (int i = 0; i < LIVE_STATS_BUCKETS; ++i) {
+        if (s->latency_hist[i]) {
+            fprintf(f, "%s\"%d\": %"PRIu64, sep, i, s->latency_hist[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(f, "}}\n");
+    fclose(f);
+}
+
+
+static void _live_stats_close(void)
+{
+    LIVE_STATS_SET(running, 0);
+    if (_live_stats_result_file)
+        _live_stats_write_result();
+    if (_live_stats_shm_name[0])
+        shm_unlink(_live_stats_shm_name);
+}
+
+
+// Call once after the command line is parsed
+//
+static inline void live_stats_open(const char *role, const char *name)
+{
+    if (getenv("BENCH_LIVE_STATS")) {
+        snprintf(_live_stats_shm_name, sizeof(_live_stats_shm_name), "/bench-stats.%d", (int) getpid());
+        int fd = shm_open(_live_stats_shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(live_stats_t)) != 0) {
+            perror("live stats shm_open failed");
+            exit(1);
+        }
+        void *ptr = mmap(0, sizeof(live_stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            perror("live stats mmap failed");
+            exit(1);
+        }
+        live_stats = (live_stats_t *) ptr;
+    }
+    _live_stats_result_file = getenv("BENCH_RESULT_FILE");
+    if (_live_stats_shm_name[0] || _live_stats_result_file)
+        atexit(_live_stats_close);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(live_stats, 0, sizeof(live_stats_t));
+    live_stats->version = LIVE_STATS_VERSION;
+    live_stats->pid = (int32_t) getpid();
+    live_stats->running = 1;
+    strncpy(live_stats->name, name, sizeof(live_stats->name) - 1);
+    strncpy(live_stats->role, role, sizeof(live_stats->role) - 1);
+    live_stats->start_usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    // publish the magic last, the monitor ignores segments without it
+    __atomic_store_n(&live_stats->magic, LIVE_STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+static inline void live_stats_sent(size_t bytes)
+{
+    _live_stats_activity();
+    LIVE_STATS_ADD(msgs_out, 1);
+    LIVE_STATS_ADD(bytes_out, bytes);
+}
+
+static inline void live_stats_received(size_t bytes)
+{
+    _live_stats_activity();
+    LIVE_STATS_ADD(msgs_in, 1);
+    LIVE_STATS_ADD(bytes_in, bytes);
+}
+
+// terminal outcome of a sent message
+static inline void live_stats_outcome(uint64_t disposition)
+{
+    switch (disposition) {
+    case PN_ACCEPTED: LIVE_STATS_ADD(accepted, 1); break;
+    case PN_RELEASED: LIVE_STATS_ADD(released, 1); break;
+    case PN_REJECTED: LIVE_STATS_ADD(rejected, 1); break;
+    default:          LIVE_STATS_ADD(modified, 1); break;
+    }
+}
+
+static inline void live_stats_credit(int credit)
+{
+    LIVE_STATS_SET(credit, credit);
+}
+
+static inline void live_stats_outstanding(int64_t outstanding)
+{
+    LIVE_STATS_SET(outstanding, outstanding);
+}
+
+static inline void live_stats_stall(void)
+{
+    LIVE_STATS_ADD(credit_stalls, 1);
+}
+
+static inline void live_stats_latency(int64_t usec)
+{
+    if (usec < 0) usec = 0;
+    LIVE_STATS_ADD(latency_hist[live_stats_bucket((uint64_t) usec)], 1);
+    LIVE_STATS_ADD(latency_count, 1);
+    LIVE_STATS_ADD(latency_sum_usec, (uint64_t) usec);
+    if ((uint64_t) usec > live_stats->latency_max_usec)
+        LIVE_STATS_SET(latency_max_usec, (uint64_t) usec);
+}
+
+#endif
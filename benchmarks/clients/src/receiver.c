@@ -37,6 +37,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 
 #define MAX_SIZE (1024 * 64)
 char in_buffer[MAX_SIZE];
@@ -144,6 +146,7 @@ static void event_handler(pn_handler_t *handler,
             // A full message has arrived
             if (!start_ts) start_ts = now_usec();
             count += 1;
+            live_stats_received(pn_delivery_pending(dlv));
             if (check_latency && pn_delivery_pending(dlv) < MAX_SIZE) {
                 // try to decode the message to get at the timestamp
                 size_t len = pn_link_recv(pn_delivery_link(dlv), in_buffer, MAX_SIZE);
@@ -166,6 +169,7 @@ static void event_handler(pn_handler_t *handler,
                                     total_latency += latency;
                                     sum_of_squares += (latency * latency);
                                     latency_count += 1;
+                                    live_stats_latency(latency);
                                 }
                             }
                         }
@@ -191,6 +195,7 @@ static void event_handler(pn_handler_t *handler,
                     pn_link_flow(pn_link, credit_window - pn_link_credit(pn_link));
                 }
             }
+            live_stats_credit(pn_link_credit(pn_link));
         }
     } break;
 
@@ -248,6 +253,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("receiver", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
@@ -40,6 +40,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 #define BOOL2STR(b) ((b)?"true":"false")
 
 #define BODY_SIZE_SMALL  100
@@ -312,6 +314,7 @@ static void event_handler(pn_handler_t *handler,
                 now_timespec(&end);
                 int64_t diff = diff_timespec_usec(&start_stall, &end);
                 if (diff > 0) {
+                    live_stats_stall();
                     stall_count += 1;
                     total_stall += (uint64_t)diff;
                     sum_of_squares += (uint64_t)(diff * diff);
@@ -337,6 +340,7 @@ static void event_handler(pn_handler_t *handler,
 
                 pn_link_send(sender, encode_buffer, encoded_data_size);
                 pn_link_advance(sender);
+                live_stats_sent(encoded_data_size);
                 if (presettle) {
                     pn_delivery_settle(delivery);
                     if (limit && count == limit) {
@@ -347,6 +351,9 @@ static void event_handler(pn_handler_t *handler,
                 }
             }
 
+            live_stats_credit(credit);
+            live_stats_outstanding(presettle ? 0 : count - acked);
+
             if (limit && count == limit) {   // done
                 stop_ts = now_usec();
             } else if (credit == 0) {
@@ -397,6 +404,10 @@ static void event_handler(pn_handler_t *handler,
                 fprintf(stderr, "Message not accepted - code: 0x%lX\n", (unsigned long)rs);
                 break;
             }
+            if (rs != PN_RECEIVED) {
+                live_stats_outcome(rs);
+                live_stats_outstanding(count - acked);
+            }
 
             if (limit && acked == limit) {
                 // initiate clean shutdown of the endpoints
@@ -467,6 +478,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("sender", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
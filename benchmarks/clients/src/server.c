@@ -33,6 +33,8 @@
 #include <signal.h>
 #include <inttypes.h>
 
+#include "live-stats.h"
+
 
 #define BOOL2STR(b) ((b)?"true":"false")
 
@@ -145,7 +147,9 @@ static void link_send(pn_event_t *e)
         if (presettle) {
             pn_delivery_settle(delivery);
         }
+        live_stats_sent(encoded_data_size);
     }
+    live_stats_credit(pn_link_credit(sender));
 }
 
 
@@ -157,10 +161,13 @@ static void link_receive(pn_event_t *e)
     if (pn_delivery_readable(dlv)) {
 
         ssize_t rc = PN_EOS;
+        size_t rx_bytes = 0;
         while (pn_delivery_pending(dlv) > 0) {
             rc = pn_link_recv(link, in_buffer, RX_MAX_SIZE);
             if (rc == PN_EOS)
                 break;
+            if (rc > 0)
+                rx_bytes += rc;
         }
 
         if (!pn_delivery_partial(dlv)) {
@@ -168,6 +175,7 @@ static void link_receive(pn_event_t *e)
             pn_delivery_update(dlv, PN_ACCEPTED);
             pn_delivery_settle(dlv);  // dlv is now freed
             rx_count += 1;
+            live_stats_received(rx_bytes);
         }
 
         if (pn_link_credit(link) <= credit_window/2) {
@@ -193,6 +201,7 @@ static void delivery_updated(pn_delivery_t *dlv)
         fprintf(stderr, "Message not accepted - code: 0x%lX\n", (unsigned long)rs);
         // fallthough
     case PN_ACCEPTED:
+        live_stats_outcome(rs);
         pn_delivery_settle(dlv);
         break;
     }
@@ -320,6 +329,8 @@ int main(int argc, char **argv)
         }
     }
 
+    live_stats_open("server", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
@@ -43,6 +43,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 
 bool stop = false;
 
@@ -124,12 +126,14 @@ static void handle_delivery(pn_delivery_t *dlv)
 
         pn_delivery_update(dlv, PN_ACCEPTED);
 
+        size_t msg_bytes = pn_delivery_pending(dlv);
         if (bytes_throughput) {
             ssize_t rc = 0;
             while ((rc = pn_link_recv(pn_delivery_link(dlv), &scratch[0], sizeof(scratch))) != PN_EOS) {
                 total_bytes += rc;
             }
         }
+        live_stats_received(msg_bytes);
 
         pn_delivery_settle(dlv);  // dlv is now freed
 
@@ -149,6 +153,7 @@ static void handle_delivery(pn_delivery_t *dlv)
                 pn_link_flow(pn_link, credit_window - pn_link_credit(pn_link));
             }
         }
+        live_stats_credit(pn_link_credit(pn_link));
     }
 }
 
@@ -326,6 +331,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("receiver", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
@@ -44,6 +44,8 @@
 #include "proton/event.h"
 #include "proton/handlers.h"
 
+#include "live-stats.h"
+
 #define BOOL2STR(b) ((b)?"true":"false")
 
 #define BODY_SIZE_SMALL  100
@@ -232,7 +234,10 @@ static void event_handler(pn_handler_t *handler,
             }
 
             pn_link_advance(sender);
+            live_stats_sent(encoded_data_size);
         }
+        live_stats_credit(pn_link_credit(sender));
+        live_stats_outstanding(count - acked);
     } break;
 
     case PN_DELIVERY: {
@@ -256,6 +261,8 @@ static void event_handler(pn_handler_t *handler,
                 else
                     ++not_accepted;
                 pn_delivery_settle(dlv);
+                live_stats_outcome(rs);
+                live_stats_outstanding(count - acked);
                 break;
             }
 
@@ -325,6 +332,8 @@ int main(int argc, char** argv)
         }
     }
 
+    live_stats_open("sender", container_name);
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
 
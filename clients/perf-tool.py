@@ -30,7 +30,7 @@ from proton import Message
 
 from utils import connect_socket
 from utils import get_host_port
-from utils import process_connection
+from utils import ConnectionLoop
 
 LOG = logging.getLogger()
 LOG.addHandler(logging.StreamHandler())
@@ -142,6 +142,9 @@ def main(argv=None):
                       help='Name of source/target node')
     parser.add_option("--count", type='int', default=100,
                       help='Send N messages (send forever if N==0)')
+    parser.add_option("--connections", type='int', default=1,
+                      help='Number of connections, each with a sender and'
+                      ' a receiver on node <node>.<i> when N > 1 [1]')
     parser.add_option("--debug", dest="debug", action="store_true",
                       help="enable debug logging")
     parser.add_option("--trace", dest="trace", action="store_true",
@@ -151,9 +154,9 @@ def main(argv=None):
     if opts.debug:
         LOG.setLevel(logging.DEBUG)
     host, port = get_host_port(opts.server)
-    my_socket = connect_socket(host, port)
 
-    # create AMQP Container, Connection, and SenderLink
+    # create AMQP Container, and a Connection, SenderLink and ReceiverLink
+    # per --connections, all serviced by one ConnectionLoop
     #
     container = pyngus.Container(uuid.uuid4().hex)
     conn_properties = {'hostname': host,
@@ -161,43 +164,67 @@ def main(argv=None):
     if opts.trace:
         conn_properties["x-trace-protocol"] = True
 
-    c_handler = ConnectionEventHandler()
-    connection = container.create_connection("perf_tool",
-                                             c_handler,
-                                             conn_properties)
-
-    r_handler = ReceiverHandler(opts.count, opts.count or 1000)
-    receiver = connection.create_receiver(opts.node, opts.node, r_handler)
-
-    s_handler = SenderHandler(opts.count)
-    sender = connection.create_sender(opts.node, opts.node, s_handler)
-
-    connection.open()
-    receiver.open()
-    while not receiver.active:
-        process_connection(connection, my_socket)
-
-    sender.open()
+    loop = ConnectionLoop()
+    sockets = []
+    connections = []
+    receivers = []
+    senders = []
+    r_handlers = []
+    s_handlers = []
+    for i in range(opts.connections):
+        node = opts.node
+        if opts.connections > 1:
+            node = "%s.%d" % (opts.node, i)
+        my_socket = connect_socket(host, port)
+        connection = container.create_connection("perf_tool-%d" % i,
+                                                 ConnectionEventHandler(),
+                                                 conn_properties)
+        r_handler = ReceiverHandler(opts.count, opts.count or 1000)
+        receiver = connection.create_receiver(node, node, r_handler)
+        s_handler = SenderHandler(opts.count)
+        sender = connection.create_sender(node, node, s_handler)
+        loop.add(connection, my_socket)
+        connection.open()
+        receiver.open()
+        sockets.append(my_socket)
+        connections.append(connection)
+        receivers.append(receiver)
+        senders.append(sender)
+        r_handlers.append(r_handler)
+        s_handlers.append(s_handler)
+
+    loop.run(until=lambda: all(r.active for r in receivers))
+
+    for sender in senders:
+        sender.open()
 
     # Run until all messages transfered
-    while not sender.closed or not receiver.closed:
-        process_connection(connection, my_socket)
-    connection.close()
-    while not connection.closed:
-        process_connection(connection, my_socket)
-
-    thru = s_handler.calls / (s_handler.stop_time - s_handler.start_time)
-    ack = s_handler.total_ack_latency / s_handler.calls
-    lat = r_handler.tx_total_latency / r_handler.receives
-    print("Stats:\n"
+    loop.run(until=lambda: all(s.closed and r.closed
+                               for s, r in zip(senders, receivers)))
+    for connection in connections:
+        connection.close()
+    loop.run(until=lambda: all(c.closed for c in connections))
+
+    calls = sum(h.calls for h in s_handlers)
+    receives = sum(h.receives for h in r_handlers)
+    start = min(h.start_time for h in s_handlers if h.start_time)
+    stop = max(h.stop_time or time.time() for h in s_handlers)
+    thru = calls / (stop - start)
+    ack = sum(h.total_ack_latency for h in s_handlers) / calls
+    lat = sum(h.tx_total_latency for h in r_handlers) / receives
+    print("Stats (%d connections):\n"
           " TX Avg Calls/Sec: %f  Ack Latency %f\n"
-          " RX Latency: %f" % (thru, ack, lat))
+          " RX Latency: %f" % (opts.connections, thru, ack, lat))
 
-    sender.destroy()
-    receiver.destroy()
-    connection.destroy()
+    for sender, receiver in zip(senders, receivers):
+        sender.destroy()
+        receiver.destroy()
+    for connection in connections:
+        connection.destroy()
     container.destroy()
-    my_socket.close()
+    loop.close()
+    for my_socket in sockets:
+        my_socket.close()
     return 0
 
 
@@ -27,7 +27,7 @@ import uuid
 import pyngus
 from utils import connect_socket
 from utils import get_host_port
-from utils import process_connection
+from utils import ConnectionLoop
 
 LOG = logging.getLogger()
 LOG.addHandler(logging.StreamHandler())
@@ -148,6 +148,8 @@ def main(argv=None):
     connection = container.create_connection("receiver",
                                              c_handler,
                                              conn_properties)
+    loop = ConnectionLoop()
+    loop.add(connection, my_socket)
     connection.open()
 
     target_address = opts.target_addr or uuid.uuid4().hex
@@ -163,7 +165,7 @@ def main(argv=None):
 
         # Poll connection until something arrives
         while not cb.done:
-            process_connection(connection, my_socket)
+            loop.run_once()
             if c_handler.error:
                 break
             if connection.closed:
@@ -187,11 +189,12 @@ def main(argv=None):
 
     # Poll connection until close completes:
     while not c_handler.error and not connection.closed:
-        process_connection(connection, my_socket)
+        loop.run_once()
 
     receiver.destroy()
     connection.destroy()
     container.destroy()
+    loop.close()
     my_socket.close()
     return 0
 
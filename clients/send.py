@@ -28,7 +28,7 @@ from proton import Message
 import pyngus
 from utils import connect_socket
 from utils import get_host_port
-from utils import process_connection
+from utils import ConnectionLoop
 from utils import SEND_STATUS
 
 LOG = logging.getLogger()
@@ -141,6 +141,8 @@ def main(argv=None):
     connection = container.create_connection("sender",
                                              c_handler,
                                              conn_properties)
+    loop = ConnectionLoop()
+    loop.add(connection, my_socket)
     connection.open()
 
     source_address = opts.source_addr or uuid.uuid4().hex
@@ -170,7 +172,7 @@ def main(argv=None):
 
         # Poll connection until SendCallback is invoked:
         while not cb.done:
-            process_connection(connection, my_socket)
+            loop.run_once()
             if c_handler.error:
                 break
             if connection.closed:
@@ -194,11 +196,12 @@ def main(argv=None):
 
     # Poll connection until close completes:
     while not c_handler.error and not connection.closed:
-        process_connection(connection, my_socket)
+        loop.run_once()
 
     sender.destroy()
     connection.destroy()
     container.destroy()
+    loop.close()
     my_socket.close()
     return 0
 
@@ -21,14 +21,13 @@
 
 import logging
 import optparse
-import select
 import sys
-import time
 import uuid
 
 from proton import Message
 import pyngus
 
+from utils import ConnectionLoop
 from utils import get_host_port
 from utils import server_socket
 
@@ -70,33 +69,6 @@ class SocketConnection(pyngus.ConnectionEventHandler):
                 self.connection is None or
                 self.connection.closed)
 
-    def fileno(self):
-        """Allows use of a SocketConnection in a select() call."""
-        return self.socket.fileno()
-
-    def process_input(self):
-        """Called when socket is read-ready"""
-        try:
-            pyngus.read_socket_input(self.connection, self.socket)
-        except Exception as e:
-            self._error = "Exception on socket read: %s" % str(e)
-            LOG.error(self._error)
-            self.connection.close_input()
-            self.connection.close()
-        self.connection.process(time.time())
-
-    def send_output(self):
-        """Called when socket is write-ready"""
-        try:
-            pyngus.write_socket_output(self.connection,
-                                       self.socket)
-        except Exception as e:
-            self._error = "Exception on socket write: %s" % str(e)
-            LOG.error(self._error)
-            self.connection.close_output()
-            self.connection.close()
-        self.connection.process(time.time())
-
     # ConnectionEventHandler callbacks:
 
     def connection_remote_closed(self, connection, reason):
@@ -283,89 +255,58 @@ def main(argv=None):
     container = pyngus.Container("Server")
     socket_connections = set()
 
+    loop = ConnectionLoop()
+
+    def accept(listener):
+        # new inbound connection request received,
+        # create a new SocketConnection for it:
+        client_socket, client_address = listener.accept()
+        # name = uuid.uuid4().hex
+        name = str(client_address)
+        conn_properties = {'x-server': True}
+        if opts.require_auth:
+            conn_properties['x-require-auth'] = True
+        if opts.sasl_mechs:
+            conn_properties['x-sasl-mechs'] = opts.sasl_mechs
+        if opts.sasl_cfg_name:
+            conn_properties['x-sasl-config-name'] = opts.sasl_cfg_name
+        if opts.sasl_cfg_dir:
+            conn_properties['x-sasl-config-dir'] = opts.sasl_cfg_dir
+        if opts.idle_timeout:
+            conn_properties["idle-time-out"] = opts.idle_timeout
+        if opts.trace:
+            conn_properties["x-trace-protocol"] = True
+        if opts.ca:
+            conn_properties["x-ssl-server"] = True
+            conn_properties["x-ssl-ca-file"] = opts.ca
+            conn_properties["x-ssl-verify-mode"] = "verify-cert"
+        if opts.ssl_cert_file:
+            conn_properties["x-ssl-server"] = True
+            identity = (opts.ssl_cert_file, opts.ssl_key_file, opts.ssl_key_password)
+            conn_properties["x-ssl-identity"] = identity
+
+        sconn = SocketConnection(container,
+                                 client_socket,
+                                 name,
+                                 conn_properties)
+        socket_connections.add(sconn)
+        loop.add(sconn.connection, client_socket)
+        LOG.debug("new connection created name=%s", name)
+
+    loop.add_listener(my_socket, accept)
+
     # Main loop: process I/O and timer events:
     #
     while True:
-        readers, writers, timers = container.need_processing()
-
-        # map pyngus Connections back to my SocketConnections:
-        readfd = [c.user_context for c in readers]
-        writefd = [c.user_context for c in writers]
-
-        timeout = None
-        if timers:
-            deadline = timers[0].next_tick  # [0] == next expiring timer
-            now = time.time()
-            timeout = 0 if deadline <= now else deadline - now
-
-        LOG.debug("select() start (t=%s)", str(timeout))
-        readfd.append(my_socket)
-        readable, writable, ignore = select.select(readfd, writefd,
-                                                   [], timeout)
-        LOG.debug("select() returned")
-
-        worked = set()
-        for r in readable:
-            if r is my_socket:
-                # new inbound connection request received,
-                # create a new SocketConnection for it:
-                client_socket, client_address = my_socket.accept()
-                # name = uuid.uuid4().hex
-                name = str(client_address)
-                conn_properties = {'x-server': True}
-                if opts.require_auth:
-                    conn_properties['x-require-auth'] = True
-                if opts.sasl_mechs:
-                    conn_properties['x-sasl-mechs'] = opts.sasl_mechs
-                if opts.sasl_cfg_name:
-                    conn_properties['x-sasl-config-name'] = opts.sasl_cfg_name
-                if opts.sasl_cfg_dir:
-                    conn_properties['x-sasl-config-dir'] = opts.sasl_cfg_dir
-                if opts.idle_timeout:
-                    conn_properties["idle-time-out"] = opts.idle_timeout
-                if opts.trace:
-                    conn_properties["x-trace-protocol"] = True
-                if opts.ca:
-                    conn_properties["x-ssl-server"] = True
-                    conn_properties["x-ssl-ca-file"] = opts.ca
-                    conn_properties["x-ssl-verify-mode"] = "verify-cert"
-                if opts.ssl_cert_file:
-                    conn_properties["x-ssl-server"] = True
-                    identity = (opts.ssl_cert_file, opts.ssl_key_file, opts.ssl_key_password)
-                    conn_properties["x-ssl-identity"] = identity
-
-                sconn = SocketConnection(container,
-                                         client_socket,
-                                         name,
-                                         conn_properties)
-                socket_connections.add(sconn)
-                LOG.debug("new connection created name=%s", name)
-
-            else:
-                assert isinstance(r, SocketConnection)
-                r.process_input()
-                worked.add(r)
-
-        for t in timers:
-            now = time.time()
-            if t.next_tick > now:
-                break
-            t.process(now)
-            sc = t.user_context
-            assert isinstance(sc, SocketConnection)
-            worked.add(sc)
-
-        for w in writable:
-            assert isinstance(w, SocketConnection)
-            w.send_output()
-            worked.add(w)
+        loop.run_once()
 
         closed = False
-        while worked:
-            sc = worked.pop()
+        for sc in list(socket_connections):
             # nuke any completed connections:
             if sc.closed:
                 socket_connections.discard(sc)
+                if sc.connection:
+                    loop.remove(sc.connection)
                 sc.destroy()
                 closed = True
             else:
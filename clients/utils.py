@@ -19,6 +19,8 @@
 """Utilities used by the Examples"""
 
 import errno
+import heapq
+import itertools
 import logging
 import re
 import socket
@@ -126,6 +128,164 @@ def process_connection(connection, my_socket):
             connection.close()
     return True
 
+
+class _LoopEntry(object):
+    __slots__ = ('connection', 'socket', 'fd', 'mask', 'deadline', 'on_closed')
+
+    def __init__(self, connection, my_socket, on_closed):
+        self.connection = connection
+        self.socket = my_socket
+        self.fd = my_socket.fileno()
+        self.mask = 0
+        self.deadline = None
+        self.on_closed = on_closed
+
+
+class ConnectionLoop(object):
+    """Handle I/O and Timers for many Connections from one epoll loop.
+
+    process_connection() select()s on a single socket, so a process can
+    only drive a few connections with it.  ConnectionLoop keeps every
+    socket registered with one epoll instance, only re-arms a socket when
+    its connection's interest changes, and keeps the connections'
+    next_tick deadlines in a single heap.  Each pass reads every ready
+    socket, runs process() once per connection that had I/O or an expired
+    timer, then writes all pending output in one go (without waiting for
+    EPOLLOUT first, the socket is nearly always writable).
+    """
+
+    def __init__(self, max_events=1024):
+        self._epoll = select.epoll()
+        self._entries = {}      # fd -> _LoopEntry
+        self._listeners = {}    # fd -> (socket, callback)
+        self._timers = []       # heap of (deadline, seq, _LoopEntry)
+        self._seq = itertools.count()
+        self._max_events = max_events
+
+    def __len__(self):
+        return len(self._entries)
+
+    def add(self, connection, my_socket, on_closed=None):
+        """Service connection over my_socket (non-blocking).  on_closed(connection)
+        is called once the connection has closed and been removed, the
+        caller remains the owner of the socket."""
+        my_socket.setblocking(0)
+        entry = _LoopEntry(connection, my_socket, on_closed)
+        self._epoll.register(entry.fd, 0)
+        self._entries[entry.fd] = entry
+
+    def remove(self, connection):
+        for entry in list(self._entries.values()):
+            if entry.connection is connection:
+                self._drop(entry)
+
+    def add_listener(self, my_socket, callback):
+        """Call callback(my_socket) whenever a listening socket is readable"""
+        self._epoll.register(my_socket.fileno(), select.EPOLLIN)
+        self._listeners[my_socket.fileno()] = (my_socket, callback)
+
+    def close(self):
+        self._epoll.close()
+
+    def _drop(self, entry):
+        self._entries.pop(entry.fd, None)
+        try:
+            self._epoll.unregister(entry.fd)
+        except (OSError, ValueError):
+            pass    # socket already closed
+        entry.deadline = None
+        if entry.on_closed:
+            entry.on_closed(entry.connection)
+
+    def _read(self, entry):
+        try:
+            pyngus.read_socket_input(entry.connection, entry.socket)
+        except Exception as e:
+            LOG.error("Socket error on read: %s", str(e))
+            entry.connection.close_input()
+            # make an attempt to cleanly close
+            entry.connection.close()
+
+    def _write(self, entry):
+        try:
+            pyngus.write_socket_output(entry.connection, entry.socket)
+        except Exception as e:
+            LOG.error("Socket error on write %s", str(e))
+            entry.connection.close_output()
+            # this may not help, but it won't hurt:
+            entry.connection.close()
+
+    def _update(self):
+        """Re-arm sockets whose interest changed and queue new deadlines"""
+        for entry in list(self._entries.values()):
+            connection = entry.connection
+            if connection.closed:
+                self._drop(entry)
+                continue
+            mask = 0
+            if connection.needs_input > 0:
+                mask |= select.EPOLLIN
+            if connection.has_output > 0:
+                mask |= select.EPOLLOUT
+            if mask != entry.mask:
+                self._epoll.modify(entry.fd, mask)
+                entry.mask = mask
+            deadline = connection.next_tick
+            if deadline and deadline != entry.deadline:
+                heapq.heappush(self._timers, (deadline, next(self._seq), entry))
+            entry.deadline = deadline
+
+    def run_once(self, timeout=None):
+        """Wait up to timeout seconds (None: until something happens) and
+        service every connection that is ready.  Returns False when there
+        are no connections left."""
+        self._update()
+        if not self._entries and not self._listeners:
+            return False
+
+        # drop heap entries superseded by a later next_tick
+        while self._timers and self._timers[0][2].deadline != self._timers[0][0]:
+            heapq.heappop(self._timers)
+        wait = -1 if timeout is None else timeout
+        if self._timers:
+            until = max(self._timers[0][0] - time.time(), 0)
+            wait = until if wait < 0 else min(wait, until)
+
+        events = self._epoll.poll(wait, self._max_events)
+
+        work = {}
+        for fd, mask in events:
+            entry = self._entries.get(fd)
+            if entry is None:
+                listener = self._listeners.get(fd)
+                if listener:
+                    listener[1](listener[0])
+                continue
+            if mask & (select.EPOLLIN | select.EPOLLHUP | select.EPOLLERR):
+                self._read(entry)
+            work[fd] = entry
+
+        now = time.time()
+        while self._timers and self._timers[0][0] <= now:
+            deadline, _, entry = heapq.heappop(self._timers)
+            if entry.deadline == deadline and entry.fd in self._entries:
+                work[entry.fd] = entry
+
+        for entry in work.values():
+            entry.connection.process(now)
+        for entry in work.values():
+            if entry.connection.has_output > 0:
+                self._write(entry)
+        return True
+
+    def run(self, until=None):
+        """Service the connections until they have all closed or until()
+        returns True"""
+        while not (until and until()):
+            if not self.run_once():
+                break
+
+
 # Map the send callback status to a string
 SEND_STATUS = {
     pyngus.SenderLink.ABORTED: "Aborted",
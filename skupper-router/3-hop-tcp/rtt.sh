@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+
+# Measure request/response round trip time through the routers with
+# rtt-client and echo-server (see ../clients, 'make install').
+# The routers must be running and nothing else may be listening on the
+# tcpConnector port (stop the iperf3 server started by setup.sh).
+#
+# usage: rtt.sh [connections] [outstanding] [request size] [duration]
+
+CONNECTIONS=${1:-10}
+OUTSTANDING=${2:-1}
+SIZE=${3:-64}
+DURATION=${4:-10}
+. "$(dirname "$0")/placement.sh"
+set -x
+
+$PLACE exec server -- echo-server -p 20002 &
+SERVER_PID=$!
+sleep 1
+
+$PLACE exec clients -- rtt-client -p 20001 -c $CONNECTIONS -n $OUTSTANDING -s $SIZE -d $DURATION -o rtt-histogram.csv
+
+kill $SERVER_PID
+wait $SERVER_PID
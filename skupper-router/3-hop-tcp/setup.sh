@@ -18,11 +18,13 @@
 # under the License.
 
 # Start routers and iperf3 server.
-# You may have to adjust the numa CPU mapping for your system.
+# CPU placement is computed for this machine, see placement.sh.
 # Use teardown.sh to clean up these processes
 
+. "$(dirname "$0")/placement.sh"
+
 rm -f *.log
-numactl --physcpubind=1,9,2,10 skrouterd -c ./skrouterd-tcp-ingress.conf &
-numactl --physcpubind=3,11,4,12 skrouterd -c ./skrouterd-tcp-egress.conf &
-numactl --physcpubind=5,13,6,14 skrouterd -c ./skrouterd-interior.conf &
-numactl --physcpubind=7 iperf3 --server --bind 127.0.0.1 --port 20002 &
+$PLACE exec ingress -- skrouterd -c ./skrouterd-tcp-ingress.conf &
+$PLACE exec egress -- skrouterd -c ./skrouterd-tcp-egress.conf &
+$PLACE exec interior -- skrouterd -c ./skrouterd-interior.conf &
+$PLACE exec server -- iperf3 --server --bind 127.0.0.1 --port 20002 &
@@ -22,3 +22,4 @@
 
 pkill -f skrouterd
 pkill -f iperf3
+pkill -f echo-server
@@ -22,13 +22,14 @@
 STREAMS=${1:-2}
 DURATION=${2:-7}
 RPIDS=`pidof skrouterd | tr " " ","`
+. "$(dirname "$0")/placement.sh"
 set -x
 
 # Uncomment ## lines for flamegraph recording
 ##perf record --freq 997 --call-graph fp --pid $RPIDS sleep $DURATION &
 ##PERF_PID=$!
 
-numactl --physcpubind=0 iperf3 --client 127.0.0.1 --port 20001 --parallel $STREAMS --time $DURATION --omit 2
+$PLACE exec clients -- iperf3 --client 127.0.0.1 --port 20001 --parallel $STREAMS --time $DURATION --omit 2
 
 ##wait $PERF_PID
 ##perf script report flamegraph
@@ -0,0 +1,30 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+
+# CPU placement shared by the scripts in this directory, sourced by them.
+# Every router, the server and the clients get physical cores (or L3
+# domains) of their own on whatever machine this runs on, see
+# ../../tools/cpu-place topology.  All scripts must use the same groups
+# so they agree on the plan.
+#
+# The edge routers run the TCP adaptor and get two cores each, the
+# interior routers only forward and get one: 8 physical cores in all
+# with at least one left for the clients.  --strict makes a smaller
+# machine fail instead of silently sharing cores between the groups.
+
+PLACE="$(dirname "${BASH_SOURCE[0]}")/../../tools/cpu-place -q -s -g ingress:2 -g egress:2 -g interior-in:1 -g interior-out:1 -g server:1 -g clients:rest"
@@ -0,0 +1,528 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// HTTP/1.x abort storm generator.
+//
+// Runs many concurrent HTTP/1.1 requests against the router's httpListener and aborts each one at a chosen point:
+// part way through the request headers, part way through an uploaded request body, or once the response has started
+// streaming back. Connections are aborted with a RST (SO_LINGER 0) or a plain close. The router's RSS and socket
+// count are sampled before, during and after the storm to show how quickly per-request state is reclaimed.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "router-sample.h"
+
+#define MAX_EVENTS  256
+#define BODY_CHUNK  (4096 * 16)
+
+typedef enum {
+    POINT_HEADERS,   // abort part way through the request headers
+    POINT_BODY,      // abort part way through the request body
+    POINT_RESPONSE,  // abort once the response is streaming
+    POINT_MIXED,     // rotate through the above
+} abort_point_t;
+
+static const char * const point_names[] = {"headers", "body", "response", "mixed"};
+
+typedef enum {
+    SLOT_IDLE,
+    SLOT_CONNECTING,
+    SLOT_SENDING,
+    SLOT_DWELL,      // partial request sent, wait before aborting
+    SLOT_RESPONSE,   // full request sent, wait for the response to start
+} slot_state_t;
+
+typedef struct slot {
+    int            fd;
+    slot_state_t   state;
+    abort_point_t  point;
+    int64_t        deadline;     // nsecs, 0 == none
+    const char    *header;       // request header to send
+    size_t         header_len;
+    size_t         to_send;      // total octets to send before aborting (or waiting for the response)
+    size_t         sent;
+    size_t         received;
+} slot_t;
+
+static unsigned int   port = 8000;
+static const char    *get_path = "/t10M.html";
+static const char    *put_path = "/upload";
+static size_t         body_size = 1024 * 1024;
+static size_t         response_octets = 1;   // abort once this much of the response has arrived
+static int64_t        dwell = 10000000;      // nsecs to wait after a partial request
+static int64_t        response_timeout = 5000000000LL;
+static bool           use_rst = true;
+static uint64_t       rng = 0x9E3779B97F4A7C15ULL;
+
+static char           get_header[512];
+static size_t         get_header_len;
+static char           put_header[512];
+static size_t         put_header_len;
+static char          *body;
+
+
+// statistics
+static uint64_t       started;
+static uint64_t       aborted[3];       // by abort point
+static uint64_t       no_response;      // response aborts that timed out before the response started
+static uint64_t       closed_by_peer;   // router closed or reset the connection first
+static uint64_t       connect_failed;
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t random_next(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1DULL;
+}
+
+// sample the routers, labelled with the phase and the secs into it
+static void sample_phase(const char *phase, double secs)
+{
+    char label[64];
+    snprintf(label, sizeof(label), "%-9s %7.1f secs", phase, secs);
+    sample_routers(label);
+}
+
+
+static void slot_abort(int epoll_fd, slot_t *slot)
+{
+    if (use_rst) {
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(slot->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL);
+    close(slot->fd);
+    slot->fd = -1;
+    slot->state = SLOT_IDLE;
+    slot->deadline = 0;
+}
+
+static bool slot_start(int epoll_fd, slot_t *slot, abort_point_t point)
+{
+    struct sockaddr_in addr = (struct sockaddr_in) {
+        0,
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+
+    slot->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (slot->fd < 0)
+        return false;
+    int opt = 1;
+    setsockopt(slot->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(slot->fd, (const struct sockaddr*) &addr, sizeof(addr)) && errno != EINPROGRESS) {
+        close(slot->fd);
+        slot->fd = -1;
+        return false;
+    }
+
+    slot->point = point;
+    slot->sent = 0;
+    slot->received = 0;
+    slot->deadline = 0;
+    switch (point) {
+        case POINT_HEADERS:
+            // cut the header somewhere after the first octet and before the final CRLF
+            slot->header = get_header;
+            slot->header_len = get_header_len;
+            slot->to_send = 1 + random_next() % (get_header_len - 2);
+            break;
+        case POINT_BODY:
+            slot->header = put_header;
+            slot->header_len = put_header_len;
+            slot->to_send = put_header_len + (body_size ? random_next() % body_size : 0);
+            break;
+        default:
+            slot->header = get_header;
+            slot->header_len = get_header_len;
+            slot->to_send = get_header_len;
+            break;
+    }
+
+    slot->state = SLOT_CONNECTING;
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = slot };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot->fd, &event);
+    started += 1;
+    return true;
+}
+
+static void slot_send(int epoll_fd, slot_t *slot, int64_t now)
+{
+    while (slot->sent < slot->to_send) {
+        const char *data;
+        size_t length;
+        if (slot->sent < slot->header_len) {
+            data = slot->header + slot->sent;
+            length = slot->header_len - slot->sent;
+        } else {
+            data = body;
+            length = BODY_CHUNK;
+        }
+        if (length > slot->to_send - slot->sent)
+            length = slot->to_send - slot->sent;
+
+        ssize_t rc = send(slot->fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;  // wait for EPOLLOUT
+            if (errno == EINTR)
+                continue;
+            closed_by_peer += 1;
+            slot_abort(epoll_fd, slot);
+            return;
+        }
+        slot->sent += rc;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = slot };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, slot->fd, &event);
+    if (slot->point == POINT_RESPONSE) {
+        slot->state = SLOT_RESPONSE;
+        slot->deadline = now + response_timeout;
+    } else {
+        slot->state = SLOT_DWELL;
+        slot->deadline = now + dwell;
+    }
+}
+
+static void slot_event(int epoll_fd, slot_t *slot, int64_t now)
+{
+    switch (slot->state) {
+        case SLOT_CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err) {
+                connect_failed += 1;
+                slot_abort(epoll_fd, slot);
+                return;
+            }
+            slot->state = SLOT_SENDING;
+            slot_send(epoll_fd, slot, now);
+            break;
+        }
+        case SLOT_SENDING:
+            slot_send(epoll_fd, slot, now);
+            break;
+
+        case SLOT_DWELL:
+        case SLOT_RESPONSE: {
+            char buffer[4096];
+            ssize_t rc = recv(slot->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (rc > 0) {
+                slot->received += rc;
+                if (slot->state == SLOT_RESPONSE && slot->received >= response_octets) {
+                    aborted[POINT_RESPONSE] += 1;
+                    slot_abort(epoll_fd, slot);
+                }
+            } else if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                closed_by_peer += 1;
+                slot_abort(epoll_fd, slot);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void slot_timer(int epoll_fd, slot_t *slot)
+{
+    if (slot->state == SLOT_DWELL) {
+        aborted[slot->point] += 1;
+    } else if (slot->state == SLOT_RESPONSE) {
+        no_response += 1;
+        aborted[POINT_RESPONSE] += 1;
+    }
+    slot_abort(epoll_fd, slot);
+}
+
+
+static int parse_octets(char *arg, size_t *value)
+{
+    size_t scale = 1;
+    char *ptr = strpbrk(arg, "KMG");
+    if (ptr) {
+        switch (*ptr) {
+            case 'K':
+                scale = 1024;
+                break;
+            case 'M':
+                scale = 1024 * 1024;
+                break;
+            case 'G':
+                scale = 1024 * 1024 * 1024;
+                break;
+        }
+        *ptr = 0;
+    }
+    if (sscanf(arg, "%zu", value) != 1)
+        return -1;
+    *value *= scale;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <options>\n", prog);
+    printf("-p \tThe router's httpListener port [%u]\n", port);
+    printf("-c \t# of concurrent requests [1000]\n");
+    printf("-d \tStorm duration [10 secs]\n");
+    printf("-r \tStart at most this many requests/sec, 0 == as fast as possible [0]\n");
+    printf("-a \tAbort point: headers, body, response or mixed [mixed]\n");
+    printf("-k \tAbort with: rst (SO_LINGER 0) or close [rst]\n");
+    printf("-u \tPath for GET requests [%s]\n", get_path);
+    printf("-U \tPath for PUT requests [%s]\n", put_path);
+    printf("-b \tPUT request body size [%zu (K|M|G)]\n", body_size);
+    printf("-R \tAbort response streaming after this many octets [%zu (K|M|G)]\n", response_octets);
+    printf("-w \tWait this long after a partial request before aborting [10 msecs]\n");
+    printf("-S \tSample the router(s) for this long after the storm [10 secs]\n");
+    printf("-P \tRouter pid to sample, may be repeated [all skrouterd processes]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int concurrency = 1000;
+    double duration = 10.0;
+    double rate = 0.0;
+    double settle = 10.0;
+    abort_point_t point = POINT_MIXED;
+
+    /* command line options */
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, "p:c:d:r:a:k:u:U:b:R:w:S:P:h")) != -1) {
+        switch(c) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%u", &port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &concurrency) != 1 || concurrency <= 0) {
+                    fprintf(stderr, "Invalid concurrency %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                if (sscanf(optarg, "%lf", &duration) != 1 || duration <= 0) {
+                    fprintf(stderr, "Invalid duration %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (sscanf(optarg, "%lf", &rate) != 1 || rate < 0) {
+                    fprintf(stderr, "Invalid rate %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'a': {
+                bool found = false;
+                for (int i = 0; i < 4 && !found; ++i) {
+                    if (strcmp(optarg, point_names[i]) == 0) {
+                        point = (abort_point_t) i;
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "Invalid abort point %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case 'k':
+                if (strcmp(optarg, "rst") == 0) {
+                    use_rst = true;
+                } else if (strcmp(optarg, "close") == 0) {
+                    use_rst = false;
+                } else {
+                    fprintf(stderr, "Invalid abort style %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'u':
+                get_path = optarg;
+                break;
+            case 'U':
+                put_path = optarg;
+                break;
+            case 'b':
+                if (parse_octets(optarg, &body_size) != 0) {
+                    fprintf(stderr, "Invalid body size %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'R':
+                if (parse_octets(optarg, &response_octets) != 0 || response_octets == 0) {
+                    fprintf(stderr, "Invalid response size %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'w': {
+                double msecs;
+                if (sscanf(optarg, "%lf", &msecs) != 1 || msecs < 0) {
+                    fprintf(stderr, "Invalid wait %s\n", optarg);
+                    usage(argv[0]);
+                }
+                dwell = (int64_t) (msecs * 1e6);
+                break;
+            }
+            case 'S':
+                if (sscanf(optarg, "%lf", &settle) != 1 || settle < 0) {
+                    fprintf(stderr, "Invalid settle time %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'P':
+                add_router(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+    if (router_count == 0)
+        find_routers();
+
+    get_header_len = snprintf(get_header, sizeof(get_header),
+                              "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%u\r\nUser-Agent: abort-storm\r\nAccept: */*\r\n\r\n",
+                              get_path, port);
+    put_header_len = snprintf(put_header, sizeof(put_header),
+                              "PUT %s HTTP/1.1\r\nHost: 127.0.0.1:%u\r\nUser-Agent: abort-storm\r\nContent-Length: %zu\r\n\r\n",
+                              put_path, port, body_size);
+    body = malloc(BODY_CHUNK);
+    memset(body, 'x', BODY_CHUNK);
+    rng ^= (uint64_t) now_nsec();
+
+    int epoll_fd = epoll_create1(0);
+    slot_t *slots = calloc(concurrency, sizeof(slot_t));
+    for (int i = 0; i < concurrency; ++i)
+        slots[i].fd = -1;
+
+    printf("abort-storm: %d concurrent requests to port %u for %.1f secs, abort at %s with %s\n",
+           concurrency, port, duration, point_names[point], use_rst ? "RST" : "close");
+    int64_t start = now_nsec();
+    sample_phase("baseline", 0.0);
+
+    const int64_t end = start + (int64_t) (duration * 1e9);
+    int64_t next_report = start + 1000000000LL;
+    int64_t next_start = start;
+    const int64_t start_interval = rate > 0 ? (int64_t) (1e9 / rate) : 0;
+    unsigned int rotate = 0;
+    uint64_t last_aborted = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int64_t now = now_nsec();
+        bool storming = now < end;
+        int active = 0;
+        int64_t wakeup = storming ? next_report : now + 1000000000LL;
+
+        // start new requests in idle slots (subject to the rate), expire timers
+        for (int i = 0; i < concurrency; ++i) {
+            slot_t *slot = &slots[i];
+            if (slot->state == SLOT_IDLE && storming && now >= next_start) {
+                abort_point_t p = point == POINT_MIXED ? (abort_point_t) (rotate++ % 3) : point;
+                if (!slot_start(epoll_fd, slot, p))
+                    connect_failed += 1;
+                next_start = start_interval ? (next_start > now - 1000000000LL ? next_start : now) + start_interval : now;
+            }
+            if (slot->deadline && slot->deadline <= now)
+                slot_timer(epoll_fd, slot);
+            if (slot->state != SLOT_IDLE) {
+                active += 1;
+                if (slot->deadline && slot->deadline < wakeup)
+                    wakeup = slot->deadline;
+            }
+        }
+        if (!storming && active == 0)
+            break;
+        if (storming && start_interval && next_start < wakeup)
+            wakeup = next_start;
+
+        int timeout = wakeup > now ? (int) ((wakeup - now) / 1000000) + 1 : 0;
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            fprintf(stderr, "abort-storm: epoll_wait() ERROR! %s\n", strerror(errno));
+            return 1;
+        }
+        now = now_nsec();
+        for (int i = 0; i < count; ++i)
+            slot_event(epoll_fd, (slot_t *) events[i].data.ptr, now);
+
+        if (now >= next_report && storming) {
+            uint64_t total = aborted[0] + aborted[1] + aborted[2];
+            fprintf(stdout, "abort-storm: %.1f secs in-flight=%d aborts/sec=%"PRIu64"\n",
+                    (now - start) / 1e9, active, total - last_aborted);
+            last_aborted = total;
+            sample_phase("storm", (now - start) / 1e9);
+            next_report += 1000000000LL;
+        }
+    }
+
+    int64_t storm_end = now_nsec();
+    double secs = (storm_end - start) / 1e9;
+    uint64_t total = aborted[0] + aborted[1] + aborted[2];
+    fprintf(stdout, "abort-storm: started %"PRIu64" requests, aborted %"PRIu64" in %.3f secs (%.1f aborts/sec)\n",
+            started, total, secs, total / secs);
+    fprintf(stdout, "abort-storm: aborted at headers=%"PRIu64" body=%"PRIu64" response=%"PRIu64
+            " (no response before timeout=%"PRIu64"), closed by router=%"PRIu64", connect failed=%"PRIu64"\n",
+            aborted[POINT_HEADERS], aborted[POINT_BODY], aborted[POINT_RESPONSE], no_response,
+            closed_by_peer, connect_failed);
+    fflush(stdout);
+
+    // watch the router reclaim the per-request state
+    for (int t = 1; t <= (int) settle; ++t) {
+        sleep(1);
+        sample_phase("after", (now_nsec() - storm_end) / 1e9);
+    }
+
+    return 0;
+}
@@ -17,62 +17,290 @@
  * under the License.
  */
 
-#include <proton/engine.h>
+//
+// Bridge AMQP to TCP: accept AMQP links and bridge them to a TCP server. Used as a reference point for the
+// throughput of the router's TCP adaptor.
+//
+// AMQP->TCP: when the peer opens a sending link the content of its deliveries is streamed to the TCP server.
+// TCP->AMQP: when the peer opens a receiving link the data read from the TCP server is streamed to the peer as a
+// single long delivery, one body data section per buffer. The delivery completes when the server half-closes.
+//
+// Each bridged connection has two pools of buffers, sized to a multiple of the raw connection's write and read
+// capacity respectively. Delivery data is received directly into write pool buffers which are then handed to the
+// raw connection for writing, and the raw connection reads directly into read pool buffers, so there is no
+// additional copy. When a pool is exhausted the bridge stops reading from that side, and the outgoing delivery is
+// paused (Q2) while too much data is buffered in the AMQP session.
+//
+
+#include <proton/condition.h>
+#include <proton/connection.h>
+#include <proton/delivery.h>
+#include <proton/event.h>
+#include <proton/link.h>
 #include <proton/listener.h>
-#include <proton/netaddr.h>
 #include <proton/proactor.h>
-#include <proton/sasl.h>
-#include <proton/ssl.h>
+#include <proton/raw_connection.h>
+#include <proton/session.h>
 #include <proton/transport.h>
-#include <proton/message.h>
+#include <proton/version.h>
 
+#include <arpa/inet.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <signal.h>
-#include <inttypes.h>
+
+#define MIN(X,Y) ((X) > (Y) ? (Y) : (X))
 
 pn_proactor_t *proactor;
-bool stop = false;
+atomic_bool stop;
+bool debug_mode = false;
 
 char *listener_address = "0.0.0.0:5672";
 char *server_address = "localhost:20002";
 char *container_name = "AmqpTcpBridge";
 int   credit_window = 1000;
+int   thread_count = 4;
+int   report_interval = 5;            // seconds, 0 == off
+uint32_t buffer_size = 16384;
+uint32_t pool_factor = 2;             // pool size == pool_factor * raw buffer capacity
+uint32_t session_frames = 64;         // incoming session window in frames
+size_t   q2_upper = 256 * 1024;       // pause the outgoing delivery above this many buffered octets...
+size_t   q2_lower = 128 * 1024;       // ...and resume below this
 
-#define SLOT_COUNT 128
-#define BUF_SIZE   4096
+// statistics (updated from all threads)
+atomic_uint_fast64_t amqp_bytes_in;   // octets received from AMQP
+atomic_uint_fast64_t tcp_bytes_out;   // octets written to TCP
+atomic_uint_fast64_t tcp_bytes_in;    // octets read from TCP
+atomic_uint_fast64_t amqp_bytes_out;  // octets sent to AMQP
+atomic_uint_fast64_t q2_blocks;       // times the outgoing delivery was paused
+atomic_uint_fast64_t buffers_total;   // buffers allocated over all pools
+atomic_uint_fast64_t buffers_busy;    // buffers holding data not yet forwarded
+atomic_uint_fast64_t buffers_peak;
+atomic_uint_fast64_t active_bridges;
 
-typedef struct buffer_t {
-    size_t size;
-    uint8_t data[BUF_SIZE];
+
+// message header and properties sections that precede the streamed body of a TCP->AMQP delivery
+//
+const uint8_t msg_header[] = {
+    0x00,  // begin described type
+    0x53,  // 1 byte ulong type
+    0x70,  // HEADER section
+    0x45,  // empty list
+    0x00,  // begin described type
+    0x53,  // 1 byte ulong type
+    0x73,  // PROPERTIES section
+    0x45,  // empty list
 };
 
+// each buffer read from TCP is sent as a body data section
+//
+typedef struct __attribute__((packed)) data_section_t {
+    uint8_t  descriptor[3];  // 0x00 0x53 0x75 (DATA section)
+    uint8_t  type;           // 0xb0 (binary uint32 length)
+    uint32_t length;         // network order
+} data_section_t;
+
+
+typedef struct buffer_t {
+    struct buffer_t *next;
+    char            *data;    // buffer_size octets
+    uint32_t         size;    // octets of valid data
+} buffer_t;
+
+typedef struct buffer_list_t {
+    buffer_t     *head;
+    buffer_t     *tail;
+    unsigned int  count;
+} buffer_list_t;
+
+typedef struct buffer_pool_t {
+    buffer_t      *descs;
+    char          *slab;      // memory for all buffers in the pool
+    unsigned int   size;
+    buffer_list_t  free_bufs;
+} buffer_pool_t;
+
 typedef struct context_t {
-    pn_connection_t *amqp_conn;
-    pn_link_t       *amqp_link;
-    pn_raw_connection_t *raw_conn;
-    unsigned int producer_slot;
-    unsigned int consumer_slot;
-    buffer_t buffers[SLOT_COUNT];
+    pthread_mutex_t      lock;
+    int                  refcount;     // one for each of the AMQP and raw connections
+
+    // AMQP side, only accessed from the AMQP connection's event batch
+    pn_link_t           *amqp_rx_link; // AMQP->TCP
+    pn_link_t           *amqp_tx_link; // TCP->AMQP
+    pn_delivery_t       *tx_dlv;
+    bool                 tx_done;      // outgoing delivery complete
+    bool                 tx_settled;
+    bool                 q2_blocked;
+    bool                 rx_closed;    // AMQP->TCP link closed by the peer, end the stream once it is drained
+
+    // protected by lock:
+    pn_connection_t     *amqp_conn;    // 0 once the AMQP connection is gone
+    pn_raw_connection_t *raw_conn;     // 0 once the raw connection is gone
+    pn_connection_t     *amqp_drain;   // released AMQP connection still drained by the raw connection
+    bool                 has_rx;       // AMQP->TCP direction in use
+    bool                 has_tx;       // TCP->AMQP direction in use
+    bool                 amqp_blocked; // AMQP side waiting for a free write buffer
+    bool                 amqp_eos;     // no more data will arrive from AMQP
+    bool                 tcp_eos;      // no more data will arrive from TCP
+    bool                 read_starved; // raw connection waiting for a free read buffer
+    bool                 write_closed;
+    bool                 raw_closing;
+    bool                 raw_done;     // raw connection has disconnected
+
+    buffer_pool_t        write_pool;
+    buffer_pool_t        read_pool;
+    buffer_list_t        write_ready;  // AMQP data waiting for the raw connection
+    buffer_list_t        read_ready;   // TCP data waiting for the AMQP link
 } context_t;
 
-static unsigned int next_slot(unsigned int slot)
+
+__attribute__((format(printf, 1, 2))) void debug(const char *format, ...)
+{
+    va_list args;
+
+    if (!debug_mode) return;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+
+static double humanize_rate(double rate, const char **suffix)
+{
+    static const char * const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    const int units_ct = 5;
+    const double base = 1024.0;
+
+    for (int i = 0; i < units_ct; ++i) {
+        if (rate < base) {
+            if (suffix)
+                *suffix = units[i];
+            return rate;
+        }
+        rate /= base;
+    }
+    if (suffix)
+        *suffix = units[units_ct - 1];
+    return rate;
+}
+
+
+static void list_append(buffer_list_t *list, buffer_t *buf)
+{
+    buf->next = 0;
+    if (list->tail)
+        list->tail->next = buf;
+    else
+        list->head = buf;
+    list->tail = buf;
+    list->count += 1;
+}
+
+static buffer_t *list_pop(buffer_list_t *list)
+{
+    buffer_t *buf = list->head;
+    if (buf) {
+        list->head = buf->next;
+        if (!list->head)
+            list->tail = 0;
+        list->count -= 1;
+        buf->next = 0;
+    }
+    return buf;
+}
+
+// move all buffers on src to the pool's free list, returns the # of buffers moved
+static unsigned int list_recycle(buffer_list_t *src, buffer_pool_t *pool)
+{
+    unsigned int count = 0;
+    buffer_t *buf;
+    while ((buf = list_pop(src))) {
+        list_append(&pool->free_bufs, buf);
+        count += 1;
+    }
+    return count;
+}
+
+
+static void buffers_busy_add(uint64_t count)
+{
+    uint64_t busy = atomic_fetch_add(&buffers_busy, count) + count;
+    uint64_t peak = atomic_load(&buffers_peak);
+    while (busy > peak && !atomic_compare_exchange_weak(&buffers_peak, &peak, busy))
+        ;
+}
+
+
+// Allocate a buffer pool once the raw connection's buffer capacity is known
+//
+static void pool_create(buffer_pool_t *pool, size_t capacity)
 {
-    return (slot + 1) % SLOT_COUNT;
+    assert(!pool->descs);
+    pool->size = MIN(capacity, 1024) * pool_factor;
+    if (pool->size == 0)
+        pool->size = pool_factor;
+    pool->descs = calloc(pool->size, sizeof(buffer_t));
+    pool->slab = malloc((size_t) pool->size * buffer_size);
+    if (!pool->descs || !pool->slab) {
+        fprintf(stderr, "ERROR: buffer pool allocation failed\n");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < pool->size; ++i) {
+        pool->descs[i].data = pool->slab + ((size_t) i * buffer_size);
+        list_append(&pool->free_bufs, &pool->descs[i]);
+    }
+    atomic_fetch_add(&buffers_total, pool->size);
 }
 
-static bool slots_full(const context_t *context)
+static void pool_free(buffer_pool_t *pool)
 {
-    return next_slot(context->producer_slot) == context->consumer_slot;
+    if (pool->descs) {
+        atomic_fetch_sub(&buffers_total, pool->size);
+        free(pool->descs);
+        free(pool->slab);
+    }
 }
 
-static bool slots_empty(const context_t *context)
+
+static context_t *context_new(void)
 {
-    return context->producer_slot == context->consumer_slot;
+    context_t *context = calloc(1, sizeof(context_t));
+    pthread_mutex_init(&context->lock, 0);
+    context->refcount = 1;  // AMQP connection
+    atomic_fetch_add(&active_bridges, 1);
+    return context;
 }
 
+
+// Drop a reference to the context. Called with the context lock held, the lock is released by this call.
+//
+static void context_release(context_t *context)
+{
+    bool last = --context->refcount == 0;
+    pthread_mutex_unlock(&context->lock);
+    if (last) {
+        debug("Freeing context %p\n", (void *) context);
+        atomic_fetch_sub(&buffers_busy, context->write_ready.count + context->read_ready.count);
+        pool_free(&context->write_pool);
+        pool_free(&context->read_pool);
+        pthread_mutex_destroy(&context->lock);
+        free(context);
+        atomic_fetch_sub(&active_bridges, 1);
+    }
+}
+
+
 static void signal_handler(int signum)
 {
     signal(SIGINT,  SIG_IGN);
@@ -81,7 +309,6 @@ static void signal_handler(int signum)
     switch (signum) {
     case SIGINT:
     case SIGQUIT:
-        stop = true;
         if (proactor) pn_proactor_interrupt(proactor);
         break;
     default:
@@ -89,101 +316,423 @@ static void signal_handler(int signum)
     }
 }
 
-static int link_receive(context_t *context, pn_link_t *link, pn_delivery_t *dlv)
+
+static void amqp_stream_end(context_t *context);
+
+// AMQP connection context: receive delivery data directly into free write pool buffers. Once the peer has closed
+// the link the stream ends when the data received before the close has been read out of the deliveries, which can
+// take several calls if the write pool runs out.
+//
+static void amqp_receive(context_t *context)
 {
-    int written = 0;
+    pn_link_t *link = context->amqp_rx_link;
+    unsigned int filled = 0;
+    bool done = false;
 
-    while (!slots_full(context) && pn_delivery_pending(dlv)) {
-        buffer_t *buf = &context->slots[context->producer_slot];
-        ssize_t rc = pn_link_recv(link, (char *)buf->data, BUF_SIZE);
-        if (rc < 0) {
-            break; // EOS or error
-        } else if (rc == 0) {
-            // no data available for now
+    while (link) {
+        pn_delivery_t *dlv = pn_link_current(link);
+        if (!dlv || !pn_delivery_readable(dlv)) {
+            done = context->rx_closed;
             break;
-        } else {
+        }
+
+        pthread_mutex_lock(&context->lock);
+        const bool raw_gone = !context->raw_conn;
+        buffer_t *buf = raw_gone ? 0 : list_pop(&context->write_pool.free_bufs);
+        context->amqp_blocked = !buf;
+        pthread_mutex_unlock(&context->lock);
+        if (!buf) {
+            done = raw_gone && context->rx_closed;  // nowhere left to write the rest
+            break;  // no room, the raw connection will wake us when buffers are written
+        }
+
+        ssize_t rc = pn_link_recv(link, buf->data, buffer_size);
+        pthread_mutex_lock(&context->lock);
+        if (rc > 0) {
             buf->size = rc;
-            context->producer_slot = next_slot(context->producer_slot);
-            written += 1;
+            list_append(&context->write_ready, buf);
+            filled += 1;
+            atomic_fetch_add(&amqp_bytes_in, rc);
+        } else {
+            list_append(&context->write_pool.free_bufs, buf);
+        }
+        pthread_mutex_unlock(&context->lock);
+
+        if (rc == PN_EOS || (rc < 0 && pn_delivery_aborted(dlv))) {
+            debug("Delivery done\n");
+            if (!pn_delivery_aborted(dlv))
+                pn_delivery_update(dlv, PN_ACCEPTED);
+            pn_delivery_settle(dlv);
+            if (!context->rx_closed)
+                pn_link_flow(link, 1);
+        } else if (rc <= 0) {
+            done = context->rx_closed;  // link closed mid-delivery, no more data will arrive
+            break;  // wait for more data
         }
     }
 
-    return written;
+    if (filled) {
+        buffers_busy_add(filled);
+        pthread_mutex_lock(&context->lock);
+        if (context->raw_conn)
+            pn_raw_connection_wake(context->raw_conn);
+        pthread_mutex_unlock(&context->lock);
+    }
+
+    if (done)
+        amqp_stream_end(context);
 }
 
-static int raw_write_drain(context_t *context)
+
+// AMQP connection context: stream the data read from TCP as a single delivery. Stops sending (Q2) while more than
+// q2_upper octets are buffered in the session, which leaves the read buffers in use and stops the raw connection
+// from reading.
+//
+static void amqp_send(context_t *context)
+{
+    pn_link_t *link = context->amqp_tx_link;
+    if (!link || context->tx_done)
+        return;
+
+    if (!context->tx_dlv) {
+        if (pn_link_credit(link) <= 0)
+            return;
+        context->tx_dlv = pn_delivery(link, pn_dtag("TCP", 3));
+        pn_link_send(link, (const char *) msg_header, sizeof(msg_header));
+    }
+
+    pn_session_t *ssn = pn_link_session(link);
+    if (context->q2_blocked) {
+        if (pn_session_outgoing_bytes(ssn) > q2_lower)
+            return;  // checked again at PN_TRANSPORT as the transport writes the buffered data
+        context->q2_blocked = false;
+    }
+
+    unsigned int sent = 0;
+    bool eos = false;
+    while (true) {
+        pthread_mutex_lock(&context->lock);
+        buffer_t *buf = list_pop(&context->read_ready);
+        eos = !buf && context->tcp_eos;
+        pthread_mutex_unlock(&context->lock);
+        if (!buf)
+            break;
+
+        data_section_t section = {
+            .descriptor = {0x00, 0x53, 0x75},
+            .type       = 0xb0,
+            .length     = htonl(buf->size),
+        };
+        pn_link_send(link, (const char *) &section, sizeof(section));
+        pn_link_send(link, buf->data, buf->size);
+        atomic_fetch_add(&amqp_bytes_out, buf->size);
+
+        pthread_mutex_lock(&context->lock);
+        list_append(&context->read_pool.free_bufs, buf);
+        pthread_mutex_unlock(&context->lock);
+        sent += 1;
+
+        if (pn_session_outgoing_bytes(ssn) > q2_upper) {
+            debug("Q2 blocked\n");
+            context->q2_blocked = true;
+            atomic_fetch_add(&q2_blocks, 1);
+            break;
+        }
+    }
+
+    if (sent) {
+        atomic_fetch_sub(&buffers_busy, sent);
+        pthread_mutex_lock(&context->lock);
+        if (context->read_starved && context->raw_conn) {
+            context->read_starved = false;
+            pn_raw_connection_wake(context->raw_conn);
+        }
+        pthread_mutex_unlock(&context->lock);
+    }
+
+    if (eos) {
+        // the TCP server has half-closed: complete the delivery
+        debug("TCP stream complete, delivery done\n");
+        pn_link_advance(link);
+        context->tx_done = true;
+    }
+}
+
+
+// AMQP connection context: the peer has updated the outgoing delivery
+//
+static void amqp_tx_update(context_t *context, pn_delivery_t *dlv)
+{
+    if (dlv != context->tx_dlv || !pn_delivery_updated(dlv))
+        return;
+
+    uint64_t rs = pn_delivery_remote_state(dlv);
+    if (rs == PN_RECEIVED)
+        return;  // informational only
+
+    if (!context->tx_done) {
+        fprintf(stderr, "TCP->AMQP delivery settled by peer before completion (%"PRIu64")\n", rs);
+        context->tx_done = true;
+    }
+    pn_delivery_settle(dlv);
+    context->tx_dlv = 0;
+    context->tx_settled = true;
+}
+
+
+// AMQP connection context: no more data will arrive from AMQP and all of it has been received.
+//
+static void amqp_stream_end(context_t *context)
+{
+    context->amqp_rx_link = 0;
+    pthread_mutex_lock(&context->lock);
+    context->amqp_eos = true;
+    if (context->raw_conn)
+        pn_raw_connection_wake(context->raw_conn);
+    pthread_mutex_unlock(&context->lock);
+}
+
+
+// AMQP connection context: no more data will be sent to AMQP, stop reading from TCP
+//
+static void amqp_tx_end(context_t *context)
+{
+    context->amqp_tx_link = 0;
+    context->tx_done = true;
+    pthread_mutex_lock(&context->lock);
+    context->has_tx = false;
+    atomic_fetch_sub(&buffers_busy, list_recycle(&context->read_ready, &context->read_pool));
+    if (context->raw_conn)
+        pn_raw_connection_wake(context->raw_conn);
+    pthread_mutex_unlock(&context->lock);
+}
+
+
+// AMQP connection context: close the AMQP connection once the TCP connection is gone and the outgoing delivery (if
+// any) has been settled by the peer. A close from the peer is answered once the incoming stream has been drained,
+// closing earlier would drop the delivery data still held by the connection.
+//
+static void amqp_check_close(context_t *context, pn_connection_t *conn)
+{
+    pthread_mutex_lock(&context->lock);
+    bool raw_done = context->raw_done;
+    pthread_mutex_unlock(&context->lock);
+
+    if (!(pn_connection_state(conn) & PN_LOCAL_ACTIVE))
+        return;
+
+    if (pn_connection_state(conn) & PN_REMOTE_CLOSED) {
+        if (!context->amqp_rx_link)
+            pn_connection_close(conn);
+    } else if (raw_done && (!context->amqp_tx_link || context->tx_settled)) {
+        fprintf(stdout, "TCP connection closed, closing AMQP connection...\n");
+        pn_connection_close(conn);
+    }
+}
+
+
+// Raw connection context: continue draining the AMQP->TCP stream of an AMQP connection released at
+// PN_TRANSPORT_CLOSED. The AMQP connection has no thread of its own any more so the raw connection does the
+// receiving. Called with the context lock held, frees the AMQP connection and drops its reference once the stream
+// has ended.
+//
+static void amqp_drain(context_t *context)
 {
-    int drained = 0;
-    pn_raw_buffer_t rdesc = {0};
+    pthread_mutex_unlock(&context->lock);
+    amqp_receive(context);
+    pthread_mutex_lock(&context->lock);
 
-    assert(context->raw_conn);
-    while (pn_raw_connection_take_written_buffers(context->raw_conn, &rdesc, 1) == 1) {
-        unsigned int my_slot = rdesc.context;
-        assert(my_slot == context->consumer_slot);
-        drained += 1;
-        context->consumer_slot = next_slot(context->consumer_slot);
+    if (!context->amqp_rx_link) {
+        debug("Released AMQP connection drained\n");
+        pn_connection_free(context->amqp_drain);
+        context->amqp_drain = 0;
+        context->refcount -= 1;  // the caller still holds the raw connection's reference
     }
+}
+
+
+static void connect_raw(context_t *context)
+{
+    pn_raw_connection_t *raw_conn = pn_raw_connection();
+    pthread_mutex_lock(&context->lock);
+    context->raw_conn = raw_conn;
+    context->refcount += 1;
+    pthread_mutex_unlock(&context->lock);
+    pn_raw_connection_set_context(raw_conn, context);
+    pn_proactor_raw_connect(proactor, raw_conn, server_address);
+    fprintf(stdout, "Connecting to %s...\n", server_address);
+}
+
+
+// Raw connection context: recycle the written buffers back into the write pool. Called with the context lock held.
+//
+static unsigned int raw_write_drain(context_t *context)
+{
+    unsigned int drained = 0;
+    pn_raw_buffer_t rdesc[16];
+    size_t count;
+
+    while ((count = pn_raw_connection_take_written_buffers(context->raw_conn, rdesc, 16)) != 0) {
+        for (size_t i = 0; i < count; ++i) {
+            buffer_t *buf = (buffer_t *) rdesc[i].context;
+            atomic_fetch_add(&tcp_bytes_out, rdesc[i].size);
+            list_append(&context->write_pool.free_bufs, buf);
+        }
+        drained += count;
+    }
+    if (drained)
+        atomic_fetch_sub(&buffers_busy, drained);
 
     return drained;
 }
 
-static int raw_send(context_t *context)
+
+// Raw connection context: hand filled buffers to the raw connection. Called with the context lock held.
+//
+static unsigned int raw_send(context_t *context)
 {
-    int written = 0;
+    unsigned int written = 0;
+    pn_raw_buffer_t rdesc[16];
 
     size_t avail = pn_raw_connection_write_buffers_capacity(context->raw_conn);
-    unsigned int slot = context->consumer_slot;
-    while (avail && slot != context->producer_slot) {
-        pn_raw_buffer_t rdesc = {0};
-        rdesc.context = slot;
-        rdesc.bytes = (char *) context->buffers[slot].data;
-        rdesc.size = context->buffers[slot].size;
-        rdesc.offset = 0;
-        pn_raw_connection_write_buffers(context->raw_conn, &rdesc, 1);
-        avail -= 1;
-        slot = next_slot(slot);
-        written += 1;
+    while (avail && context->write_ready.count) {
+        size_t count = 0;
+        while (count < 16 && count < avail) {
+            buffer_t *buf = list_pop(&context->write_ready);
+            if (!buf)
+                break;
+            rdesc[count] = (pn_raw_buffer_t) {
+                .context  = (uintptr_t) buf,
+                .bytes    = buf->data,
+                .capacity = buffer_size,
+                .size     = buf->size,
+                .offset   = 0,
+            };
+            count += 1;
+        }
+        size_t given = pn_raw_connection_write_buffers(context->raw_conn, rdesc, count);
+        assert(given == count);
+        avail -= given;
+        written += given;
     }
 
-    // advance consumer_slot AFTER buffers are written
-
     return written;
 }
 
-static void connect_raw(context_t *context)
+
+// Raw connection context: collect the buffers filled by the raw connection. Called with the context lock held.
+//
+static unsigned int raw_read_drain(context_t *context)
 {
-    assert(context);
+    unsigned int filled = 0;
+    pn_raw_buffer_t rdesc[16];
+    size_t count;
 
-    context->raw_conn = pn_raw_connection();
-    pn_raw_connection_set_context(context->raw_conn, context);
-    pn_proactor_raw_connect(proactor, context->raw_conn, server_address);
-    fprintf(stdout, "Connecting to %s...\n", server_address);
+    while ((count = pn_raw_connection_take_read_buffers(context->raw_conn, rdesc, 16)) != 0) {
+        for (size_t i = 0; i < count; ++i) {
+            buffer_t *buf = (buffer_t *) rdesc[i].context;
+            if (rdesc[i].size && context->has_tx) {
+                buf->size = rdesc[i].size;
+                list_append(&context->read_ready, buf);
+                atomic_fetch_add(&tcp_bytes_in, rdesc[i].size);
+                filled += 1;
+            } else {
+                list_append(&context->read_pool.free_bufs, buf);
+            }
+        }
+    }
+    if (filled)
+        buffers_busy_add(filled);
+
+    return filled;
 }
 
+
+// Raw connection context: give free buffers to the raw connection for reading. Called with the context lock held.
+//
+static void raw_give_read_buffers(context_t *context)
+{
+    if (!context->has_tx || context->tcp_eos)
+        return;
+
+    pn_raw_buffer_t rdesc[16];
+    size_t avail = pn_raw_connection_read_buffers_capacity(context->raw_conn);
+    while (avail) {
+        size_t count = 0;
+        while (count < 16 && count < avail) {
+            buffer_t *buf = list_pop(&context->read_pool.free_bufs);
+            if (!buf)
+                break;
+            rdesc[count] = (pn_raw_buffer_t) {
+                .context  = (uintptr_t) buf,
+                .bytes    = buf->data,
+                .capacity = buffer_size,
+                .size     = 0,
+                .offset   = 0,
+            };
+            count += 1;
+        }
+        if (count == 0) {
+            context->read_starved = true;  // AMQP side will wake us when buffers are sent
+            break;
+        }
+        size_t given = pn_raw_connection_give_read_buffers(context->raw_conn, rdesc, count);
+        assert(given == count);
+        avail -= given;
+    }
+}
+
+
+// Raw connection context: half-close the TCP connection once all AMQP data has been written, and close it
+// completely once both directions are done. Called with the context lock held.
+//
+static void raw_check_close(context_t *context)
+{
+    if (context->raw_closing)
+        return;
+
+    if (context->has_rx && context->amqp_eos && !context->write_closed
+        && context->write_ready.count == 0
+        && context->write_pool.free_bufs.count == context->write_pool.size) {
+        debug("AMQP stream complete, half-closing raw conn...\n");
+        context->write_closed = true;
+        pn_raw_connection_write_close(context->raw_conn);
+    }
+
+    const bool write_done = context->write_closed || !context->has_rx;
+    const bool read_done = context->tcp_eos || !context->has_tx;
+    if (write_done && read_done) {
+        fprintf(stdout, "Stream complete, closing raw conn...\n");
+        context->raw_closing = true;
+        pn_raw_connection_close(context->raw_conn);
+    }
+}
+
+
 static void listener_event_handler(pn_event_t *e)
 {
-    fprintf(stdout, "Proactor event %s\n", pn_event_type_name(pn_event_type(e)));
+    debug("Listener event %s\n", pn_event_type_name(pn_event_type(e)));
 
     pn_listener_t *pn_listener = pn_event_listener(e);
     assert(pn_listener);
 
     switch (pn_event_type(e)) {
-        case PN_LISTENER_OPEN: {
-            /* char port[PN_MAX_ADDR];    /\* Get the listening port *\/ */
-            /* pn_netaddr_host_port(pn_listener_addr(pn_listener), NULL, 0, port, sizeof(port)); */
-            /* fprintf(stdout, "listening on %s\n", port); */
-            /* fflush(stdout); */
-            break;
-        }
         case PN_LISTENER_ACCEPT: {
-            context_t *context = calloc(1, sizeof(context_t));
-            context->amqp_conn = pn_connection();
-            pn_connection_set_context(context->amqp_conn, context);
-            pn_listener_accept2(pn_listener, context->amqp_conn, 0);
+            context_t *context = context_new();
+            pn_connection_t *amqp_conn = pn_connection();
+            context->amqp_conn = amqp_conn;
+            pn_connection_set_context(amqp_conn, context);
+            pn_listener_accept2(pn_listener, amqp_conn, 0);
             fprintf(stdout, "Accepted AMQP conn, context=%p\n", (void *)context);
             break;
         }
         case PN_LISTENER_CLOSE: {
+            pn_condition_t *cond = pn_listener_condition(pn_listener);
+            if (pn_condition_is_set(cond)) {
+                fprintf(stderr, "Listener error: %s %s\n",
+                        pn_condition_get_name(cond), pn_condition_get_description(cond));
+                exit(1);
+            }
             break;
         }
         default:
@@ -194,9 +743,11 @@ static void listener_event_handler(pn_event_t *e)
 
 static void amqp_event_handler(pn_event_t *e)
 {
-    fprintf(stdout, "Proactor event %s\n", pn_event_type_name(pn_event_type(e)));
+    debug("AMQP event %s\n", pn_event_type_name(pn_event_type(e)));
 
     context_t *context = pn_connection_get_context(pn_event_connection(e));
+    if (!context)
+        return;  // context released at PN_TRANSPORT_CLOSED
 
     switch (pn_event_type(e)) {
 
@@ -209,133 +760,305 @@ static void amqp_event_handler(pn_event_t *e)
             break;
         }
         case PN_SESSION_REMOTE_OPEN: {
-            pn_session_open(pn_event_session(e));
+            pn_session_t *ssn = pn_event_session(e);
+#if (PN_VERSION_MAJOR > 0) || (PN_VERSION_MINOR > 39)
+            if (pn_session_set_incoming_window_and_lwm(ssn, session_frames, session_frames / 2) != 0) {
+                fprintf(stderr, "Failed to set incoming window and low watermark\n");
+                exit(1);
+            }
+#endif
+            pn_session_open(ssn);
             break;
         }
         case PN_LINK_REMOTE_OPEN: {
             pn_link_t *l = pn_event_link(e);
-            if (context->amqp_link) {
+            const bool first_link = !context->amqp_rx_link && !context->amqp_tx_link;
+            const bool is_receiver = pn_link_is_receiver(l);
+
+            if ((is_receiver && context->amqp_rx_link) || (!is_receiver && context->amqp_tx_link)) {
                 fprintf(stdout, "Rejecting extra link\n");
                 pn_link_open(l);
                 pn_link_close(l);
+                break;
             }
 
-            if (pn_link_is_receiver) {
+            if (is_receiver) {
                 const char* target = pn_terminus_get_address(pn_link_remote_target(l));
                 pn_terminus_set_address(pn_link_target(l), target);
                 pn_link_flow(l, credit_window);
+                context->amqp_rx_link = l;
             } else {
-                fprintf(stderr, "ERROR: AMQP Sender not supported!\n");
-                exit(1);
-                /* const char *source = pn_terminus_get_address(pn_link_remote_source(l)); */
-                /* pn_terminus_set_address(pn_link_source(l), source); */
+                const char *source = pn_terminus_get_address(pn_link_remote_source(l));
+                pn_terminus_set_address(pn_link_source(l), source);
+                context->amqp_tx_link = l;
             }
             pn_link_open(l);
 
+            pthread_mutex_lock(&context->lock);
+            if (is_receiver)
+                context->has_rx = true;
+            else
+                context->has_tx = true;
+            if (context->raw_conn)
+                pn_raw_connection_wake(context->raw_conn);  // start reading
+            pthread_mutex_unlock(&context->lock);
 
             // now initiate a raw connection to the TCP server
-            context->amqp_link = link;
-            connect_raw(context);
+            if (first_link)
+                connect_raw(context);
             break;
         }
         case PN_CONNECTION_REMOTE_CLOSE:
-            pn_connection_close(pn_event_connection(e));
-            assert(context);
-            context->amqp_connection = 0;
-            if (context->raw_conn == 0) {
-                fprintf(stdout, "Freeing context %p\n", (void *)context);
-                free(context);
+            if (context->amqp_rx_link) {
+                context->rx_closed = true;
+                amqp_receive(context);
             }
+            amqp_check_close(context, pn_event_connection(e));
             break;
 
         case PN_SESSION_REMOTE_CLOSE:
             pn_session_close(pn_event_session(e));
-            pn_session_free(pn_event_session(e));
             break;
 
-        case PN_LINK_REMOTE_CLOSE:
-            context->amqp_link = 0;
-            pn_link_close(pn_event_link(e));
-            pn_link_free(pn_event_link(e));
+        case PN_LINK_REMOTE_CLOSE: {
+            pn_link_t *l = pn_event_link(e);
+            if (l == context->amqp_rx_link) {
+                context->rx_closed = true;
+                amqp_receive(context);  // ends the stream unless data is waiting for write buffers
+            } else if (l == context->amqp_tx_link) {
+                amqp_tx_end(context);
+            }
+            pn_link_close(l);
             break;
+        }
 
         case PN_LINK_FLOW:
+            if (pn_event_link(e) == context->amqp_tx_link)
+                amqp_send(context);
             break;
 
-        case PN_DELIVERY:
-            assert(pn_event_delivery(e) == pn_link_current(context->amqp_link));
-            // fallthrough
-        case PN_CONNECTION_WAKE: {
-            if (!context->amqp_link)
-                break;
+        case PN_DELIVERY: {
+            pn_link_t *l = pn_event_link(e);
+            if (l == context->amqp_rx_link) {
+                amqp_receive(context);
+            } else if (l == context->amqp_tx_link) {
+                amqp_tx_update(context, pn_event_delivery(e));
+            }
+            amqp_check_close(context, pn_event_connection(e));
+            break;
+        }
 
-            pn_delivery_t *d = pn_link_current(context->amqp_link);
+        case PN_TRANSPORT:
+            if (context->q2_blocked)
+                amqp_send(context);  // resume once the outgoing bytes drop below q2_lower
+            break;
 
-            int written = 0;
-            if (pn_delivery_pending(d)) {
-                if (context->raw_conn)
-                    raw_write_drain(context);  // attempt to make room in slots
+        case PN_CONNECTION_WAKE:
+            amqp_receive(context);
+            amqp_send(context);
+            amqp_check_close(context, pn_event_connection(e));
+            break;
 
-                written = link_receive(context, pn_event_link(e), d);
+        case PN_TRANSPORT_CLOSED: {
+            pn_condition_t *cond = pn_transport_condition(pn_event_transport(e));
+            if (pn_condition_is_set(cond)) {
+                fprintf(stderr, "AMQP transport error: %s %s\n",
+                        pn_condition_get_name(cond), pn_condition_get_description(cond));
             }
-
-            // try sending the new data
-            if (written && context->raw_conn) {
-                pn_raw_connection_wake(context->raw_conn);
+            if (context->amqp_rx_link) {
+                context->rx_closed = true;
+                amqp_receive(context);
             }
-
-            if (!pn_delivery_pending(d) && !pn_delivery_partial(d)) {
-                fprintf(stdout, "Delivery done\n");
-                pn_delivery_update(d, PN_ACCEPTED);
-                pn_delivery_settle(d);
-                d = 0;
-                pn_link_flow(context->amqp_link, 1);
+            if (context->amqp_tx_link)
+                amqp_tx_end(context);
+            pthread_mutex_lock(&context->lock);
+            context->amqp_conn = 0;
+            if (context->amqp_rx_link) {
+                // received data is waiting for write buffers: take the connection (and the deliveries holding the
+                // data) from the proactor and let the raw connection finish the stream, see amqp_drain()
+                debug("Releasing AMQP connection to drain it\n");
+                pn_proactor_release_connection(pn_event_connection(e));
+                context->amqp_drain = pn_event_connection(e);
+                pthread_mutex_unlock(&context->lock);
+                break;
             }
+            context_release(context);
+            pn_connection_set_context(pn_event_connection(e), 0);
+            break;
         }
-        break;
-    }
 
-    default:
-        break;
+        default:
+            break;
     }
 }
 
+
 static void raw_event_handler(pn_event_t *e)
 {
-    fprintf(stdout, "Proactor event %s\n", pn_event_type_name(pn_event_type(e)));
+    debug("Raw event %s\n", pn_event_type_name(pn_event_type(e)));
 
-    context_t *context = pn_event_raw_connection(event);
+    pn_raw_connection_t *raw_conn = pn_event_raw_connection(e);
+    context_t *context = (context_t *) pn_raw_connection_get_context(raw_conn);
     assert(context);
 
-    if (pn_event_type(e) == PN_RAW_CONNECTION_DISCONNECTED) {
-        context->raw_conn = 0;
-        if (context->amqp_conn == 0) {
-            fprintf(stdout, "Freeing context %p\n", (void *)context);
-            free(context);
-        } else {
-            fprintf(stdout, "Force-close AMQP connection...\n");
-            pn_connection_close(context->amqp_conn);
+    pthread_mutex_lock(&context->lock);
+
+    bool wake_amqp = false;
+    switch (pn_event_type(e)) {
+        case PN_RAW_CONNECTION_CONNECTED: {
+            fprintf(stdout, "Connected to %s\n", server_address);
+            pool_create(&context->write_pool, pn_raw_connection_write_buffers_capacity(raw_conn));
+            pool_create(&context->read_pool, pn_raw_connection_read_buffers_capacity(raw_conn));
+            wake_amqp = true;  // start receiving data
+            break;
         }
-        return;  // raw conn no longer valid
+
+        case PN_RAW_CONNECTION_CLOSED_READ:
+            debug("TCP server closed its write side\n");
+            context->tcp_eos = true;
+            wake_amqp = true;  // complete the outgoing delivery
+            break;
+
+        case PN_RAW_CONNECTION_DISCONNECTED: {
+            pn_condition_t *cond = pn_raw_connection_condition(raw_conn);
+            if (pn_condition_is_set(cond)) {
+                fprintf(stderr, "TCP connection error: %s %s\n",
+                        pn_condition_get_name(cond), pn_condition_get_description(cond));
+            }
+            raw_write_drain(context);
+            raw_read_drain(context);
+            // discard data that will never be written, data already read is still sent to AMQP
+            atomic_fetch_sub(&buffers_busy, list_recycle(&context->write_ready, &context->write_pool));
+            context->raw_conn = 0;
+            context->raw_done = true;
+            context->tcp_eos = true;
+            if (context->amqp_drain)
+                amqp_drain(context);  // nowhere left to write, ends the stream
+            if (context->amqp_conn)
+                pn_connection_wake(context->amqp_conn);
+            context_release(context);
+            return;  // raw conn no longer valid
+        }
+
+        default:
+            break;
     }
 
-    bool was_full = slots_full(context);
-    raw_write_drain(context);
-    raw_send(context);
+    if (context->write_pool.descs) {
+        const bool was_blocked = context->amqp_blocked;
+        const bool freed = raw_write_drain(context) > 0;
+        raw_send(context);
+        const bool filled = raw_read_drain(context) > 0;
+        raw_give_read_buffers(context);
+        raw_check_close(context);
 
-    if (slots_empty(context) && context->amqp_link == 0) {
-        fprintf(stdout, "Stream complete, closing raw conn...\n");
-        pn_raw_connection_close(context->raw_conn);
-    } else if (was_full && !slots_full(context)) {
-        if (context->amqp_conn) {
-            pn_connection_wake(context->amqp_conn);
+        if ((was_blocked && freed) || filled) {
+            context->amqp_blocked = false;
+            wake_amqp = true;
+        }
+        if (wake_amqp && context->amqp_drain) {
+            amqp_drain(context);
+            raw_send(context);
+            raw_check_close(context);
         }
     }
+
+    if (wake_amqp && context->amqp_conn)
+        pn_connection_wake(context->amqp_conn);
+
+    pthread_mutex_unlock(&context->lock);
+}
+
+
+static void report(void)
+{
+    static uint64_t last[4];
+    static struct timespec last_ts, last_cpu;
+    struct timespec now, cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    const uint64_t counters[4] = {
+        atomic_load(&amqp_bytes_in), atomic_load(&tcp_bytes_out),
+        atomic_load(&tcp_bytes_in), atomic_load(&amqp_bytes_out),
+    };
+    if (last_ts.tv_sec) {
+        const double secs = (now.tv_sec - last_ts.tv_sec) + (now.tv_nsec - last_ts.tv_nsec) / 1e9;
+        const double cpu_secs = (cpu.tv_sec - last_cpu.tv_sec) + (cpu.tv_nsec - last_cpu.tv_nsec) / 1e9;
+        const char *suffix[4];
+        double rate[4];
+        for (int i = 0; i < 4; ++i)
+            rate[i] = humanize_rate((counters[i] - last[i]) / secs, &suffix[i]);
+        const uint64_t moved = (counters[1] - last[1]) + (counters[3] - last[3]);
+        const uint64_t total = atomic_load(&buffers_total);
+        const uint64_t busy = atomic_load(&buffers_busy);
+        fprintf(stdout, "bridges=%"PRIuFAST64" AMQP->TCP in %.3f %s/sec out %.3f %s/sec, "
+                "TCP->AMQP in %.3f %s/sec out %.3f %s/sec, Q2 blocks %"PRIuFAST64", "
+                "buffers busy %"PRIu64"/%"PRIu64" (%.1f%%) peak %"PRIuFAST64", "
+                "CPU %.1f%% %.3f nsec/byte\n",
+                atomic_load(&active_bridges),
+                rate[0], suffix[0], rate[1], suffix[1], rate[2], suffix[2], rate[3], suffix[3],
+                atomic_load(&q2_blocks),
+                busy, total, total ? (100.0 * busy) / total : 0.0, atomic_load(&buffers_peak),
+                100.0 * cpu_secs / secs, moved ? (cpu_secs * 1e9) / moved : 0.0);
+        fflush(stdout);
+        atomic_store(&buffers_peak, busy);
+    }
+    memcpy(last, counters, sizeof(last));
+    last_ts = now;
+    last_cpu = cpu;
+}
+
+
+static void proactor_event_handler(pn_event_t *e)
+{
+    debug("Proactor event %s\n", pn_event_type_name(pn_event_type(e)));
+
+    switch (pn_event_type(e)) {
+        case PN_PROACTOR_INTERRUPT:
+            // wake the next thread so it exits too
+            atomic_store(&stop, true);
+            pn_proactor_interrupt(proactor);
+            break;
+
+        case PN_PROACTOR_TIMEOUT:
+            report();
+            pn_proactor_set_timeout(proactor, report_interval * 1000);
+            break;
+
+        default:
+            break;
+    }
 }
 
-static void proactor_event_handler(pn_event_type *e)
+
+static void *run_proactor(void *arg)
 {
-    fprintf(stdout, "Proactor event %s\n", pn_event_type_name(pn_event_type(e)));
+    do {
+        pn_event_batch_t *events = pn_proactor_wait(proactor);
+        pn_event_t *e;
+
+        if (pn_event_batch_connection(events) != 0) {
+            while ((e = pn_event_batch_next(events))) {
+                amqp_event_handler(e);
+            }
+        } else if (pn_event_batch_raw_connection(events) != 0) {
+            while ((e = pn_event_batch_next(events))) {
+                raw_event_handler(e);
+            }
+        } else if (pn_event_batch_listener(events) != 0) {
+            while ((e = pn_event_batch_next(events))) {
+                listener_event_handler(e);
+            }
+        } else {
+            while ((e = pn_event_batch_next(events))) {
+                proactor_event_handler(e);
+            }
+        }
+        pn_proactor_done(proactor, events);
+    } while (!atomic_load(&stop));
+
+    return 0;
 }
 
 
@@ -345,6 +1068,13 @@ static void usage(const char *prog)
     printf("-a \tThe address to listen on [%s]\n", listener_address);
     printf("-s \tThe address of the server to connect to [%s]\n", server_address);
     printf("-i \tContainer name [%s]\n", container_name);
+    printf("-t \t# of proactor threads [%d]\n", thread_count);
+    printf("-b \tBuffer size [%"PRIu32" bytes]\n", buffer_size);
+    printf("-p \tBuffer pool size as a multiple of the raw connection buffer capacity [%"PRIu32"]\n", pool_factor);
+    printf("-W \tIncoming session window [%"PRIu32" frames]\n", session_frames);
+    printf("-Q \tPause the TCP->AMQP delivery when more than this is buffered, resume at half [%zu bytes]\n", q2_upper);
+    printf("-R \tReport throughput and buffer occupancy every N seconds, 0 == off [%d]\n", report_interval);
+    printf("-D \tPrint debug info [off]\n");
     exit(1);
 }
 
@@ -354,12 +1084,38 @@ int main(int argc, char **argv)
     // command line options
     opterr = 0;
     int c;
-    while ((c = getopt(argc, argv, "ha:i:s:")) != -1) {
+    while ((c = getopt(argc, argv, "ha:i:s:t:b:p:W:Q:R:D")) != -1) {
         switch(c) {
             case 'h': usage(argv[0]); break;
             case 'a': listener_address = optarg; break;
             case 'i': container_name = optarg; break;
             case 's': server_address = optarg; break;
+            case 't':
+                if (sscanf(optarg, "%d", &thread_count) != 1 || thread_count <= 0)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                if (sscanf(optarg, "%"SCNu32, &buffer_size) != 1 || buffer_size == 0)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%"SCNu32, &pool_factor) != 1 || pool_factor == 0)
+                    usage(argv[0]);
+                break;
+            case 'W':
+                if (sscanf(optarg, "%"SCNu32, &session_frames) != 1 || session_frames < 2)
+                    usage(argv[0]);
+                break;
+            case 'Q':
+                if (sscanf(optarg, "%zu", &q2_upper) != 1 || q2_upper == 0)
+                    usage(argv[0]);
+                q2_lower = q2_upper / 2;
+                break;
+            case 'R':
+                if (sscanf(optarg, "%d", &report_interval) != 1 || report_interval < 0)
+                    usage(argv[0]);
+                break;
+            case 'D': debug_mode = true; break;
             default:
                 usage(argv[0]);
                 break;
@@ -372,33 +1128,18 @@ int main(int argc, char **argv)
     proactor = pn_proactor();
     pn_proactor_listen(proactor, pn_listener(), listener_address, 16);
     fprintf(stdout, "Listening for AMQP on %s\n", listener_address);
+    if (report_interval)
+        pn_proactor_set_timeout(proactor, report_interval * 1000);
 
-    do {
-        pn_event_batch_t *events = pn_proactor_wait(proactor);
-
-        if (pn_event_batch_connection(events) != 0) {
-            pn_event_t *e;
-            while ((e = pn_event_batch_next(events))) {
-                amqp_event_handler(e);
-            }
-        } else if (pn_event_batch_raw_connection(events) != 0) {
-            pn_event_t *e;
-            while ((e = pn_event_batch_next(events))) {
-                raw_event_handler(e);
-            }
-        } else if (pn_event_batch_listener(events) != 0) {
-            pn_event_t *e;
-            while ((e = pn_event_batch_next(events))) {
-                listener_event_handler(e);
-            }
-        } else {
-            pn_event_t *e;
-            while ((e = pn_event_batch_next(events))) {
-                proactor_event_handler(e);
-            }
-        }
-        pn_proactor_done(proactor, events);
-    } while (!stop);
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    for (int i = 1; i < thread_count; ++i) {
+        pthread_create(&threads[i], 0, run_proactor, 0);
+    }
+    run_proactor(0);
+    for (int i = 1; i < thread_count; ++i) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
 
     pn_proactor_free(proactor);
     return 0;
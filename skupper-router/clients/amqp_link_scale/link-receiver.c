@@ -20,8 +20,12 @@
 
 /*
  * Opens N receive links to the router. Drains all incoming messages until ^C hit
+ *
+ * Per-link byte and message counters are sampled every report interval to measure how fairly the router distributes
+ * the balanced address across the links: see report_interval().
  */
 
+#include "proton/condition.h"
 #include "proton/connection.h"
 #include "proton/delivery.h"
 #include "proton/link.h"
@@ -49,6 +53,26 @@ char proactor_address[PN_MAX_ADDR];
 pn_proactor_t *proactor;
 int max_links = 100;
 unsigned long msg_count = 0;
+int report_msecs = 1000;       // 0 == final report only
+int starve_msecs = 1000;
+bool per_link_report = false;
+FILE *csv_file;
+
+// per-link counters, indexed by link number
+typedef struct link_stats_t {
+    uint64_t  msgs;       // messages received
+    uint64_t  bytes;      // octets received
+    uint64_t  last_bytes; // at the previous report
+    int64_t   last_data;  // msecs, last time octets arrived
+    int64_t   max_gap;    // msecs, longest time without data
+    uint32_t  starved;    // # of gaps longer than starve_msecs
+} link_stats_t;
+
+link_stats_t *links;
+uint64_t starvation_events = 0;
+int64_t first_data_msecs;      // 0 until the first transfer, gaps are measured from there
+int64_t start_msecs;
+int64_t last_report_msecs;
 
 #define RX_BUF_SIZE 65536
 char rx_buffer[RX_BUF_SIZE];
@@ -66,6 +90,120 @@ __attribute__((format(printf, 1, 2))) void debug(const char *format, ...)
 }
 
 
+static int64_t now_msecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Record octets arriving on a link. A link that has received nothing for more than starve_msecs has been starved by
+// the router's balanced distribution.
+//
+static void link_data(link_stats_t *ls, size_t octets, int64_t now)
+{
+    if (!first_data_msecs) {
+        // the setup time before traffic starts is not a gap
+        first_data_msecs = now;
+        for (int i = 0; i < max_links; ++i)
+            links[i].last_data = now;
+    }
+    int64_t gap = now - ls->last_data;
+    if (gap > starve_msecs) {
+        ls->starved += 1;
+        starvation_events += 1;
+    }
+    if (gap > ls->max_gap)
+        ls->max_gap = gap;
+    ls->last_data = now;
+    ls->bytes += octets;
+}
+
+
+// Jain's fairness index over the per-link throughput, 1.0 == perfectly fair, 1/n == one link gets everything. Also
+// returns the min/max link throughput ratio.
+//
+static double jain_index(const double *x, int n, double *min_max)
+{
+    double sum = 0, sum_sq = 0, min = 0, max = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += x[i];
+        sum_sq += x[i] * x[i];
+        if (i == 0 || x[i] < min) min = x[i];
+        if (i == 0 || x[i] > max) max = x[i];
+    }
+    *min_max = max > 0 ? min / max : 0.0;
+    return sum_sq > 0 ? (sum * sum) / (n * sum_sq) : 0.0;
+}
+
+
+static void report_interval(int64_t now)
+{
+    double *x = calloc(max_links, sizeof(double));
+    double secs = (now - last_report_msecs) / 1000.0;
+    double total = 0;
+    int starving = 0;
+
+    for (int i = 0; i < max_links; ++i) {
+        link_stats_t *ls = &links[i];
+        uint64_t delta = ls->bytes - ls->last_bytes;
+        if (csv_file)
+            fprintf(csv_file, "%.3f,%d,%"PRIu64",%"PRIu64",%"PRIu64"\n",
+                    (now - start_msecs) / 1000.0, i, ls->msgs, ls->bytes, delta);
+        ls->last_bytes = ls->bytes;
+        if (first_data_msecs && now - ls->last_data > starve_msecs)
+            starving += 1;
+        x[i] = delta / secs;
+        total += delta;
+    }
+
+    // nothing to be fair about while the senders are idle
+    if (total > 0) {
+        double min_max;
+        double jain = jain_index(x, max_links, &min_max);
+        fprintf(stdout, "receiver: %.1f secs links=%d rate=%.3f MiB/sec jain=%.4f min/max=%.4f starving=%d starvation-events=%"PRIu64"\n",
+                (now - start_msecs) / 1000.0, max_links, total / secs / (1024.0 * 1024.0), jain, min_max, starving, starvation_events);
+        fflush(stdout);
+    }
+    if (csv_file)
+        fflush(csv_file);
+    last_report_msecs = now;
+    free(x);
+}
+
+
+static void report_final(void)
+{
+    int64_t now = now_msecs();
+    double secs = (now - start_msecs) / 1000.0;
+    double *x = calloc(max_links, sizeof(double));
+    uint64_t bytes = 0;
+    int starved_links = 0;
+    int64_t max_gap = 0;
+
+    for (int i = 0; i < max_links; ++i) {
+        link_stats_t *ls = &links[i];
+        x[i] = ls->bytes / secs;
+        bytes += ls->bytes;
+        starved_links += ls->starved != 0;
+        if (ls->max_gap > max_gap)
+            max_gap = ls->max_gap;
+        if (per_link_report)
+            fprintf(stdout, "receiver: link L:%d msgs=%"PRIu64" bytes=%"PRIu64" starved=%"PRIu32" max-gap=%"PRId64" msecs\n",
+                    i, ls->msgs, ls->bytes, ls->starved, ls->max_gap);
+    }
+
+    double min_max;
+    double jain = jain_index(x, max_links, &min_max);
+    fprintf(stdout, "receiver: %d links received %lu msgs %"PRIu64" bytes in %.3f secs (%.1f msgs/sec)\n",
+            max_links, msg_count, bytes, secs, msg_count / secs);
+    fprintf(stdout, "receiver: jain=%.4f min/max=%.4f starvation-events=%"PRIu64" (>%d msecs) on %d links, max-gap=%"PRId64" msecs\n",
+            jain, min_max, starvation_events, starve_msecs, starved_links, max_gap);
+    free(x);
+}
+
+
 static void signal_handler(int signum)
 {
     signal(signum, SIG_IGN);
@@ -94,6 +232,7 @@ static bool event_handler(pn_event_t *event)
             char link_name[64];
             snprintf(link_name, sizeof(link_name), "L:%d", index);
             pn_link_t *pn_link = pn_receiver(pn_ssn, link_name);
+            pn_link_set_context(pn_link, &links[index]);
             pn_terminus_set_address(pn_link_source(pn_link), source_address);
             pn_link_open(pn_link);
             pn_link_flow(pn_link, 1000);
@@ -103,6 +242,8 @@ static bool event_handler(pn_event_t *event)
     case PN_DELIVERY: {
         pn_delivery_t *dlv = pn_event_delivery(event);
         pn_link_t *pn_link = pn_event_link(event);
+        link_stats_t *ls = (link_stats_t *) pn_link_get_context(pn_link);
+        int64_t now = now_msecs();
         size_t avail = pn_delivery_pending(dlv);
         bool rx_done = false;
         uintptr_t total = (uintptr_t) pn_delivery_get_context(dlv);
@@ -112,8 +253,10 @@ static bool event_handler(pn_event_t *event)
              // messages that are way huge.
              ssize_t rc = pn_link_recv(pn_link, rx_buffer, sizeof(rx_buffer));
              rx_done = (rc == PN_EOS || rc < 0);
-             if (!rx_done)
+             if (!rx_done) {
                  total += rc;
+                 link_data(ls, rc, now);
+             }
              avail = pn_delivery_pending(dlv);
         }
 
@@ -124,12 +267,28 @@ static bool event_handler(pn_event_t *event)
             pn_delivery_settle(dlv);  // dlv is now freed
             pn_link_flow(pn_link, 1);
             msg_count += 1;
+            ls->msgs += 1;
         } else if (total) {
             debug("Link received %"PRIuPTR" octets\n", total);
             pn_delivery_set_context(dlv, (void *) total);
         }
     } break;
 
+    case PN_PROACTOR_TIMEOUT: {
+        report_interval(now_msecs());
+        pn_proactor_set_timeout(proactor, report_msecs);
+    } break;
+
+    case PN_TRANSPORT_CLOSED: {
+        // the report timer keeps the proactor from going inactive
+        pn_condition_t *cond = pn_transport_condition(pn_event_transport(event));
+        if (pn_condition_is_set(cond))
+            fprintf(stderr, "receiver: connection failed: %s %s\n",
+                    pn_condition_get_name(cond), pn_condition_get_description(cond));
+        pn_proactor_cancel_timeout(proactor);
+        return true;
+    } break;
+
     case PN_PROACTOR_INACTIVE:
     case PN_PROACTOR_INTERRUPT: {
         debug("proactor inactive!\n");
@@ -150,6 +309,10 @@ static void usage(void)
     printf("-l \tTotal receive links to open [%d]\n", max_links);
     printf("-i \tContainer name [%s]\n", container_name);
     printf("-s \tSource address [%s]\n", source_address);
+    printf("-I \tFairness report interval, 0 == final report only [%d msecs]\n", report_msecs);
+    printf("-S \tCount a starvation event when a link receives nothing for this long [%d msecs]\n", starve_msecs);
+    printf("-o \tWrite per-link counters to this CSV file every interval [off]\n");
+    printf("-v \tPrint per-link counters at exit [off]\n");
     printf("-D \tPrint debug info [off]\n");
     exit(EXIT_FAILURE);
 }
@@ -160,7 +323,7 @@ int main(int argc, char** argv)
     /* command line options */
     opterr = 0;
     int c;
-    while((c = getopt(argc, argv, "hDi:a:s:l:")) != -1) {
+    while((c = getopt(argc, argv, "hDvi:a:s:l:I:S:o:")) != -1) {
         switch(c) {
         case 'h': usage(); break;
         case 'a': host_address = optarg; break;
@@ -171,6 +334,23 @@ int main(int argc, char** argv)
         case 'i': container_name = optarg; break;
         case 's': source_address = optarg; break;
         case 'D': _debug = true;           break;
+        case 'v': per_link_report = true;  break;
+        case 'I':
+            if (sscanf(optarg, "%d", &report_msecs) != 1 || report_msecs < 0)
+                usage();
+            break;
+        case 'S':
+            if (sscanf(optarg, "%d", &starve_msecs) != 1 || starve_msecs <= 0)
+                usage();
+            break;
+        case 'o':
+            csv_file = fopen(optarg, "w");
+            if (!csv_file) {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            fprintf(csv_file, "time,link,msgs,bytes,interval_bytes\n");
+            break;
         default:
             usage();
             break;
@@ -190,6 +370,9 @@ int main(int argc, char** argv)
         port = "5672";
     }
 
+    links = calloc(max_links, sizeof(link_stats_t));
+    start_msecs = last_report_msecs = now_msecs();
+
     pn_connection_t *pn_conn = pn_connection();
     // the container name should be unique for each client
     pn_connection_set_container(pn_conn, container_name);
@@ -198,6 +381,8 @@ int main(int argc, char** argv)
     pn_proactor_addr(proactor_address, sizeof(proactor_address), hostname, port);
     pn_proactor_connect2(proactor, pn_conn, 0, proactor_address);
     free(hostname);
+    if (report_msecs)
+        pn_proactor_set_timeout(proactor, report_msecs);
 
     bool done = false;
     while (!done) {
@@ -220,5 +405,8 @@ int main(int argc, char** argv)
     pn_proactor_free(proactor);
 
     debug("Total messages received: %lu\n", msg_count);
+    report_final();
+    if (csv_file)
+        fclose(csv_file);
     return 0;
 }
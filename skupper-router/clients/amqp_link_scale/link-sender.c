@@ -19,9 +19,14 @@
  */
 
 /*
- * Opens N sending links to the router. Sends 1 message per link. Exits after all messages accepted. See link-receiver.c
+ * Opens N sending links to the router. Sends 1 message per link (or -c messages per link, or until ^C). Exits after all
+ * messages are settled. See link-receiver.c
+ *
+ * Per-link byte and message counters are sampled every report interval to measure how fairly the router grants credit
+ * across the links: see report_interval().
  */
 
+#include "proton/condition.h"
 #include "proton/connection.h"
 #include "proton/delivery.h"
 #include "proton/link.h"
@@ -37,6 +42,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MIN(X,Y) (((X) < (Y)) ? (X) : (Y))
@@ -51,6 +57,33 @@ pn_proactor_t *proactor;
 int max_links = 100;
 int closed_links = 0;
 uint32_t body_length = 1024;
+uint64_t msgs_per_link = 1;    // 0 == until ^C
+int window = 10;               // max unsettled deliveries per link
+int report_msecs = 1000;       // 0 == final report only
+int starve_msecs = 1000;
+bool per_link_report = false;
+FILE *csv_file;
+
+// per-link counters, indexed by link number
+typedef struct link_stats_t {
+    pn_delivery_t *dlv;        // message currently being written
+    pn_delivery_t *queued_dlv; // holds the last chunk written until the transport takes it
+    size_t         queued;     // body octets in that chunk
+    uint64_t       msgs;       // messages settled
+    uint64_t       sent;       // messages started
+    uint64_t       bytes;      // body octets taken by the transport
+    uint64_t       last_bytes; // at the previous report
+    int64_t        last_data;  // msecs, last time body octets left the link
+    int64_t        max_gap;    // msecs, longest time without octets leaving
+    uint32_t       starved;    // # of gaps longer than starve_msecs
+    bool           done;
+} link_stats_t;
+
+link_stats_t *links;
+uint64_t starvation_events = 0;
+int64_t first_data_msecs;      // 0 until the first transfer, gaps are measured from there
+int64_t start_msecs;
+int64_t last_report_msecs;
 
 #define TX_BUF_SIZE 32768
 char tx_buffer[TX_BUF_SIZE];
@@ -88,6 +121,126 @@ __attribute__((format(printf, 1, 2))) void debug(const char *format, ...)
 }
 
 
+static int64_t now_msecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Record body octets leaving a link. A link that has not sent anything for more than starve_msecs has been starved
+// of credit, of session window (or of disposition updates, since the window limits unsettled deliveries).
+//
+static void link_data(link_stats_t *ls, size_t octets, int64_t now)
+{
+    if (!first_data_msecs) {
+        // the setup time before traffic starts is not a gap
+        first_data_msecs = now;
+        for (int i = 0; i < max_links; ++i)
+            links[i].last_data = now;
+    }
+    int64_t gap = now - ls->last_data;
+    if (gap > starve_msecs) {
+        ls->starved += 1;
+        starvation_events += 1;
+    }
+    if (gap > ls->max_gap)
+        ls->max_gap = gap;
+    ls->last_data = now;
+    ls->bytes += octets;
+}
+
+
+// Jain's fairness index over the per-link throughput, 1.0 == perfectly fair, 1/n == one link gets everything. Also
+// returns the min/max link throughput ratio.
+//
+static double jain_index(const double *x, int n, double *min_max)
+{
+    double sum = 0, sum_sq = 0, min = 0, max = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += x[i];
+        sum_sq += x[i] * x[i];
+        if (i == 0 || x[i] < min) min = x[i];
+        if (i == 0 || x[i] > max) max = x[i];
+    }
+    *min_max = max > 0 ? min / max : 0.0;
+    return sum_sq > 0 ? (sum * sum) / (n * sum_sq) : 0.0;
+}
+
+
+static void report_interval(int64_t now)
+{
+    double *x = calloc(max_links, sizeof(double));
+    double secs = (now - last_report_msecs) / 1000.0;
+    double total = 0;
+    int active = 0;
+    int starving = 0;
+
+    for (int i = 0; i < max_links; ++i) {
+        link_stats_t *ls = &links[i];
+        uint64_t delta = ls->bytes - ls->last_bytes;
+        if (csv_file)
+            fprintf(csv_file, "%.3f,%d,%"PRIu64",%"PRIu64",%"PRIu64"\n",
+                    (now - start_msecs) / 1000.0, i, ls->msgs, ls->bytes, delta);
+        ls->last_bytes = ls->bytes;
+        if (ls->done && delta == 0)
+            continue;  // finished before this interval
+        if (!ls->done && first_data_msecs && now - ls->last_data > starve_msecs)
+            starving += 1;
+        x[active++] = delta / secs;
+        total += delta;
+    }
+
+    if (active) {
+        double min_max;
+        double jain = jain_index(x, active, &min_max);
+        fprintf(stdout, "sender: %.1f secs links=%d rate=%.3f MiB/sec jain=%.4f min/max=%.4f starving=%d starvation-events=%"PRIu64"\n",
+                (now - start_msecs) / 1000.0, active, total / secs / (1024.0 * 1024.0), jain, min_max, starving, starvation_events);
+        fflush(stdout);
+    }
+    if (csv_file)
+        fflush(csv_file);
+    last_report_msecs = now;
+    free(x);
+}
+
+
+static void report_final(void)
+{
+    int64_t now = now_msecs();
+    double secs = (now - start_msecs) / 1000.0;
+    double *x = calloc(max_links, sizeof(double));
+    uint64_t msgs = 0, bytes = 0;
+    int starved_links = 0;
+    int64_t max_gap = 0;
+
+    for (int i = 0; i < max_links; ++i) {
+        link_stats_t *ls = &links[i];
+        int64_t gap = ls->max_gap;
+        if (!ls->done && first_data_msecs && now - ls->last_data > gap)
+            gap = now - ls->last_data;
+        x[i] = ls->bytes / secs;
+        msgs += ls->msgs;
+        bytes += ls->bytes;
+        starved_links += ls->starved != 0;
+        if (gap > max_gap)
+            max_gap = gap;
+        if (per_link_report)
+            fprintf(stdout, "sender: link L:%d msgs=%"PRIu64" bytes=%"PRIu64" starved=%"PRIu32" max-gap=%"PRId64" msecs\n",
+                    i, ls->msgs, ls->bytes, ls->starved, gap);
+    }
+
+    double min_max;
+    double jain = jain_index(x, max_links, &min_max);
+    fprintf(stdout, "sender: %d links sent %"PRIu64" msgs %"PRIu64" bytes in %.3f secs (%.1f msgs/sec)\n",
+            max_links, msgs, bytes, secs, msgs / secs);
+    fprintf(stdout, "sender: jain=%.4f min/max=%.4f starvation-events=%"PRIu64" (>%d msecs) on %d links, max-gap=%"PRId64" msecs\n",
+            jain, min_max, starvation_events, starve_msecs, starved_links, max_gap);
+    free(x);
+}
+
+
 static void signal_handler(int signum)
 {
     signal(signum, SIG_IGN);
@@ -116,6 +269,7 @@ pn_delivery_t *start_message(pn_link_t *pn_link)
     ++tag;
 
     pn_delivery_set_context(dlv, (void *)((uintptr_t) 0));  // body bytes sent
+    ((link_stats_t *) pn_link_get_context(pn_link))->sent += 1;
 
     // start sending the message
     ssize_t rc = pn_link_send(pn_link, (const char *)msg_fragment, sizeof(msg_fragment));
@@ -136,6 +290,58 @@ pn_delivery_t *start_message(pn_link_t *pn_link)
 }
 
 
+// Count the last chunk written once the transport has taken it off the link
+//
+static void link_drain(link_stats_t *ls)
+{
+    if (ls->queued_dlv && pn_delivery_pending(ls->queued_dlv) == 0) {
+        link_data(ls, ls->queued, now_msecs());
+        ls->queued_dlv = 0;
+        ls->queued = 0;
+    }
+}
+
+
+// Write the next chunk of the current message, starting a new message if credit and the unsettled window allow.
+// Only one chunk per link is buffered at a time: the next is written once the transport has taken the previous
+// one, so the router's credit and the session window pace each link rather than the link's buffer.
+//
+static void send_messages(pn_link_t *pn_link)
+{
+    link_stats_t *ls = (link_stats_t *) pn_link_get_context(pn_link);
+
+    link_drain(ls);
+    if (ls->queued_dlv)
+        return;  // wait for PN_LINK_FLOW once the transport has sent it
+
+    if (!ls->dlv) {
+        if (pn_link_credit(pn_link) <= 0
+            || pn_link_unsettled(pn_link) >= window
+            || (msgs_per_link && ls->sent == msgs_per_link))
+            return;
+        ls->dlv = start_message(pn_link);
+    }
+
+    if (pn_delivery_writable(ls->dlv)) {
+        uintptr_t sent = (uintptr_t) pn_delivery_get_context(ls->dlv);
+        size_t amount = MIN(body_length - sent, TX_BUF_SIZE);
+        ssize_t rc = pn_link_send(pn_link, tx_buffer, amount);
+        if (rc != amount) {
+            fprintf(stderr, "Unexpected send failure\n");
+            exit(EXIT_FAILURE);
+        }
+        sent += amount;
+        pn_delivery_set_context(ls->dlv, (void *)sent);
+        ls->queued_dlv = ls->dlv;
+        ls->queued = amount;
+        if (sent == body_length) {
+            pn_link_advance(pn_link);
+            ls->dlv = 0;
+        }
+    }
+}
+
+
 /* Process each event posted by the proactor.
    Return true if client has stopped.
  */
@@ -155,6 +361,7 @@ static bool event_handler(pn_event_t *event)
             char name[64];
             snprintf(name, sizeof(name), "L:%d", index);
             pn_link_t *pn_link = pn_sender(pn_ssn, name);
+            pn_link_set_context(pn_link, &links[index]);
             pn_terminus_set_address(pn_link_target(pn_link), target_address);
             pn_link_open(pn_link);
         }
@@ -163,29 +370,8 @@ static bool event_handler(pn_event_t *event)
 
     case PN_LINK_FLOW: {
         pn_link_t *pn_link = pn_event_link(event);
-        if ((pn_link_state(pn_link) & PN_LOCAL_ACTIVE)) {
-            pn_delivery_t *dlv = (pn_delivery_t *) pn_link_get_context(pn_link);
-            if (!dlv && pn_link_credit(pn_link) > 0) {
-                dlv = start_message(pn_link);
-                pn_link_set_context(pn_link, dlv);
-            }
-            if (dlv && pn_delivery_writable(dlv)) {
-                uintptr_t sent = (uintptr_t) pn_delivery_get_context(dlv);
-                if (sent < body_length) {
-                    size_t amount = MIN(body_length - sent, TX_BUF_SIZE);
-                    ssize_t rc = pn_link_send(pn_link, tx_buffer, amount);
-                    if (rc != amount) {
-                        fprintf(stderr, "Unexpected send failure\n");
-                        exit(EXIT_FAILURE);
-                    }
-                    sent += amount;
-                    pn_delivery_set_context(dlv, (void *)sent);
-                    if (sent == body_length) {
-                        pn_link_advance(pn_link);
-                    }
-                }
-            }
-        }
+        if ((pn_link_state(pn_link) & PN_LOCAL_ACTIVE))
+            send_messages(pn_link);
     } break;
 
     case PN_DELIVERY: {
@@ -203,16 +389,49 @@ static bool event_handler(pn_event_t *event)
             case PN_MODIFIED:
             default:
                 pn_link_t *pn_link = pn_delivery_link(dlv);
+                link_stats_t *ls = (link_stats_t *) pn_link_get_context(pn_link);
+                link_drain(ls);
+                if (ls->queued_dlv == dlv) {
+                    ls->queued_dlv = 0;  // settled before it was all sent
+                    ls->queued = 0;
+                }
+                if (ls->dlv == dlv) {
+                    // the peer gave up on a partly written message: end it so the link can start the next one
+                    pn_link_advance(pn_link);
+                    ls->dlv = 0;
+                }
                 pn_delivery_settle(dlv);
-                pn_link_close(pn_link);
-                closed_links += 1;
-                if (closed_links == max_links)
-                    return true;  // exit
+                ls->msgs += 1;
+                if (msgs_per_link && ls->msgs == msgs_per_link) {
+                    pn_link_close(pn_link);
+                    ls->done = true;
+                    closed_links += 1;
+                    if (closed_links == max_links)
+                        return true;  // exit
+                } else {
+                    send_messages(pn_link);
+                }
                 break;
             }
         }
     } break;
 
+    case PN_PROACTOR_TIMEOUT: {
+        int64_t now = now_msecs();
+        report_interval(now);
+        pn_proactor_set_timeout(proactor, report_msecs);
+    } break;
+
+    case PN_TRANSPORT_CLOSED: {
+        // the report timer keeps the proactor from going inactive
+        pn_condition_t *cond = pn_transport_condition(pn_event_transport(event));
+        if (pn_condition_is_set(cond))
+            fprintf(stderr, "sender: connection failed: %s %s\n",
+                    pn_condition_get_name(cond), pn_condition_get_description(cond));
+        pn_proactor_cancel_timeout(proactor);
+        return true;  // exit
+    } break;
+
     case PN_PROACTOR_INACTIVE:
         debug("proactor inactive!\n");
         // fallthrough
@@ -236,6 +455,12 @@ static void usage(const char *prog)
     printf("-t  \tTarget address [%s]\n", target_address);
     printf("-l  \t# of links to create [%d]\n", max_links);
     printf("-s  \tSize of the message [%"PRIu32" bytes]\n", body_length);
+    printf("-c  \t# of messages to send per link, 0 == until ^C [%"PRIu64"]\n", msgs_per_link);
+    printf("-w  \tMax unsettled messages per link [%d]\n", window);
+    printf("-I  \tFairness report interval, 0 == final report only [%d msecs]\n", report_msecs);
+    printf("-S  \tCount a starvation event when a link sends nothing for this long [%d msecs]\n", starve_msecs);
+    printf("-o  \tWrite per-link counters to this CSV file every interval [off]\n");
+    printf("-v  \tPrint per-link counters at exit [off]\n");
     printf("-D  \tPrint debug info [off]\n");
     exit(EXIT_FAILURE);
 }
@@ -245,13 +470,14 @@ int main(int argc, char** argv)
     /* command line options */
     opterr = 0;
     int c;
-    while ((c = getopt(argc, argv, "hDa:i:t:l:s:")) != -1) {
+    while ((c = getopt(argc, argv, "hDva:i:t:l:s:c:w:I:S:o:")) != -1) {
         switch(c) {
         case 'h': usage(argv[0]); break;
         case 'a': host_address = optarg; break;
         case 'i': container_name = optarg; break;
         case 't': target_address = optarg; break;
         case 'D': _debug = true; break;
+        case 'v': per_link_report = true; break;
         case 'l':
             if (sscanf(optarg, "%d", &max_links) != 1 || max_links <= 0)
                 usage(argv[0]);
@@ -260,6 +486,30 @@ int main(int argc, char** argv)
             if (sscanf(optarg, "%"SCNu32, &body_length) != 1 || body_length == 0)
                 usage(argv[0]);
             break;
+        case 'c':
+            if (sscanf(optarg, "%"SCNu64, &msgs_per_link) != 1)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d", &window) != 1 || window <= 0)
+                usage(argv[0]);
+            break;
+        case 'I':
+            if (sscanf(optarg, "%d", &report_msecs) != 1 || report_msecs < 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            if (sscanf(optarg, "%d", &starve_msecs) != 1 || starve_msecs <= 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            csv_file = fopen(optarg, "w");
+            if (!csv_file) {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            fprintf(csv_file, "time,link,msgs,bytes,interval_bytes\n");
+            break;
         default:
             usage(argv[0]);
             break;
@@ -279,6 +529,9 @@ int main(int argc, char** argv)
         port = "5672";
     }
 
+    links = calloc(max_links, sizeof(link_stats_t));
+    start_msecs = last_report_msecs = now_msecs();
+
     pn_connection_t *pn_conn = pn_connection();
     // the container name should be unique for each client
     pn_connection_set_container(pn_conn, container_name);
@@ -287,6 +540,8 @@ int main(int argc, char** argv)
     pn_proactor_addr(proactor_address, sizeof(proactor_address), hostname, port);
     pn_proactor_connect2(proactor, pn_conn, 0, proactor_address);
     free(hostname);
+    if (report_msecs)
+        pn_proactor_set_timeout(proactor, report_msecs);
 
     bool done = false;
     while (!done) {
@@ -309,5 +564,9 @@ int main(int argc, char** argv)
     debug("Send complete!\n");
     pn_proactor_free(proactor);
 
+    report_final();
+    if (csv_file)
+        fclose(csv_file);
+
     return EXIT_SUCCESS;
 }
@@ -20,14 +20,21 @@
 //
 // accept TCP connections and drain the incoming data as fast as possible
 //
+// Connections are spread round-robin over a small fixed pool of worker threads, each running its own epoll loop,
+// so that hundreds of connections measure the router rather than the scheduler. A reporter thread prints the
+// aggregate (and optionally per-connection) receive rate at a fixed interval.
+//
 
 #include <errno.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -37,6 +44,7 @@
 // drain the raw connection write buffers each time data is read
 //
 #define BUFFER_SIZE (4096 * 32)
+#define MAX_EVENTS  64
 
 static long double humanize_rate(long double rate, const char **suffix)
 {
@@ -57,67 +65,174 @@ static long double humanize_rate(long double rate, const char **suffix)
     return rate;
 }
 
-typedef struct thread_context {
-    int socket;
-    bool half_close;
-} thread_context_t;
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-static void *run(void* data)
+typedef struct connection {
+    struct connection    *next;       // registry list, protected by registry_lock
+    struct connection    *prev;
+    int                   socket;
+    unsigned int          id;
+    int64_t               start;      // nsecs
+    atomic_uint_fast64_t  rx_octets;  // written by the worker, read by the reporter
+    uint64_t              last_octets;  // reporter only
+} connection_t;
+
+typedef struct worker {
+    pthread_t             thread;
+    int                   epoll_fd;
+    atomic_uint_fast64_t  rx_octets;  // all connections served by this worker, including closed ones
+    atomic_uint           active;
+} worker_t;
+
+static worker_t        *workers;
+static int              worker_count = 4;
+static size_t           buffer_size = BUFFER_SIZE;
+static bool             half_close = false;
+static bool             per_connection = false;
+static long             report_msecs = 1000;  // 0 == off
+
+static pthread_mutex_t  registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static connection_t    *registry;
+
+static void registry_insert(connection_t *conn)
 {
-    int sock = ((thread_context_t*) data)->socket;
-    bool half_close = ((thread_context_t*) data)->half_close;
+    pthread_mutex_lock(&registry_lock);
+    conn->next = registry;
+    if (registry)
+        registry->prev = conn;
+    registry = conn;
+    pthread_mutex_unlock(&registry_lock);
+}
 
-    int opt = 1;
-    int err = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*) &opt, sizeof(opt));
-    if (err) {
-        fprintf(stderr, "server: setsockopt() ERROR! %s\n", strerror(errno));
-        return NULL;
-    }
+static void registry_remove(connection_t *conn)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        registry = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    pthread_mutex_unlock(&registry_lock);
+}
 
-    if (half_close) {
-        shutdown(sock, SHUT_WR);
-    }
+static void connection_close(worker_t *worker, connection_t *conn, ssize_t result)
+{
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    registry_remove(conn);
+    atomic_fetch_sub(&worker->active, 1);
 
-    struct timespec start = {0};
-    int rc = clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-    if (rc) {
-        fprintf(stderr, "server: clock_gettime() ERROR! %s\n", strerror(errno));
-        return NULL;
+    uint64_t rx_octets = atomic_load(&conn->rx_octets);
+    if (result < 0) {
+        fprintf(stderr, "server: conn %u ERROR! %s\n", conn->id, strerror(errno));
+    } else {
+        long double secs = (now_nsec() - conn->start) / 1e9L;
+        long double rate = secs != 0.0L ? ((long double) rx_octets / secs) : 0.0L;
+        const char *suffix = "";
+        rate = humanize_rate(rate, &suffix);
+        fprintf(stdout, "server: conn %u recv %"PRIu64" octets in %.6Lf secs, recv rate=%.3Lf %s/sec\n",
+                conn->id, rx_octets, secs, rate, suffix);
+        fflush(stdout);
     }
 
-    char *buffer = (char*) malloc(BUFFER_SIZE);
+    close(conn->socket);
+    free(conn);
+}
 
-    unsigned long rx_octets = 0;
-    ssize_t received = 0;
-    do {
-        rx_octets += received;
-        received = recv(sock, buffer, BUFFER_SIZE, 0);
-    } while (received > 0);
+static void *run_worker(void *data)
+{
+    worker_t *worker = (worker_t *) data;
+    struct epoll_event events[MAX_EVENTS];
+    char *buffer = (char*) malloc(buffer_size);
 
-    if (received < 0) {
-        fprintf(stderr, "server: ERROR! %s\n", strerror(errno));
-    } else {
-        struct timespec end = {0};
-        rc = clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-        if (rc == 0) {
-            long long msecs = (end.tv_sec - start.tv_sec) * 1000LL;
-            end.tv_nsec /= 1000000L;
-            start.tv_nsec /= 1000000L;
-            msecs = (msecs + end.tv_nsec) - start.tv_nsec;
-
-            long double secs = msecs / 1000.0L;
-            long double rate = secs != 0.0L ? ((long double) rx_octets / secs) : 0.0L;
-            const char *suffix = "";
-            rate = humanize_rate(rate, &suffix);
-            fprintf(stdout, "server: recv %lu octets in %.3Lf secs, recv rate=%.3Lf %s/sec\n",
-                    rx_octets, secs, rate, suffix);
-        } else {
-            fprintf(stderr, "server: clock_gettime() ERROR! %s\n", strerror(errno));
+    while (1) {
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "server: epoll_wait() ERROR! %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            connection_t *conn = (connection_t *) events[i].data.ptr;
+
+            // level triggered: one read per wakeup keeps the connections on this worker fair
+            ssize_t received = recv(conn->socket, buffer, buffer_size, MSG_DONTWAIT);
+            if (received > 0) {
+                atomic_fetch_add_explicit(&conn->rx_octets, received, memory_order_relaxed);
+                atomic_fetch_add_explicit(&worker->rx_octets, received, memory_order_relaxed);
+            } else if (received == 0) {
+                connection_close(worker, conn, 0);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                connection_close(worker, conn, received);
+            }
         }
     }
 
-    close(sock);
     free(buffer);
+    return NULL;
+}
+
+static void *run_reporter(void *data)
+{
+    (void) data;  // pthread start routine signature, no argument
+    const char *suffix = "";
+    int64_t start = now_nsec();
+    int64_t last = start;
+    uint64_t last_total = 0;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+        next.tv_sec  += report_msecs / 1000;
+        next.tv_nsec += (report_msecs % 1000) * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec  += 1;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+
+        int64_t now = now_nsec();
+        long double secs = (now - last) / 1e9L;
+        uint64_t total = 0;
+        unsigned int active = 0;
+        for (int i = 0; i < worker_count; ++i) {
+            total  += atomic_load(&workers[i].rx_octets);
+            active += atomic_load(&workers[i].active);
+        }
+        if (active == 0 && total == last_total) {
+            last = now;
+            continue;  // idle, keep quiet
+        }
+
+        long double rate = humanize_rate((total - last_total) / secs, &suffix);
+        fprintf(stdout, "server: [%.6Lf] %.6Lf secs conns=%u recv %"PRIu64" octets, recv rate=%.3Lf %s/sec\n",
+                (now - start) / 1e9L, secs, active, total - last_total, rate, suffix);
+
+        pthread_mutex_lock(&registry_lock);
+        for (connection_t *conn = registry; conn; conn = conn->next) {
+            uint64_t rx_octets = atomic_load(&conn->rx_octets);
+            if (per_connection) {
+                rate = humanize_rate((rx_octets - conn->last_octets) / secs, &suffix);
+                fprintf(stdout, "server:   conn %u recv %"PRIu64" octets, recv rate=%.3Lf %s/sec\n",
+                        conn->id, rx_octets - conn->last_octets, rate, suffix);
+            }
+            conn->last_octets = rx_octets;
+        }
+        pthread_mutex_unlock(&registry_lock);
+        fflush(stdout);
+
+        last = now;
+        last_total = total;
+    }
 
     return NULL;
 }
@@ -130,18 +245,21 @@ static void usage(const char *prog)
     printf("Usage: %s <options>\n", prog);
     printf("-p \tThe TCP port to listen on [%u]\n", DEFAULT_PORT);
     printf("-H \tUse half-close transfer [off]\n");
+    printf("-t \t# of worker threads [%d]\n", worker_count);
+    printf("-b \tReceive buffer size [%zu bytes]\n", buffer_size);
+    printf("-i \tReport interval in msecs, 0 == off [%ld]\n", report_msecs);
+    printf("-v \tReport each connection's rate every interval [off]\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
     unsigned int port = DEFAULT_PORT;
-    bool half_close = false;
 
     /* command line options */
     opterr = 0;
     int c;
-    while ((c = getopt(argc, argv, "p:Hh")) != -1) {
+    while ((c = getopt(argc, argv, "p:Ht:b:i:vh")) != -1) {
         switch(c) {
             case 'h':
                 usage(argv[0]);
@@ -155,12 +273,48 @@ int main(int argc, char** argv)
             case 'H':
                 half_close = true;
                 break;
+            case 't':
+                if (sscanf(optarg, "%d", &worker_count) != 1 || worker_count <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                if (sscanf(optarg, "%zu", &buffer_size) != 1 || buffer_size == 0) {
+                    fprintf(stderr, "Invalid buffer size %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'i':
+                if (sscanf(optarg, "%ld", &report_msecs) != 1 || report_msecs < 0) {
+                    fprintf(stderr, "Invalid report interval %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'v':
+                per_connection = true;
+                break;
             default:
                 usage(argv[0]);
                 break;
         }
     }
 
+    workers = calloc(worker_count, sizeof(worker_t));
+    for (int i = 0; i < worker_count; ++i) {
+        workers[i].epoll_fd = epoll_create1(0);
+        if (workers[i].epoll_fd < 0) {
+            fprintf(stderr, "server: epoll_create1() ERROR! %s\n", strerror(errno));
+            return errno;
+        }
+        pthread_create(&workers[i].thread, NULL, &run_worker, (void*) &workers[i]);
+    }
+
+    if (report_msecs) {
+        pthread_t reporter;
+        pthread_create(&reporter, NULL, &run_reporter, NULL);
+    }
+
     int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) goto egress;
 
@@ -178,26 +332,52 @@ int main(int argc, char** argv)
     err = bind(server_sock, (const struct sockaddr*) &addr, sizeof(addr));
     if (err) goto egress;
 
-    err = listen(server_sock, 1);
+    err = listen(server_sock, SOMAXCONN);
     if (err) goto egress;
 
-    printf("server: Listening for connections on port %d\n", port);
+    printf("server: Listening for connections on port %d, %d worker threads\n", port, worker_count);
+    fflush(stdout);
 
+    unsigned int next_id = 0;
     while (1) {
         int sock = accept(server_sock, NULL, NULL);
         if (sock < 0) goto egress;
 
-        printf("server: Connection accepted\n");
+        opt = 1;
+        err = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*) &opt, sizeof(opt));
+        if (err) {
+            fprintf(stderr, "server: setsockopt() ERROR! %s\n", strerror(errno));
+            close(sock);
+            continue;
+        }
 
-        pthread_t* thread = malloc(sizeof(pthread_t));
-        thread_context_t* context = malloc(sizeof(thread_context_t));
+        if (half_close) {
+            shutdown(sock, SHUT_WR);
+        }
 
-        *context = (thread_context_t) {
-            .socket = sock,
-            .half_close = half_close,
+        connection_t *conn = calloc(1, sizeof(connection_t));
+        conn->socket = sock;
+        conn->id = next_id++;
+        const unsigned int id = conn->id;  // conn may be closed by the worker once added
+        conn->start = now_nsec();
+        registry_insert(conn);
+
+        worker_t *worker = &workers[id % worker_count];
+        atomic_fetch_add(&worker->active, 1);
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLRDHUP,
+            .data.ptr = conn,
         };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+            fprintf(stderr, "server: epoll_ctl() ERROR! %s\n", strerror(errno));
+            registry_remove(conn);
+            atomic_fetch_sub(&worker->active, 1);
+            close(sock);
+            free(conn);
+            continue;
+        }
 
-        pthread_create(thread, NULL, &run, (void*) context);
+        printf("server: Connection %u accepted\n", id);
     }
 
 egress:
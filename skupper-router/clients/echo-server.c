@@ -0,0 +1,258 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// accept TCP connections and echo back everything that is received
+//
+// Server side of rtt-client. Connections are spread round-robin over a small fixed pool of worker threads each running
+// its own epoll loop.
+//
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#define BUFFER_SIZE (4096 * 16)
+#define MAX_EVENTS  64
+
+typedef struct connection {
+    int       socket;
+    unsigned  id;
+    size_t    pending;   // octets in buffer not yet echoed
+    size_t    offset;
+    char     *buffer;
+} connection_t;
+
+typedef struct worker {
+    pthread_t  thread;
+    int        epoll_fd;
+} worker_t;
+
+static worker_t *workers;
+static int       worker_count = 2;
+static bool      verbose = false;
+
+static void connection_close(worker_t *worker, connection_t *conn)
+{
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    close(conn->socket);
+    if (verbose)
+        printf("server: Connection %u closed\n", conn->id);
+    free(conn->buffer);
+    free(conn);
+}
+
+// Write as much of the pending data as possible. Returns false on error.
+//
+static bool connection_flush(worker_t *worker, connection_t *conn)
+{
+    while (conn->pending) {
+        ssize_t sent = send(conn->socket, conn->buffer + conn->offset, conn->pending, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // stop reading until the client drains its side
+                struct epoll_event event = { .events = EPOLLOUT, .data.ptr = conn };
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+                return true;
+            }
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        conn->pending -= sent;
+        conn->offset += sent;
+    }
+
+    conn->offset = 0;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+    return true;
+}
+
+static void *run_worker(void *data)
+{
+    worker_t *worker = (worker_t *) data;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "server: epoll_wait() ERROR! %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            connection_t *conn = (connection_t *) events[i].data.ptr;
+
+            if (conn->pending) {
+                // EPOLLOUT: finish echoing before reading more
+                if (!connection_flush(worker, conn))
+                    connection_close(worker, conn);
+                continue;
+            }
+
+            ssize_t received = recv(conn->socket, conn->buffer, BUFFER_SIZE, MSG_DONTWAIT);
+            if (received > 0) {
+                conn->pending = received;
+                if (!connection_flush(worker, conn)) {
+                    fprintf(stderr, "server: conn %u ERROR! %s\n", conn->id, strerror(errno));
+                    connection_close(worker, conn);
+                }
+            } else if (received == 0) {
+                connection_close(worker, conn);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "server: conn %u ERROR! %s\n", conn->id, strerror(errno));
+                connection_close(worker, conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+#define DEFAULT_PORT 9999U
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <options>\n", prog);
+    printf("-p \tThe TCP port to listen on [%u]\n", DEFAULT_PORT);
+    printf("-t \t# of worker threads [%d]\n", worker_count);
+    printf("-v \tLog each connection [off]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int port = DEFAULT_PORT;
+
+    /* command line options */
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, "p:t:vh")) != -1) {
+        switch(c) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%u", &port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &worker_count) != 1 || worker_count <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    workers = calloc(worker_count, sizeof(worker_t));
+    for (int i = 0; i < worker_count; ++i) {
+        workers[i].epoll_fd = epoll_create1(0);
+        if (workers[i].epoll_fd < 0) {
+            fprintf(stderr, "server: epoll_create1() ERROR! %s\n", strerror(errno));
+            return errno;
+        }
+        pthread_create(&workers[i].thread, NULL, &run_worker, (void*) &workers[i]);
+    }
+
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) goto egress;
+
+    int opt = 1;
+    int err = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (err) goto egress;
+
+    struct sockaddr_in addr = (struct sockaddr_in) {
+        0,
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+
+    err = bind(server_sock, (const struct sockaddr*) &addr, sizeof(addr));
+    if (err) goto egress;
+
+    err = listen(server_sock, SOMAXCONN);
+    if (err) goto egress;
+
+    printf("server: Listening for connections on port %d, %d worker threads\n", port, worker_count);
+    fflush(stdout);
+
+    unsigned int next_id = 0;
+    while (1) {
+        int sock = accept(server_sock, NULL, NULL);
+        if (sock < 0) goto egress;
+
+        opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*) &opt, sizeof(opt));
+
+        connection_t *conn = calloc(1, sizeof(connection_t));
+        conn->socket = sock;
+        conn->id = next_id++;
+        conn->buffer = malloc(BUFFER_SIZE);
+
+        const unsigned int id = conn->id;  // conn may be closed by the worker once added
+        worker_t *worker = &workers[id % worker_count];
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+            fprintf(stderr, "server: epoll_ctl() ERROR! %s\n", strerror(errno));
+            close(sock);
+            free(conn->buffer);
+            free(conn);
+            continue;
+        }
+
+        if (verbose) {
+            printf("server: Connection %u accepted\n", id);
+            fflush(stdout);
+        }
+    }
+
+egress:
+
+    if (errno) {
+        fprintf(stderr, "server: ERROR! %s\n", strerror(errno));
+    }
+
+    if (server_sock > 0) {
+        shutdown(server_sock, SHUT_RDWR);
+    }
+
+    return errno;
+}
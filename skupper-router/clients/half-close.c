@@ -0,0 +1,475 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Half-close propagation benchmark for the tcp adaptor.
+//
+// Acts as both the client and the server behind the router: opens many connections to the router's tcpListener and
+// accepts the matching connections from its tcpConnector. Each connection carries a 4 octet id in both directions so
+// the two ends can be paired. Then shutdown(SHUT_WR) is applied at one or both ends and the time until the EOF
+// appears at the far end is measured. The flows are held half-closed for a while the router's memory and socket
+// count are sampled, then the other sides are shut down and the router is sampled again once everything is closed.
+//
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "router-sample.h"
+
+#define MAX_EVENTS  256
+
+typedef enum {
+    ORDER_CLIENT,   // client shuts down first, server after the hold period
+    ORDER_SERVER,   // server first, client after the hold period
+    ORDER_BOTH,     // both at the same time
+    ORDER_MIXED,    // rotate through the above per connection
+} order_t;
+
+static const char * const order_names[] = {"client", "server", "both", "mixed"};
+
+enum { CLIENT = 0, SERVER = 1 };
+
+// epoll data is either an endpoint of a flow or an accepted socket whose flow is not known yet
+enum { KIND_ENDPOINT, KIND_PENDING };
+
+struct flow;
+
+typedef struct endpoint {
+    int           kind;
+    struct flow  *flow;
+    int           side;
+    int           fd;
+    char          id[4];
+    size_t        id_len;     // octets of the peer's id received
+    int64_t       shut_at;    // when this end shut down its write side, 0 == not yet
+    int64_t       eof_at;     // when this end saw the EOF, 0 == not yet
+} endpoint_t;
+
+typedef struct flow {
+    uint32_t    id;
+    order_t     order;
+    endpoint_t  end[2];
+} flow_t;
+
+static flow_t   *flows;
+static int       flow_count = 100;
+static int       epoll_fd;
+static int       paired;        // flows with both ends connected and ids exchanged
+static int       eof_count;     // EOFs seen
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+static void endpoint_watch(endpoint_t *ep)
+{
+    fcntl(ep->fd, F_SETFL, fcntl(ep->fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = ep };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ep->fd, &event);
+}
+
+static void endpoint_shutdown(endpoint_t *ep)
+{
+    if (!ep->shut_at) {
+        ep->shut_at = now_nsec();
+        shutdown(ep->fd, SHUT_WR);
+    }
+}
+
+// Pending accepted server side socket: read the client's id to find its flow
+typedef struct pending {
+    int     kind;
+    int     fd;
+    char    id[4];
+    size_t  id_len;
+} pending_t;
+
+static void handle_accepted(pending_t *pending)
+{
+    ssize_t rc = recv(pending->fd, pending->id + pending->id_len, 4 - pending->id_len, MSG_DONTWAIT);
+    if (rc <= 0) {
+        if (rc == 0 || (errno != EAGAIN && errno != EINTR)) {
+            fprintf(stderr, "half-close: accepted connection closed before its id arrived\n");
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pending->fd, NULL);
+            close(pending->fd);
+            free(pending);
+        }
+        return;
+    }
+    pending->id_len += rc;
+    if (pending->id_len < 4)
+        return;
+
+    uint32_t id;
+    memcpy(&id, pending->id, 4);
+    id = ntohl(id);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pending->fd, NULL);
+    if (id >= (uint32_t) flow_count || flows[id].end[SERVER].fd >= 0) {
+        fprintf(stderr, "half-close: unexpected flow id %"PRIu32"\n", id);
+        close(pending->fd);
+        free(pending);
+        return;
+    }
+
+    endpoint_t *ep = &flows[id].end[SERVER];
+    ep->fd = pending->fd;
+    ep->id_len = 4;
+    free(pending);
+
+    // echo the id back so the client knows the flow is established end to end
+    uint32_t net_id = htonl(id);
+    send(ep->fd, &net_id, 4, MSG_NOSIGNAL);
+    endpoint_watch(ep);
+}
+
+static void handle_endpoint(endpoint_t *ep)
+{
+    char buffer[4096];
+
+    while (true) {
+        ssize_t rc = recv(ep->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (rc > 0) {
+            if (ep->side == CLIENT && ep->id_len < 4) {
+                size_t take = (size_t) rc < 4 - ep->id_len ? (size_t) rc : 4 - ep->id_len;
+                memcpy(ep->id + ep->id_len, buffer, take);
+                ep->id_len += take;
+                if (ep->id_len == 4)
+                    paired += 1;
+            }
+            continue;
+        }
+        if (rc == 0) {
+            if (!ep->eof_at) {
+                ep->eof_at = now_nsec();
+                eof_count += 1;
+            }
+            // stop polling, the EOF is level triggered
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ep->fd, NULL);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr, "half-close: flow %"PRIu32" %s ERROR! %s\n", ep->flow->id,
+                    ep->side == CLIENT ? "client" : "server", strerror(errno));
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ep->fd, NULL);
+        }
+        return;
+    }
+}
+
+// Wait up to timeout_msec (0 == just poll) for events and process them
+//
+static void service(int listener, int timeout_msec)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_msec);
+    if (count < 0 && errno != EINTR) {
+        fprintf(stderr, "half-close: epoll_wait() ERROR! %s\n", strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < count; ++i) {
+        if (events[i].data.ptr == NULL) {
+            int fd;
+            while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                pending_t *pending = calloc(1, sizeof(pending_t));
+                pending->kind = KIND_PENDING;
+                pending->fd = fd;
+                struct epoll_event event = { .events = EPOLLIN, .data.ptr = pending };
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            }
+        } else if (*(int *) events[i].data.ptr == KIND_ENDPOINT) {
+            handle_endpoint((endpoint_t *) events[i].data.ptr);
+        } else {
+            handle_accepted((pending_t *) events[i].data.ptr);
+        }
+    }
+}
+
+// Process events until done() is true or the deadline passes. Returns true if done.
+//
+static bool run_until(int listener, bool (*done)(void), int64_t deadline)
+{
+    while (!done()) {
+        int64_t now = now_nsec();
+        if (now >= deadline)
+            return false;
+        service(listener, (int) ((deadline - now) / 1000000) + 1);
+    }
+    return true;
+}
+
+static bool all_paired(void) { return paired == flow_count; }
+
+static int expected_eofs;
+static bool eofs_done(void) { return eof_count >= expected_eofs; }
+
+static bool never(void) { return false; }
+
+// Shut down the ends that go first (first == true) or second for each flow
+static int shutdown_phase(bool first)
+{
+    int shut = 0;
+    for (int i = 0; i < flow_count; ++i) {
+        flow_t *flow = &flows[i];
+        switch (flow->order) {
+            case ORDER_CLIENT:
+                endpoint_shutdown(&flow->end[first ? CLIENT : SERVER]);
+                shut += 1;
+                break;
+            case ORDER_SERVER:
+                endpoint_shutdown(&flow->end[first ? SERVER : CLIENT]);
+                shut += 1;
+                break;
+            default:
+                if (first) {
+                    endpoint_shutdown(&flow->end[CLIENT]);
+                    endpoint_shutdown(&flow->end[SERVER]);
+                    shut += 2;
+                }
+                break;
+        }
+    }
+    return shut;
+}
+
+// Report the propagation time of each shutdown from 'from' to the other end
+static void report_latency(int from)
+{
+    int64_t *values = calloc(flow_count, sizeof(int64_t));
+    int count = 0, missing = 0;
+    for (int i = 0; i < flow_count; ++i) {
+        endpoint_t *src = &flows[i].end[from];
+        endpoint_t *dst = &flows[i].end[!from];
+        if (!src->shut_at)
+            continue;
+        if (dst->eof_at)
+            values[count++] = dst->eof_at - src->shut_at;
+        else
+            missing += 1;
+    }
+    if (count + missing == 0) {
+        free(values);
+        return;
+    }
+
+    const char *dir = from == CLIENT ? "client->server" : "server->client";
+    if (count) {
+        qsort(values, count, sizeof(int64_t), compare_i64);
+        fprintf(stdout, "half-close %s: %d propagated, usecs min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f, %d never arrived\n",
+                dir, count, values[0] / 1000.0, values[count / 2] / 1000.0, values[(count * 9) / 10] / 1000.0,
+                values[(count * 99) / 100] / 1000.0, values[count - 1] / 1000.0, missing);
+    } else {
+        fprintf(stdout, "half-close %s: none of %d propagated\n", dir, missing);
+    }
+    free(values);
+}
+
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <options>\n", prog);
+    printf("-p \tThe router's tcpListener port to connect to [8000]\n");
+    printf("-l \tThe port to accept the router's tcpConnector connections on [8800]\n");
+    printf("-c \t# of connections [%d]\n", flow_count);
+    printf("-o \tShutdown order: client, server, both or mixed [client]\n");
+    printf("-H \tHold the flows half-closed for this long [5 secs]\n");
+    printf("-T \tWait this long for connections and EOFs [10 secs]\n");
+    printf("-P \tRouter pid to sample, may be repeated [all skrouterd processes]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int router_port = 8000;
+    unsigned int listen_port = 8800;
+    order_t order = ORDER_CLIENT;
+    double hold = 5.0;
+    double timeout = 10.0;
+
+    /* command line options */
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, "p:l:c:o:H:T:P:h")) != -1) {
+        switch(c) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%u", &router_port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'l':
+                if (sscanf(optarg, "%u", &listen_port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &flow_count) != 1 || flow_count <= 0) {
+                    fprintf(stderr, "Invalid connection count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'o': {
+                bool found = false;
+                for (int i = 0; i < 4 && !found; ++i) {
+                    if (strcmp(optarg, order_names[i]) == 0) {
+                        order = (order_t) i;
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "Invalid order %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            }
+            case 'H':
+                if (sscanf(optarg, "%lf", &hold) != 1 || hold < 0) {
+                    fprintf(stderr, "Invalid hold time %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'T':
+                if (sscanf(optarg, "%lf", &timeout) != 1 || timeout <= 0) {
+                    fprintf(stderr, "Invalid timeout %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'P':
+                add_router(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+    if (router_count == 0)
+        find_routers();
+
+    flows = calloc(flow_count, sizeof(flow_t));
+    for (int i = 0; i < flow_count; ++i) {
+        flows[i].id = i;
+        flows[i].order = order == ORDER_MIXED ? (order_t) (i % 3) : order;
+        for (int side = 0; side < 2; ++side) {
+            flows[i].end[side].flow = &flows[i];
+            flows[i].end[side].side = side;
+            flows[i].end[side].fd = -1;
+        }
+    }
+
+    epoll_fd = epoll_create1(0);
+
+    // server side: accept the router's connections
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int opt = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = (struct sockaddr_in) {
+        0,
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(listen_port)
+    };
+    if (bind(listener, (const struct sockaddr*) &addr, sizeof(addr)) || listen(listener, SOMAXCONN)) {
+        fprintf(stderr, "half-close: cannot listen on port %u: %s\n", listen_port, strerror(errno));
+        return 1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+
+    sample_routers("baseline");
+
+    // client side: connect to the router and send the flow id
+    addr.sin_port = htons(router_port);
+    printf("half-close: Connecting %d connection(s) to port %u, shutdown order %s\n",
+           flow_count, router_port, order_names[order]);
+    fflush(stdout);
+    for (int i = 0; i < flow_count; ++i) {
+        endpoint_t *ep = &flows[i].end[CLIENT];
+        ep->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (ep->fd < 0 || connect(ep->fd, (const struct sockaddr*) &addr, sizeof(addr))) {
+            fprintf(stderr, "half-close: connect ERROR! %s\n", strerror(errno));
+            return 1;
+        }
+        setsockopt(ep->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        uint32_t net_id = htonl(i);
+        send(ep->fd, &net_id, 4, MSG_NOSIGNAL);
+        endpoint_watch(ep);
+        // service the accept side as we go so the router's connector is not held up
+        service(listener, 0);
+    }
+
+    if (!run_until(listener, all_paired, now_nsec() + (int64_t) (timeout * 1e9))) {
+        fprintf(stderr, "half-close: only %d of %d flows established\n", paired, flow_count);
+        return 1;
+    }
+    sample_routers("established");
+
+    // first shutdown and wait for it to arrive at the far ends
+    expected_eofs = shutdown_phase(true);
+    run_until(listener, eofs_done, now_nsec() + (int64_t) (timeout * 1e9));
+
+    // hold half-closed
+    int64_t hold_end = now_nsec() + (int64_t) (hold * 1e9);
+    do {
+        sample_routers("half-closed");
+        int64_t next = now_nsec() + 1000000000LL;
+        run_until(listener, never, next < hold_end ? next : hold_end);
+    } while (now_nsec() < hold_end);
+
+    // close the other direction
+    expected_eofs += shutdown_phase(false);
+    run_until(listener, eofs_done, now_nsec() + (int64_t) (timeout * 1e9));
+
+    report_latency(CLIENT);
+    report_latency(SERVER);
+
+    for (int i = 0; i < flow_count; ++i) {
+        close(flows[i].end[CLIENT].fd);
+        close(flows[i].end[SERVER].fd);
+    }
+    sleep(1);
+    sample_routers("closed");
+
+    return eof_count == expected_eofs ? 0 : 1;
+}
@@ -0,0 +1,748 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// HTTP/1.1 load generator.
+//
+// Keeps many keep-alive connections busy with pipelined requests and parses the responses incrementally
+// (Content-Length, chunked and read-until-close bodies). Body data is counted but never copied. Request latency is
+// recorded into a log-linear histogram. Intended to drive the router's http1 adaptor (see the http1-perf
+// configurations) without depending on external tools like hey or wrk.
+//
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define BUFFER_SIZE (4096 * 16)
+#define MAX_EVENTS  64
+#define MAX_HEADERS 8192
+
+static long double humanize_rate(long double rate, const char **suffix)
+{
+    static const char * const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    const int units_ct = 5;
+    const double base = 1024.0;
+
+    for (int i = 0; i < units_ct; ++i) {
+        if (rate < base) {
+            if (suffix)
+                *suffix = units[i];
+            return rate;
+        }
+        rate /= base;
+    }
+    if (suffix)
+        *suffix = units[units_ct - 1];
+    return rate;
+}
+
+// Log-linear histogram of nanosecond values: 32 linear sub-buckets per power of two (~3% resolution)
+//
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    long double sum;
+} histogram_t;
+
+static int hist_index(uint64_t value)
+{
+    if (value < 2 * HIST_SUB)
+        return (int) value;
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - HIST_SUB_BITS) * HIST_SUB + (int) (value >> (exp - HIST_SUB_BITS));
+}
+
+// lowest value that falls into bucket index
+static uint64_t hist_value(int index)
+{
+    if (index < 2 * HIST_SUB)
+        return index;
+    int exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((uint64_t) (index % HIST_SUB + HIST_SUB)) << (exp - HIST_SUB_BITS);
+}
+
+static void hist_record(histogram_t *hist, uint64_t value)
+{
+    hist->counts[hist_index(value)] += 1;
+    if (hist->total == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->total += 1;
+    hist->sum += value;
+}
+
+static void hist_merge(histogram_t *dst, const histogram_t *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+        dst->counts[i] += src->counts[i];
+    if (src->total && (dst->total == 0 || src->min < dst->min))
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+static uint64_t hist_percentile(const histogram_t *hist, double pct)
+{
+    uint64_t target = (uint64_t) ((pct / 100.0) * hist->total + 0.5);
+    uint64_t seen = 0;
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= target)
+            return hist_value(i) > hist->max ? hist->max : hist_value(i);
+    }
+    return hist->max;
+}
+
+
+typedef enum {
+    ST_HEADERS,     // accumulating the status line and headers
+    ST_BODY,        // Content-Length body
+    ST_BODY_EOF,    // body ends when the server closes
+    ST_CHUNK_SIZE,  // reading a chunk size line
+    ST_CHUNK_DATA,
+    ST_CHUNK_CRLF,  // CRLF after the chunk data
+    ST_TRAILERS,    // trailer lines after the last chunk
+} parse_state_t;
+
+typedef struct connection {
+    int            socket;
+    bool           want_write;
+
+    // transmit
+    size_t         tx_pending;    // octets of queued requests not yet sent
+    size_t         tx_offset;     // offset into the current request
+
+    // ring of queue timestamps of outstanding requests
+    int64_t       *sent_at;
+    unsigned       head;
+    unsigned       count;
+
+    // response parser
+    parse_state_t  state;
+    char           line[MAX_HEADERS];
+    size_t         line_len;
+    uint64_t       body_remaining;
+    int            status;
+    bool           close_after;   // server will close after this response
+} connection_t;
+
+typedef struct worker {
+    pthread_t      thread;
+    int            epoll_fd;
+    connection_t  *conns;
+    int            conn_count;
+    histogram_t    hist;
+    uint64_t       completed;     // after the warmup
+    uint64_t       status[6];     // responses by status class (1xx..5xx), index 0 == unparseable
+    uint64_t       body_octets;   // after the warmup
+    uint64_t       reconnects;
+    uint64_t       errors;        // protocol errors and requests lost to a closed connection
+} worker_t;
+
+static unsigned int  port = 8000;
+static const char   *path = "/t1K.html";
+static const char   *method = "GET";
+static size_t        body_size = 0;
+static unsigned int  depth = 1;         // pipelined requests per connection
+static int64_t       measure_start;     // nsecs, end of warmup
+static int64_t       deadline;          // nsecs
+static char         *requests;          // the request repeated depth times
+static size_t        request_len;
+static bool          head_request;
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void queue_request(connection_t *conn, int64_t now)
+{
+    conn->sent_at[(conn->head + conn->count) % depth] = now;
+    conn->count += 1;
+    conn->tx_pending += request_len;
+}
+
+static bool connection_open(worker_t *worker, connection_t *conn, bool add)
+{
+    struct sockaddr_in addr = (struct sockaddr_in) {
+        0,
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return false;
+    if (connect(sock, (const struct sockaddr*) &addr, sizeof(addr))) {
+        close(sock);
+        return false;
+    }
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*) &opt, sizeof(opt));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    conn->socket = sock;
+    conn->want_write = false;
+    conn->tx_pending = 0;
+    conn->tx_offset = 0;
+    conn->head = 0;
+    conn->count = 0;
+    conn->state = ST_HEADERS;
+    conn->line_len = 0;
+    if (add) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, sock, &event)) {
+            close(sock);
+            conn->socket = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Close the connection and open a new one. Requests still outstanding are counted as errors.
+//
+static bool connection_reopen(worker_t *worker, connection_t *conn, int64_t now)
+{
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    close(conn->socket);
+    conn->socket = -1;
+    worker->errors += conn->count;
+    if (now >= deadline)
+        return false;
+    worker->reconnects += 1;
+    if (!connection_open(worker, conn, true)) {
+        fprintf(stderr, "client: reconnect ERROR! %s\n", strerror(errno));
+        return false;
+    }
+    for (unsigned n = 0; n < depth; ++n)
+        queue_request(conn, now);
+    return true;
+}
+
+// send as much of the queued requests as possible, returns false on error
+static bool connection_flush(worker_t *worker, connection_t *conn)
+{
+    while (conn->tx_pending) {
+        size_t length = (size_t) depth * request_len - conn->tx_offset;
+        if (length > conn->tx_pending)
+            length = conn->tx_pending;
+        ssize_t sent = send(conn->socket, requests + conn->tx_offset, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        conn->tx_pending -= sent;
+        conn->tx_offset = (conn->tx_offset + sent) % request_len;
+    }
+
+    bool want_write = conn->tx_pending > 0;
+    if (want_write != conn->want_write) {
+        struct epoll_event event = {
+            .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+            .data.ptr = conn,
+        };
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+        conn->want_write = want_write;
+    }
+    return true;
+}
+
+static const char *find_header(const char *headers, const char *name)
+{
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(headers, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t')
+                value++;
+            return value;
+        }
+    }
+    return 0;
+}
+
+// case insensitive search for token in a header value
+static bool value_has(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    for (; value && *value && *value != '\r'; ++value) {
+        if (strncasecmp(value, token, len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Parse the status line and headers in conn->line, select the body state. Returns false on a malformed response.
+//
+static bool parse_headers(connection_t *conn)
+{
+    int minor = 0;
+    if (sscanf(conn->line, "HTTP/1.%d %d", &minor, &conn->status) != 2)
+        return false;
+
+    const char *value = find_header(conn->line, "connection");
+    conn->close_after = value_has(value, "close") || (minor == 0 && !value_has(value, "keep-alive"));
+
+    if ((conn->status >= 100 && conn->status < 200) || conn->status == 204 || conn->status == 304 || head_request) {
+        conn->state = ST_BODY;
+        conn->body_remaining = 0;
+    } else if (value_has(find_header(conn->line, "transfer-encoding"), "chunked")) {
+        conn->state = ST_CHUNK_SIZE;
+    } else if ((value = find_header(conn->line, "content-length"))) {
+        conn->state = ST_BODY;
+        conn->body_remaining = strtoull(value, 0, 10);
+    } else {
+        conn->state = ST_BODY_EOF;
+    }
+    return true;
+}
+
+// Accumulate octets into conn->line until terminator is seen. Returns the # of octets consumed and sets *done.
+//
+static ssize_t read_until(connection_t *conn, const char *data, size_t len, const char *terminator, bool *done)
+{
+    size_t term_len = strlen(terminator);
+    size_t space = MAX_HEADERS - 1 - conn->line_len;
+    size_t copy = len < space ? len : space;
+    size_t scan = conn->line_len > term_len - 1 ? conn->line_len - (term_len - 1) : 0;
+
+    memcpy(conn->line + conn->line_len, data, copy);
+    conn->line_len += copy;
+    conn->line[conn->line_len] = 0;
+
+    char *end = memmem(conn->line + scan, conn->line_len - scan, terminator, term_len);
+    if (end) {
+        size_t used = (end + term_len) - conn->line;
+        size_t consumed = copy - (conn->line_len - used);
+        conn->line_len = used;
+        conn->line[used] = 0;
+        *done = true;
+        return consumed;
+    }
+    *done = false;
+    return copy == len ? (ssize_t) copy : -1;  // line too long
+}
+
+static void response_complete(worker_t *worker, connection_t *conn, int64_t now)
+{
+    conn->state = ST_HEADERS;
+    conn->line_len = 0;
+    if (conn->status >= 100 && conn->status < 200)
+        return;  // interim response, the final one follows
+
+    int64_t latency = now - conn->sent_at[conn->head];
+    conn->head = (conn->head + 1) % depth;
+    conn->count -= 1;
+    if (now >= measure_start) {
+        hist_record(&worker->hist, latency);
+        worker->completed += 1;
+        worker->status[conn->status >= 100 && conn->status < 600 ? conn->status / 100 : 0] += 1;
+    }
+    if (now < deadline && !conn->close_after)
+        queue_request(conn, now);
+}
+
+// Run the response parser over received data. Returns false on a protocol error.
+//
+static bool parse_response(worker_t *worker, connection_t *conn, const char *data, size_t len, int64_t now)
+{
+    while (len > 0) {
+        ssize_t used = 0;
+        bool done = false;
+
+        switch (conn->state) {
+            case ST_HEADERS:
+                used = read_until(conn, data, len, "\r\n\r\n", &done);
+                if (used < 0 || (done && !parse_headers(conn)))
+                    return false;
+                if (done) {
+                    conn->line_len = 0;
+                    if (conn->state == ST_BODY && conn->body_remaining == 0)
+                        response_complete(worker, conn, now);
+                }
+                break;
+
+            case ST_BODY:
+            case ST_CHUNK_DATA:
+                used = len < conn->body_remaining ? len : conn->body_remaining;
+                conn->body_remaining -= used;
+                if (now >= measure_start)
+                    worker->body_octets += used;
+                if (conn->body_remaining == 0) {
+                    if (conn->state == ST_BODY) {
+                        response_complete(worker, conn, now);
+                    } else {
+                        conn->state = ST_CHUNK_CRLF;
+                        conn->body_remaining = 2;
+                    }
+                }
+                break;
+
+            case ST_BODY_EOF:
+                used = len;
+                if (now >= measure_start)
+                    worker->body_octets += used;
+                break;
+
+            case ST_CHUNK_CRLF:
+                used = len < conn->body_remaining ? len : conn->body_remaining;
+                conn->body_remaining -= used;
+                if (conn->body_remaining == 0) {
+                    conn->state = ST_CHUNK_SIZE;
+                    conn->line_len = 0;
+                }
+                break;
+
+            case ST_CHUNK_SIZE:
+                used = read_until(conn, data, len, "\r\n", &done);
+                if (used < 0)
+                    return false;
+                if (done) {
+                    char *end = 0;
+                    conn->body_remaining = strtoull(conn->line, &end, 16);
+                    if (end == conn->line)
+                        return false;
+                    conn->line_len = 0;
+                    conn->state = conn->body_remaining ? ST_CHUNK_DATA : ST_TRAILERS;
+                }
+                break;
+
+            case ST_TRAILERS:
+                used = read_until(conn, data, len, "\r\n", &done);
+                if (used < 0)
+                    return false;
+                if (done) {
+                    if (conn->line_len == 2)
+                        response_complete(worker, conn, now);  // empty line ends the trailers
+                    conn->line_len = 0;
+                }
+                break;
+        }
+
+        data += used;
+        len -= used;
+    }
+    return true;
+}
+
+static void *run_worker(void *data)
+{
+    worker_t *worker = (worker_t *) data;
+    struct epoll_event events[MAX_EVENTS];
+    char *buffer = malloc(BUFFER_SIZE);
+    int active = worker->conn_count;
+
+    int64_t now = now_nsec();
+    for (int i = 0; i < worker->conn_count; ++i) {
+        connection_t *conn = &worker->conns[i];
+        for (unsigned n = 0; n < depth; ++n)
+            queue_request(conn, now);
+        connection_flush(worker, conn);
+    }
+
+    while (active > 0) {
+        now = now_nsec();
+        if (now >= deadline)
+            break;
+        int timeout = (int) ((deadline - now) / 1000000) + 1;
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "client: epoll_wait() ERROR! %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            connection_t *conn = (connection_t *) events[i].data.ptr;
+            bool reopen = false;
+
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ssize_t received = recv(conn->socket, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+                now = now_nsec();
+                if (received > 0) {
+                    if (!parse_response(worker, conn, buffer, received, now)) {
+                        fprintf(stderr, "client: malformed response, reconnecting\n");
+                        worker->errors += 1;
+                        reopen = true;
+                    } else if (conn->close_after && conn->state == ST_HEADERS) {
+                        reopen = true;  // response complete and the server is closing
+                    }
+                } else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    if (conn->state == ST_BODY_EOF)
+                        response_complete(worker, conn, now);
+                    reopen = true;
+                }
+            }
+
+            if (reopen) {
+                if (!connection_reopen(worker, conn, now)) {
+                    active -= 1;
+                    continue;
+                }
+            }
+
+            if (!connection_flush(worker, conn)) {
+                if (!connection_reopen(worker, conn, now_nsec()))
+                    active -= 1;
+            }
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+static void write_histogram(const char *file, const histogram_t *hist)
+{
+    FILE *out = fopen(file, "w");
+    if (!out) {
+        fprintf(stderr, "client: cannot open %s: %s\n", file, strerror(errno));
+        return;
+    }
+    fprintf(out, "latency_usec,count,cumulative_pct\n");
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        if (hist->counts[i] == 0)
+            continue;
+        seen += hist->counts[i];
+        fprintf(out, "%.3f,%"PRIu64",%.6f\n", hist_value(i) / 1000.0, hist->counts[i],
+                (100.0 * seen) / hist->total);
+    }
+    fclose(out);
+}
+
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <options>\n", prog);
+    printf("-p \tThe TCP port to connect to [%u]\n", port);
+    printf("-u \tRequest path [%s]\n", path);
+    printf("-m \tRequest method [%s]\n", method);
+    printf("-b \tRequest body size, sent with Content-Length [%zu octets]\n", body_size);
+    printf("-c \t# of keep-alive connections [10]\n");
+    printf("-P \tPipeline depth: requests outstanding per connection [%u]\n", depth);
+    printf("-d \tTest duration [10 secs]\n");
+    printf("-w \tWarmup period excluded from the results [1 secs]\n");
+    printf("-t \t# of threads [2]\n");
+    printf("-o \tWrite the latency histogram as CSV to this file [off]\n");
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int conn_count = 10;
+    int thread_count = 2;
+    double duration = 10.0;
+    double warmup = 1.0;
+    const char *hist_file = 0;
+
+    /* command line options */
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, "p:u:m:b:c:P:d:w:t:o:h")) != -1) {
+        switch(c) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%u", &port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            case 'm':
+                method = optarg;
+                break;
+            case 'b':
+                if (sscanf(optarg, "%zu", &body_size) != 1) {
+                    fprintf(stderr, "Invalid body size %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &conn_count) != 1 || conn_count <= 0) {
+                    fprintf(stderr, "Invalid connection count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'P':
+                if (sscanf(optarg, "%u", &depth) != 1 || depth == 0) {
+                    fprintf(stderr, "Invalid pipeline depth %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                if (sscanf(optarg, "%lf", &duration) != 1 || duration <= 0) {
+                    fprintf(stderr, "Invalid duration %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'w':
+                if (sscanf(optarg, "%lf", &warmup) != 1 || warmup < 0) {
+                    fprintf(stderr, "Invalid warmup %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &thread_count) != 1 || thread_count <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'o':
+                hist_file = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+    if (thread_count > conn_count)
+        thread_count = conn_count;
+    head_request = strcasecmp(method, "HEAD") == 0;
+
+    // build the request once, repeated depth times so a whole pipeline can be sent with one call
+    char header[1024];
+    int header_len = snprintf(header, sizeof(header), "%s %s HTTP/1.1\r\nHost: 127.0.0.1:%u\r\n", method, path, port);
+    if (body_size)
+        header_len += snprintf(header + header_len, sizeof(header) - header_len, "Content-Length: %zu\r\n", body_size);
+    header_len += snprintf(header + header_len, sizeof(header) - header_len, "\r\n");
+    request_len = header_len + body_size;
+    requests = malloc(request_len * depth);
+    for (unsigned n = 0; n < depth; ++n) {
+        memcpy(requests + n * request_len, header, header_len);
+        memset(requests + n * request_len + header_len, 'x', body_size);
+    }
+
+    worker_t *workers = calloc(thread_count, sizeof(worker_t));
+    for (int i = 0; i < thread_count; ++i) {
+        workers[i].epoll_fd = epoll_create1(0);
+        workers[i].conns = calloc(conn_count / thread_count + 1, sizeof(connection_t));
+    }
+
+    int result = 0;
+    printf("client: Connecting %d connection(s) to port %u\n", conn_count, port);
+
+    for (int i = 0; i < conn_count; ++i) {
+        worker_t *worker = &workers[i % thread_count];
+        connection_t *conn = &worker->conns[worker->conn_count];
+        conn->sent_at = calloc(depth, sizeof(int64_t));
+        if (!connection_open(worker, conn, true)) {
+            fprintf(stderr, "client: connect ERROR! %s\n", strerror(errno));
+            result = 1;
+            goto egress;
+        }
+        worker->conn_count += 1;
+    }
+
+    printf("client: Connected, %s %s pipeline depth %u for %.1f secs\n", method, path, depth, duration);
+    fflush(stdout);
+
+    int64_t start = now_nsec();
+    measure_start = start + (int64_t) (warmup * 1e9);
+    deadline = measure_start + (int64_t) (duration * 1e9);
+
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_create(&workers[i].thread, NULL, &run_worker, (void*) &workers[i]);
+    }
+
+    histogram_t *hist = calloc(1, sizeof(histogram_t));
+    uint64_t completed = 0, body_octets = 0, reconnects = 0, errors = 0;
+    uint64_t status[6] = {0};
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(hist, &workers[i].hist);
+        completed += workers[i].completed;
+        body_octets += workers[i].body_octets;
+        reconnects += workers[i].reconnects;
+        errors += workers[i].errors;
+        for (int s = 0; s < 6; ++s)
+            status[s] += workers[i].status[s];
+    }
+
+    long double secs = (now_nsec() - measure_start) / 1e9L;
+    const char *suffix = "";
+    long double rate = humanize_rate(secs > 0 ? body_octets / secs : 0.0L, &suffix);
+    fprintf(stdout, "client: %"PRIu64" responses in %.6Lf secs, rate=%.1Lf req/sec, body rate=%.3Lf %s/sec\n",
+            completed, secs, secs > 0 ? completed / secs : 0.0L, rate, suffix);
+    fprintf(stdout, "client: status 2xx=%"PRIu64" 3xx=%"PRIu64" 4xx=%"PRIu64" 5xx=%"PRIu64" other=%"PRIu64
+            ", errors=%"PRIu64" reconnects=%"PRIu64"\n",
+            status[2], status[3], status[4], status[5], status[0] + status[1], errors, reconnects);
+    if (hist->total) {
+        fprintf(stdout, "client: latency usecs min=%.1f mean=%.1Lf p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f p99.99=%.1f max=%.1f\n",
+                hist->min / 1000.0, hist->sum / hist->total / 1000.0L,
+                hist_percentile(hist, 50.0) / 1000.0, hist_percentile(hist, 90.0) / 1000.0,
+                hist_percentile(hist, 99.0) / 1000.0, hist_percentile(hist, 99.9) / 1000.0,
+                hist_percentile(hist, 99.99) / 1000.0, hist->max / 1000.0);
+        if (hist_file)
+            write_histogram(hist_file, hist);
+    }
+
+egress:
+
+    // connections that failed to reopen at the deadline are already closed
+    for (int i = 0; i < thread_count; ++i) {
+        for (int j = 0; j < workers[i].conn_count; ++j) {
+            if (workers[i].conns[j].socket >= 0)
+                close(workers[i].conns[j].socket);
+        }
+    }
+    exit(result);
+}
@@ -0,0 +1,107 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Router resource sampling shared by the tcp/http adaptor stress clients (half-close, abort-storm): finds the running
+// skrouterd processes, or takes their pids from the command line, and prints each router's RSS and open socket count
+// from /proc.
+//
+
+#ifndef ROUTER_SAMPLE_H
+#define ROUTER_SAMPLE_H
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MAX_ROUTERS 16
+
+static pid_t routers[MAX_ROUTERS];
+static int   router_count;
+
+// add a router by pid, e.g. from a command line option
+static void add_router(const char *pid)
+{
+    if (router_count < MAX_ROUTERS)
+        routers[router_count++] = atoi(pid);
+}
+
+// find all running skrouterd processes
+static void find_routers(void)
+{
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    while (proc && (entry = readdir(proc)) && router_count < MAX_ROUTERS) {
+        if (!isdigit((unsigned char) entry->d_name[0]))
+            continue;
+        char path[300], comm[64] = {0};
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        if (fgets(comm, sizeof(comm), f) && strcmp(comm, "skrouterd\n") == 0)
+            routers[router_count++] = atoi(entry->d_name);
+        fclose(f);
+    }
+    if (proc)
+        closedir(proc);
+}
+
+// print "router <pid> <label> rss=N KiB sockets=N" for each router
+static void sample_routers(const char *label)
+{
+    for (int i = 0; i < router_count; ++i) {
+        char path[64], line[256];
+        char link[320], target[64];
+        long rss_kb = -1;
+        int sockets = 0;
+
+        snprintf(path, sizeof(path), "/proc/%d/status", routers[i]);
+        FILE *f = fopen(path, "r");
+        while (f && fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "VmRSS:", 6) == 0)
+                rss_kb = strtol(line + 6, 0, 10);
+        }
+        if (f)
+            fclose(f);
+
+        snprintf(path, sizeof(path), "/proc/%d/fd", routers[i]);
+        DIR *dir = opendir(path);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir))) {
+            snprintf(link, sizeof(link), "%s/%s", path, entry->d_name);
+            ssize_t len = readlink(link, target, sizeof(target) - 1);
+            if (len > 0) {
+                target[len] = 0;
+                sockets += strncmp(target, "socket:", 7) == 0;
+            }
+        }
+        if (dir)
+            closedir(dir);
+
+        fprintf(stdout, "router %d %-12s rss=%ld KiB sockets=%d\n", routers[i], label, rss_kb, sockets);
+    }
+    fflush(stdout);
+}
+
+#endif // ROUTER_SAMPLE_H
@@ -0,0 +1,455 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Measure TCP request/response round trip time.
+//
+// Opens many connections to an echo-server (usually through a router's tcpListener/tcpConnector pair) and keeps a
+// fixed number of fixed-size requests outstanding on each. A request completes when the same number of octets has
+// been echoed back. Round trip times are recorded into a log-linear histogram.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define BUFFER_SIZE (4096 * 16)
+#define MAX_EVENTS  64
+
+// Log-linear histogram of nanosecond values: 32 linear sub-buckets per power of two (~3% resolution)
+//
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    long double sum;
+} histogram_t;
+
+static int hist_index(uint64_t value)
+{
+    if (value < 2 * HIST_SUB)
+        return (int) value;
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - HIST_SUB_BITS) * HIST_SUB + (int) (value >> (exp - HIST_SUB_BITS));
+}
+
+// lowest value that falls into bucket index
+static uint64_t hist_value(int index)
+{
+    if (index < 2 * HIST_SUB)
+        return index;
+    int exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((uint64_t) (index % HIST_SUB + HIST_SUB)) << (exp - HIST_SUB_BITS);
+}
+
+static void hist_record(histogram_t *hist, uint64_t value)
+{
+    hist->counts[hist_index(value)] += 1;
+    if (hist->total == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    hist->total += 1;
+    hist->sum += value;
+}
+
+static void hist_merge(histogram_t *dst, const histogram_t *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+        dst->counts[i] += src->counts[i];
+    if (src->total && (dst->total == 0 || src->min < dst->min))
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+static uint64_t hist_percentile(const histogram_t *hist, double pct)
+{
+    uint64_t target = (uint64_t) ((pct / 100.0) * hist->total + 0.5);
+    uint64_t seen = 0;
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= target)
+            return hist_value(i) > hist->max ? hist->max : hist_value(i);
+    }
+    return hist->max;
+}
+
+
+typedef struct connection {
+    int        socket;
+    size_t     tx_pending;   // octets of queued requests not yet sent
+    size_t     rx_partial;   // octets received towards the oldest outstanding request
+    int64_t   *sent_at;      // ring of send timestamps of outstanding requests
+    unsigned   head;
+    unsigned   count;
+    bool       want_write;
+} connection_t;
+
+typedef struct worker {
+    pthread_t      thread;
+    int            epoll_fd;
+    connection_t  *conns;
+    int            conn_count;
+    histogram_t    hist;
+    uint64_t       completed;  // after the warmup
+    bool           failed;
+} worker_t;
+
+static unsigned int  outstanding = 1;
+static size_t        request_size = 64;
+static int64_t       measure_start;  // nsecs, end of warmup
+static int64_t       deadline;       // nsecs
+static char         *payload;        // BUFFER_SIZE octets of request content
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void queue_request(connection_t *conn, int64_t now)
+{
+    conn->sent_at[(conn->head + conn->count) % outstanding] = now;
+    conn->count += 1;
+    conn->tx_pending += request_size;
+}
+
+// send as much of the queued requests as possible, returns false on error
+static bool connection_flush(worker_t *worker, connection_t *conn)
+{
+    while (conn->tx_pending) {
+        // request content is constant so queued requests are sent back to back from the same payload
+        size_t length = conn->tx_pending < BUFFER_SIZE ? conn->tx_pending : BUFFER_SIZE;
+        ssize_t sent = send(conn->socket, payload, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        conn->tx_pending -= sent;
+    }
+
+    bool want_write = conn->tx_pending > 0;
+    if (want_write != conn->want_write) {
+        struct epoll_event event = {
+            .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+            .data.ptr = conn,
+        };
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+        conn->want_write = want_write;
+    }
+    return true;
+}
+
+static void *run_worker(void *data)
+{
+    worker_t *worker = (worker_t *) data;
+    struct epoll_event events[MAX_EVENTS];
+    char *buffer = malloc(BUFFER_SIZE);
+    int active = worker->conn_count;
+
+    int64_t now = now_nsec();
+    for (int i = 0; i < worker->conn_count; ++i) {
+        connection_t *conn = &worker->conns[i];
+        for (unsigned n = 0; n < outstanding; ++n)
+            queue_request(conn, now);
+        if (!connection_flush(worker, conn)) {
+            fprintf(stderr, "client: send ERROR! %s\n", strerror(errno));
+            worker->failed = true;
+            return NULL;
+        }
+    }
+
+    while (active > 0) {
+        now = now_nsec();
+        if (now >= deadline)
+            break;
+        int timeout = (int) ((deadline - now) / 1000000) + 1;
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "client: epoll_wait() ERROR! %s\n", strerror(errno));
+            worker->failed = true;
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            connection_t *conn = (connection_t *) events[i].data.ptr;
+
+            if (events[i].events & EPOLLIN) {
+                ssize_t received = recv(conn->socket, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+                if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    fprintf(stderr, "client: connection closed by peer: %s\n",
+                            received == 0 ? "EOF" : strerror(errno));
+                    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+                    worker->failed = true;
+                    active -= 1;
+                    continue;
+                }
+                if (received > 0) {
+                    now = now_nsec();
+                    conn->rx_partial += received;
+                    while (conn->rx_partial >= request_size && conn->count) {
+                        conn->rx_partial -= request_size;
+                        int64_t rtt = now - conn->sent_at[conn->head];
+                        conn->head = (conn->head + 1) % outstanding;
+                        conn->count -= 1;
+                        if (now >= measure_start) {
+                            hist_record(&worker->hist, rtt);
+                            worker->completed += 1;
+                        }
+                        if (now < deadline)
+                            queue_request(conn, now);
+                    }
+                }
+            }
+
+            if (!connection_flush(worker, conn)) {
+                fprintf(stderr, "client: send ERROR! %s\n", strerror(errno));
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+                worker->failed = true;
+                active -= 1;
+            }
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+static void write_histogram(const char *path, const histogram_t *hist)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "client: cannot open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fprintf(out, "rtt_usec,count,cumulative_pct\n");
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        if (hist->counts[i] == 0)
+            continue;
+        seen += hist->counts[i];
+        fprintf(out, "%.3f,%"PRIu64",%.6f\n", hist_value(i) / 1000.0, hist->counts[i],
+                (100.0 * seen) / hist->total);
+    }
+    fclose(out);
+}
+
+
+#define DEFAULT_PORT 9999U
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <options>\n", prog);
+    printf("-p \tThe TCP port to connect to [%u]\n", DEFAULT_PORT);
+    printf("-c \t# of connections [1]\n");
+    printf("-n \t# of requests outstanding per connection [%u]\n", outstanding);
+    printf("-s \tRequest size [%zu octets]\n", request_size);
+    printf("-d \tTest duration [10 secs]\n");
+    printf("-w \tWarmup period excluded from the results [1 secs]\n");
+    printf("-t \t# of threads [2]\n");
+    printf("-o \tWrite the RTT histogram as CSV to this file [off]\n");
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned int port = DEFAULT_PORT;
+    int conn_count = 1;
+    int thread_count = 2;
+    double duration = 10.0;
+    double warmup = 1.0;
+    const char *hist_file = 0;
+
+    /* command line options */
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, "p:c:n:s:d:w:t:o:h")) != -1) {
+        switch(c) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%u", &port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &conn_count) != 1 || conn_count <= 0) {
+                    fprintf(stderr, "Invalid connection count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                if (sscanf(optarg, "%u", &outstanding) != 1 || outstanding == 0) {
+                    fprintf(stderr, "Invalid outstanding count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                if (sscanf(optarg, "%zu", &request_size) != 1 || request_size == 0) {
+                    fprintf(stderr, "Invalid request size %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                if (sscanf(optarg, "%lf", &duration) != 1 || duration <= 0) {
+                    fprintf(stderr, "Invalid duration %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'w':
+                if (sscanf(optarg, "%lf", &warmup) != 1 || warmup < 0) {
+                    fprintf(stderr, "Invalid warmup %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &thread_count) != 1 || thread_count <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'o':
+                hist_file = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+    if (thread_count > conn_count)
+        thread_count = conn_count;
+
+    payload = malloc(BUFFER_SIZE);
+    memset(payload, 'x', BUFFER_SIZE);
+
+    worker_t *workers = calloc(thread_count, sizeof(worker_t));
+    for (int i = 0; i < thread_count; ++i) {
+        workers[i].epoll_fd = epoll_create1(0);
+        workers[i].conns = calloc(conn_count / thread_count + 1, sizeof(connection_t));
+    }
+
+    struct sockaddr_in addr = (struct sockaddr_in) {
+        0,
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+
+    printf("client: Connecting %d connection(s) to port %d\n", conn_count, port);
+
+    for (int i = 0; i < conn_count; ++i) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) goto egress;
+
+        int err = connect(sock, (const struct sockaddr*) &addr, sizeof(addr));
+        if (err) goto egress;
+
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*) &opt, sizeof(opt));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+        worker_t *worker = &workers[i % thread_count];
+        connection_t *conn = &worker->conns[worker->conn_count++];
+        conn->socket = sock;
+        conn->sent_at = calloc(outstanding, sizeof(int64_t));
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, sock, &event)) goto egress;
+    }
+
+    printf("client: Connected, %u x %zu octet requests outstanding per connection for %.1f secs\n",
+           outstanding, request_size, duration);
+    fflush(stdout);
+
+    int64_t start = now_nsec();
+    measure_start = start + (int64_t) (warmup * 1e9);
+    deadline = measure_start + (int64_t) (duration * 1e9);
+
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_create(&workers[i].thread, NULL, &run_worker, (void*) &workers[i]);
+    }
+
+    histogram_t *hist = calloc(1, sizeof(histogram_t));
+    uint64_t completed = 0;
+    bool failed = false;
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(hist, &workers[i].hist);
+        completed += workers[i].completed;
+        failed = failed || workers[i].failed;
+    }
+
+    long double secs = (now_nsec() - measure_start) / 1e9L;
+    fprintf(stdout, "client: %"PRIu64" requests in %.6Lf secs, rate=%.1Lf req/sec\n",
+            completed, secs, secs > 0 ? completed / secs : 0.0L);
+    if (hist->total) {
+        fprintf(stdout, "client: RTT usecs min=%.1f mean=%.1Lf p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f p99.99=%.1f max=%.1f\n",
+                hist->min / 1000.0, hist->sum / hist->total / 1000.0L,
+                hist_percentile(hist, 50.0) / 1000.0, hist_percentile(hist, 90.0) / 1000.0,
+                hist_percentile(hist, 99.0) / 1000.0, hist_percentile(hist, 99.9) / 1000.0,
+                hist_percentile(hist, 99.99) / 1000.0, hist->max / 1000.0);
+        if (hist_file)
+            write_histogram(hist_file, hist);
+    }
+    errno = failed ? EIO : 0;
+
+egress:
+
+    if (errno) {
+        fprintf(stderr, "client: ERROR! %s\n", strerror(errno));
+    }
+
+    for (int i = 0; i < thread_count; ++i) {
+        for (int j = 0; j < workers[i].conn_count; ++j)
+            close(workers[i].conns[j].socket);
+    }
+    exit(errno);
+}
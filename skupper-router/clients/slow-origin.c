@@ -0,0 +1,815 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+//
+// Event driven slow HTTP/1.1 origin server.
+//
+// Emulates a large population of slow backends: each request is answered after a delay and with a response body
+// whose sizes are drawn from configurable distributions. Reading requests and writing responses can each be limited
+// to a byte rate per connection. Connections are spread over a small fixed pool of epoll worker threads.
+//
+// Distributions are given as:
+//     N               constant value N
+//     const:N         constant value N
+//     uniform:A:B     uniformly distributed between A and B
+//     exp:M           exponentially distributed with mean M
+// Values may have a K, M or G suffix (x1024).
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define INPUT_SIZE  (4096 * 4)
+#define BODY_SIZE   (4096 * 16)
+#define MAX_EVENTS  64
+
+static long double humanize_rate(long double rate, const char **suffix)
+{
+    static const char * const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    const int units_ct = 5;
+    const double base = 1024.0;
+
+    for (int i = 0; i < units_ct; ++i) {
+        if (rate < base) {
+            if (suffix)
+                *suffix = units[i];
+            return rate;
+        }
+        rate /= base;
+    }
+    if (suffix)
+        *suffix = units[units_ct - 1];
+    return rate;
+}
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+typedef enum {
+    DIST_CONST,
+    DIST_UNIFORM,
+    DIST_EXP,
+} dist_type_t;
+
+typedef struct dist {
+    dist_type_t type;
+    double      a;
+    double      b;
+} dist_t;
+
+static int parse_value(const char *str, double *value)
+{
+    char *end = 0;
+    *value = strtod(str, &end);
+    if (end == str)
+        return -1;
+    switch (*end) {
+        case 'K': *value *= 1024.0; end++; break;
+        case 'M': *value *= 1024.0 * 1024.0; end++; break;
+        case 'G': *value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+        default: break;
+    }
+    return (*end == 0 || *end == ':') && *value >= 0 ? 0 : -1;
+}
+
+static int parse_dist(const char *str, dist_t *dist)
+{
+    if (strncmp(str, "const:", 6) == 0) {
+        dist->type = DIST_CONST;
+        return parse_value(str + 6, &dist->a);
+    } else if (strncmp(str, "uniform:", 8) == 0) {
+        dist->type = DIST_UNIFORM;
+        const char *sep = strchr(str + 8, ':');
+        if (!sep || parse_value(str + 8, &dist->a) || parse_value(sep + 1, &dist->b) || dist->b < dist->a)
+            return -1;
+        return 0;
+    } else if (strncmp(str, "exp:", 4) == 0) {
+        dist->type = DIST_EXP;
+        return parse_value(str + 4, &dist->a);
+    }
+    dist->type = DIST_CONST;
+    return parse_value(str, &dist->a);
+}
+
+// xorshift64* - one generator per worker thread
+static double random_unit(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+static double dist_sample(const dist_t *dist, uint64_t *rng)
+{
+    switch (dist->type) {
+        case DIST_UNIFORM:
+            return dist->a + (dist->b - dist->a) * random_unit(rng);
+        case DIST_EXP:
+            return -dist->a * log(1.0 - random_unit(rng));
+        default:
+            return dist->a;
+    }
+}
+
+
+// Token bucket used to limit a connection's read or write rate. Allows a burst of 100 msecs worth of octets.
+//
+typedef struct bucket {
+    double   tokens;
+    int64_t  last;
+} bucket_t;
+
+static size_t bucket_allow(bucket_t *bucket, uint64_t rate, size_t want, int64_t now)
+{
+    if (!rate)
+        return want;
+    double burst = rate / 10.0 > 1.0 ? rate / 10.0 : 1.0;
+    bucket->tokens += (now - bucket->last) * (double) rate / 1e9;
+    bucket->last = now;
+    if (bucket->tokens > burst)
+        bucket->tokens = burst;
+    return bucket->tokens >= 1.0 ? ((size_t) bucket->tokens < want ? (size_t) bucket->tokens : want) : 0;
+}
+
+// when enough tokens for the next transfer (10 msecs worth, at least 1 octet) will be available
+static int64_t bucket_ready_at(const bucket_t *bucket, uint64_t rate, int64_t now)
+{
+    double quantum = rate / 100.0 > 1.0 ? rate / 100.0 : 1.0;
+    double needed = quantum - bucket->tokens;
+    return needed > 0 ? now + (int64_t) (needed * 1e9 / rate) : now;
+}
+
+
+typedef enum {
+    ST_HEADERS,     // reading request headers
+    ST_BODY,        // reading the request body
+    ST_DELAY,       // waiting before responding
+    ST_RESPONSE,    // writing the response
+} conn_state_t;
+
+typedef struct connection {
+    int            socket;
+    unsigned int   id;
+    conn_state_t   state;
+    uint32_t       events;        // current epoll interest
+    int            heap_index;    // position in the worker's timer heap, -1 if no timer
+    int64_t        timer;         // nsecs
+
+    char           input[INPUT_SIZE];
+    size_t         input_len;
+    size_t         scanned;       // input octets already searched for the end of headers
+    uint64_t       body_remaining;
+    bool           close_after;
+
+    char           header[128];
+    size_t         header_len;
+    uint64_t       response_remaining;  // header + body octets still to write
+    uint64_t       response_len;
+
+    bucket_t       read_bucket;
+    bucket_t       write_bucket;
+    bool           write_blocked; // socket full: the peer (router) is not reading
+
+    // statistics
+    int64_t        start;
+    int64_t        blocked_since;
+    int64_t        blocked_total;
+    uint64_t       requests;
+    uint64_t       octets_in;
+    uint64_t       octets_out;
+} connection_t;
+
+typedef struct worker {
+    pthread_t              thread;
+    int                    epoll_fd;
+    uint64_t               rng;
+    connection_t         **heap;      // timer min-heap
+    int                    heap_len;
+    int                    heap_size;
+
+    atomic_uint_fast64_t   requests;
+    atomic_uint_fast64_t   octets_in;
+    atomic_uint_fast64_t   octets_out;
+    atomic_uint            active;
+    atomic_uint            delaying;
+    atomic_uint            blocked;
+} worker_t;
+
+static worker_t     *workers;
+static int           worker_count = 4;
+static dist_t        delay_dist = {DIST_CONST, 100.0, 0};  // msecs
+static dist_t        size_dist = {DIST_CONST, 0, 0};       // octets
+static uint64_t      read_rate;    // octets/sec per connection, 0 == unlimited
+static uint64_t      write_rate;
+static bool          verbose = false;
+static char         *body;         // BODY_SIZE octets of response content
+
+
+static void heap_swap(worker_t *worker, int i, int j)
+{
+    connection_t *tmp = worker->heap[i];
+    worker->heap[i] = worker->heap[j];
+    worker->heap[j] = tmp;
+    worker->heap[i]->heap_index = i;
+    worker->heap[j]->heap_index = j;
+}
+
+static void heap_fix(worker_t *worker, int i)
+{
+    while (i > 0 && worker->heap[(i - 1) / 2]->timer > worker->heap[i]->timer) {
+        heap_swap(worker, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (true) {
+        int smallest = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < worker->heap_len && worker->heap[left]->timer < worker->heap[smallest]->timer)
+            smallest = left;
+        if (right < worker->heap_len && worker->heap[right]->timer < worker->heap[smallest]->timer)
+            smallest = right;
+        if (smallest == i)
+            break;
+        heap_swap(worker, i, smallest);
+        i = smallest;
+    }
+}
+
+static void timer_cancel(worker_t *worker, connection_t *conn)
+{
+    int i = conn->heap_index;
+    if (i < 0)
+        return;
+    conn->heap_index = -1;
+    worker->heap_len -= 1;
+    if (i != worker->heap_len) {
+        worker->heap[i] = worker->heap[worker->heap_len];
+        worker->heap[i]->heap_index = i;
+        heap_fix(worker, i);
+    }
+}
+
+static void timer_set(worker_t *worker, connection_t *conn, int64_t when)
+{
+    timer_cancel(worker, conn);
+    if (worker->heap_len == worker->heap_size) {
+        worker->heap_size = worker->heap_size ? worker->heap_size * 2 : 64;
+        worker->heap = realloc(worker->heap, worker->heap_size * sizeof(connection_t *));
+    }
+    conn->timer = when;
+    conn->heap_index = worker->heap_len++;
+    worker->heap[conn->heap_index] = conn;
+    heap_fix(worker, conn->heap_index);
+}
+
+
+static void set_blocked(worker_t *worker, connection_t *conn, bool blocked, int64_t now)
+{
+    if (blocked == conn->write_blocked)
+        return;
+    conn->write_blocked = blocked;
+    if (blocked) {
+        conn->blocked_since = now;
+        atomic_fetch_add(&worker->blocked, 1);
+    } else {
+        conn->blocked_total += now - conn->blocked_since;
+        atomic_fetch_sub(&worker->blocked, 1);
+    }
+}
+
+static void set_events(worker_t *worker, connection_t *conn, uint32_t events)
+{
+    if (events != conn->events) {
+        struct epoll_event event = { .events = events, .data.ptr = conn };
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+        conn->events = events;
+    }
+}
+
+static void connection_close(worker_t *worker, connection_t *conn, int64_t now)
+{
+    set_blocked(worker, conn, false, now);
+    if (conn->state == ST_DELAY)
+        atomic_fetch_sub(&worker->delaying, 1);
+    timer_cancel(worker, conn);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    close(conn->socket);
+    atomic_fetch_sub(&worker->active, 1);
+
+    if (verbose) {
+        long double secs = (now - conn->start) / 1e9L;
+        fprintf(stdout, "server: conn %u closed after %.3Lf secs: requests=%"PRIu64" in=%"PRIu64" out=%"PRIu64
+                " write blocked %.3Lf secs (%.1Lf%%)\n",
+                conn->id, secs, conn->requests, conn->octets_in, conn->octets_out,
+                conn->blocked_total / 1e9L, secs > 0 ? 100.0L * conn->blocked_total / 1e9L / secs : 0.0L);
+        fflush(stdout);
+    }
+    free(conn);
+}
+
+// Read from the socket into the input buffer, subject to the read rate. Returns the # of octets read, 0 if nothing
+// could be read now, -1 if the connection closed.
+//
+static ssize_t connection_read(worker_t *worker, connection_t *conn, int64_t now)
+{
+    size_t space = INPUT_SIZE - conn->input_len;
+    size_t allowed = bucket_allow(&conn->read_bucket, read_rate, space, now);
+    if (allowed == 0)
+        return 0;
+
+    ssize_t received = recv(conn->socket, conn->input + conn->input_len, allowed, MSG_DONTWAIT);
+    if (received > 0) {
+        conn->input_len += received;
+        conn->octets_in += received;
+        atomic_fetch_add_explicit(&worker->octets_in, received, memory_order_relaxed);
+        if (read_rate)
+            conn->read_bucket.tokens -= received;
+        return received;
+    }
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    return -1;
+}
+
+static void consume_input(connection_t *conn, size_t count)
+{
+    memmove(conn->input, conn->input + count, conn->input_len - count);
+    conn->input_len -= count;
+    conn->scanned = 0;
+}
+
+// Parse the request headers if they are complete. Returns 1 when done, 0 if more input is needed, -1 on error.
+//
+static int parse_request(connection_t *conn)
+{
+    size_t scan = conn->scanned > 3 ? conn->scanned - 3 : 0;
+    char *end = memmem(conn->input + scan, conn->input_len - scan, "\r\n\r\n", 4);
+    if (!end) {
+        conn->scanned = conn->input_len;
+        return conn->input_len == INPUT_SIZE ? -1 : 0;  // headers too large
+    }
+
+    size_t header_len = end + 4 - conn->input;
+    conn->body_remaining = 0;
+    conn->close_after = false;
+    for (char *line = memmem(conn->input, header_len, "\r\n", 2); line && line < end; line = memmem(line, end + 2 - line, "\r\n", 2)) {
+        line += 2;
+        if (strncasecmp(line, "content-length:", 15) == 0)
+            conn->body_remaining = strtoull(line + 15, 0, 10);
+        else if (strncasecmp(line, "connection:", 11) == 0) {
+            char *value = line + 11;
+            while (*value == ' ')
+                value++;
+            conn->close_after = strncasecmp(value, "close", 5) == 0;
+        }
+    }
+    consume_input(conn, header_len);
+    return 1;
+}
+
+static void start_response(worker_t *worker, connection_t *conn)
+{
+    uint64_t size = (uint64_t) dist_sample(&size_dist, &worker->rng);
+    conn->header_len = snprintf(conn->header, sizeof(conn->header),
+                                "HTTP/1.1 200 OK\r\nContent-Length: %"PRIu64"\r\n%s\r\n",
+                                size, conn->close_after ? "Connection: close\r\n" : "");
+    conn->response_len = conn->header_len + size;
+    conn->response_remaining = conn->response_len;
+    conn->state = ST_RESPONSE;
+}
+
+// Write as much of the response as possible. Returns 1 when complete, 0 if blocked, -1 on error.
+//
+static int write_response(worker_t *worker, connection_t *conn, int64_t now)
+{
+    while (conn->response_remaining) {
+        uint64_t offset = conn->response_len - conn->response_remaining;
+        const char *data;
+        size_t length;
+        if (offset < conn->header_len) {
+            data = conn->header + offset;
+            length = conn->header_len - offset;
+        } else {
+            // body content is constant
+            data = body;
+            length = conn->response_remaining < BODY_SIZE ? conn->response_remaining : BODY_SIZE;
+        }
+        length = bucket_allow(&conn->write_bucket, write_rate, length, now);
+        if (length == 0)
+            return 0;
+
+        ssize_t sent = send(conn->socket, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_blocked(worker, conn, true, now);
+                return 0;
+            }
+            return -1;
+        }
+        set_blocked(worker, conn, false, now);
+        if (write_rate)
+            conn->write_bucket.tokens -= sent;
+        conn->response_remaining -= sent;
+        conn->octets_out += sent;
+        atomic_fetch_add_explicit(&worker->octets_out, sent, memory_order_relaxed);
+    }
+    return 1;
+}
+
+// Advance the connection's state machine as far as possible, then update its epoll interest and timer
+//
+static void connection_process(worker_t *worker, connection_t *conn, int64_t now)
+{
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        switch (conn->state) {
+            case ST_HEADERS: {
+                int rc = parse_request(conn);
+                if (rc < 0) {
+                    fprintf(stderr, "server: conn %u bad request\n", conn->id);
+                    connection_close(worker, conn, now);
+                    return;
+                }
+                if (rc == 0) {
+                    ssize_t received = connection_read(worker, conn, now);
+                    if (received < 0) {
+                        connection_close(worker, conn, now);
+                        return;
+                    }
+                    progress = received > 0;
+                    break;
+                }
+                conn->state = ST_BODY;
+                progress = true;
+                break;
+            }
+
+            case ST_BODY: {
+                size_t used = conn->input_len < conn->body_remaining ? conn->input_len : conn->body_remaining;
+                consume_input(conn, used);
+                conn->body_remaining -= used;
+                if (conn->body_remaining) {
+                    ssize_t received = connection_read(worker, conn, now);
+                    if (received < 0) {
+                        connection_close(worker, conn, now);
+                        return;
+                    }
+                    progress = received > 0;
+                    break;
+                }
+                int64_t delay = (int64_t) (dist_sample(&delay_dist, &worker->rng) * 1e6);
+                if (delay > 0) {
+                    conn->state = ST_DELAY;
+                    atomic_fetch_add(&worker->delaying, 1);
+                    timer_set(worker, conn, now + delay);
+                } else {
+                    start_response(worker, conn);
+                    progress = true;
+                }
+                break;
+            }
+
+            case ST_DELAY:
+                if (now >= conn->timer) {
+                    atomic_fetch_sub(&worker->delaying, 1);
+                    start_response(worker, conn);
+                    progress = true;
+                }
+                break;
+
+            case ST_RESPONSE: {
+                int rc = write_response(worker, conn, now);
+                if (rc < 0) {
+                    connection_close(worker, conn, now);
+                    return;
+                }
+                if (rc > 0) {
+                    conn->requests += 1;
+                    atomic_fetch_add_explicit(&worker->requests, 1, memory_order_relaxed);
+                    if (conn->close_after) {
+                        connection_close(worker, conn, now);
+                        return;
+                    }
+                    conn->state = ST_HEADERS;
+                    progress = true;
+                }
+                break;
+            }
+        }
+    }
+
+    // now waiting for input, output space, or a timer
+    uint32_t events = 0;
+    bool throttled = false;
+    switch (conn->state) {
+        case ST_HEADERS:
+        case ST_BODY:
+            if (read_rate && conn->read_bucket.tokens < 1.0)
+                throttled = true;
+            else
+                events = EPOLLIN;
+            break;
+        case ST_RESPONSE:
+            if (conn->write_blocked)
+                events = EPOLLOUT;
+            else
+                throttled = true;
+            break;
+        default:
+            break;
+    }
+    set_events(worker, conn, events);
+    if (throttled) {
+        if (conn->state == ST_RESPONSE)
+            timer_set(worker, conn, bucket_ready_at(&conn->write_bucket, write_rate, now));
+        else
+            timer_set(worker, conn, bucket_ready_at(&conn->read_bucket, read_rate, now));
+    } else if (conn->state != ST_DELAY) {
+        timer_cancel(worker, conn);
+    }
+}
+
+static void *run_worker(void *data)
+{
+    worker_t *worker = (worker_t *) data;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int timeout = -1;
+        if (worker->heap_len) {
+            int64_t wait = worker->heap[0]->timer - now_nsec();
+            timeout = wait > 0 ? (int) ((wait + 999999) / 1000000) : 0;
+        }
+
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "server: epoll_wait() ERROR! %s\n", strerror(errno));
+            break;
+        }
+
+        int64_t now = now_nsec();
+        for (int i = 0; i < count; ++i) {
+            connection_process(worker, (connection_t *) events[i].data.ptr, now);
+        }
+
+        while (worker->heap_len && worker->heap[0]->timer <= now) {
+            connection_t *conn = worker->heap[0];
+            timer_cancel(worker, conn);
+            connection_process(worker, conn, now);
+        }
+    }
+
+    return NULL;
+}
+
+static void *run_reporter(void *data)
+{
+    long interval = (long) (intptr_t) data;
+    uint64_t last[3] = {0};
+    int64_t last_time = now_nsec();
+
+    while (1) {
+        sleep(interval);
+
+        int64_t now = now_nsec();
+        long double secs = (now - last_time) / 1e9L;
+        uint64_t counters[3] = {0};
+        unsigned int active = 0, delaying = 0, blocked = 0;
+        for (int i = 0; i < worker_count; ++i) {
+            counters[0] += atomic_load(&workers[i].requests);
+            counters[1] += atomic_load(&workers[i].octets_in);
+            counters[2] += atomic_load(&workers[i].octets_out);
+            active += atomic_load(&workers[i].active);
+            delaying += atomic_load(&workers[i].delaying);
+            blocked += atomic_load(&workers[i].blocked);
+        }
+
+        const char *in_suffix = "", *out_suffix = "";
+        long double in_rate = humanize_rate((counters[1] - last[1]) / secs, &in_suffix);
+        long double out_rate = humanize_rate((counters[2] - last[2]) / secs, &out_suffix);
+        fprintf(stdout, "server: conns=%u delaying=%u write-blocked=%u rate=%.1Lf req/sec in=%.3Lf %s/sec out=%.3Lf %s/sec\n",
+                active, delaying, blocked, (counters[0] - last[0]) / secs, in_rate, in_suffix, out_rate, out_suffix);
+        fflush(stdout);
+
+        memcpy(last, counters, sizeof(last));
+        last_time = now;
+    }
+    return NULL;
+}
+
+
+#define DEFAULT_PORT 8800U
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s <options>\n", prog);
+    printf("-p \tThe TCP port to listen on [%u]\n", DEFAULT_PORT);
+    printf("-t \t# of worker threads [%d]\n", worker_count);
+    printf("-d \tResponse delay distribution in msecs [100]\n");
+    printf("-s \tResponse body size distribution in octets [0]\n");
+    printf("-r \tLimit each connection's read rate to this many octets/sec, 0 == unlimited [0 (K|M|G)]\n");
+    printf("-w \tLimit each connection's write rate to this many octets/sec, 0 == unlimited [0 (K|M|G)]\n");
+    printf("-i \tReport interval in secs, 0 == off [5]\n");
+    printf("-v \tPrint each connection's statistics when it closes [off]\n");
+    printf("Distributions: N, const:N, uniform:A:B, exp:MEAN\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int port = DEFAULT_PORT;
+    long report_interval = 5;
+    double value;
+
+    /* command line options */
+    opterr = 0;
+    int c;
+    while ((c = getopt(argc, argv, "p:t:d:s:r:w:i:vh")) != -1) {
+        switch(c) {
+            case 'h':
+                usage(argv[0]);
+                break;
+            case 'p':
+                if (sscanf(optarg, "%u", &port) != 1) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &worker_count) != 1 || worker_count <= 0) {
+                    fprintf(stderr, "Invalid thread count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                if (parse_dist(optarg, &delay_dist)) {
+                    fprintf(stderr, "Invalid delay distribution %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                if (parse_dist(optarg, &size_dist)) {
+                    fprintf(stderr, "Invalid size distribution %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (parse_value(optarg, &value)) {
+                    fprintf(stderr, "Invalid read rate %s\n", optarg);
+                    usage(argv[0]);
+                }
+                read_rate = (uint64_t) value;
+                break;
+            case 'w':
+                if (parse_value(optarg, &value)) {
+                    fprintf(stderr, "Invalid write rate %s\n", optarg);
+                    usage(argv[0]);
+                }
+                write_rate = (uint64_t) value;
+                break;
+            case 'i':
+                if (sscanf(optarg, "%ld", &report_interval) != 1 || report_interval < 0) {
+                    fprintf(stderr, "Invalid report interval %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    body = malloc(BODY_SIZE);
+    memset(body, 'x', BODY_SIZE);
+
+    workers = calloc(worker_count, sizeof(worker_t));
+    for (int i = 0; i < worker_count; ++i) {
+        workers[i].epoll_fd = epoll_create1(0);
+        if (workers[i].epoll_fd < 0) {
+            fprintf(stderr, "server: epoll_create1() ERROR! %s\n", strerror(errno));
+            return errno;
+        }
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1) ^ (uint64_t) now_nsec();
+        pthread_create(&workers[i].thread, NULL, &run_worker, (void*) &workers[i]);
+    }
+
+    if (report_interval) {
+        pthread_t reporter;
+        pthread_create(&reporter, NULL, &run_reporter, (void*) (intptr_t) report_interval);
+    }
+
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) goto egress;
+
+    int opt = 1;
+    int err = setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (err) goto egress;
+
+    struct sockaddr_in addr = (struct sockaddr_in) {
+        0,
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(port)
+    };
+
+    err = bind(server_sock, (const struct sockaddr*) &addr, sizeof(addr));
+    if (err) goto egress;
+
+    err = listen(server_sock, SOMAXCONN);
+    if (err) goto egress;
+
+    printf("server: Listening for connections on port %d, %d worker threads\n", port, worker_count);
+    fflush(stdout);
+
+    unsigned int next_id = 0;
+    while (1) {
+        int sock = accept(server_sock, NULL, NULL);
+        if (sock < 0) goto egress;
+
+        opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*) &opt, sizeof(opt));
+
+        connection_t *conn = calloc(1, sizeof(connection_t));
+        conn->socket = sock;
+        conn->id = next_id++;
+        conn->heap_index = -1;
+        conn->events = EPOLLIN;
+        conn->start = now_nsec();
+        conn->read_bucket.last = conn->start;
+        conn->write_bucket.last = conn->start;
+
+        const unsigned int id = conn->id;  // conn may be closed by the worker once added
+        worker_t *worker = &workers[id % worker_count];
+        atomic_fetch_add(&worker->active, 1);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+            fprintf(stderr, "server: epoll_ctl() ERROR! %s\n", strerror(errno));
+            atomic_fetch_sub(&worker->active, 1);
+            close(sock);
+            free(conn);
+            continue;
+        }
+
+        if (verbose) {
+            printf("server: Connection %u accepted\n", id);
+            fflush(stdout);
+        }
+    }
+
+egress:
+
+    if (errno) {
+        fprintf(stderr, "server: ERROR! %s\n", strerror(errno));
+    }
+
+    if (server_sock > 0) {
+        shutdown(server_sock, SHUT_RDWR);
+    }
+
+    return errno;
+}
@@ -20,19 +20,31 @@
 //
 // Connect to the TCP server and send data as fast as possible
 //
+// Multiple parallel streams can be sent from one process, each on its own thread and connection, optionally rate
+// limited. The data can be sent with plain send(), with MSG_ZEROCOPY, or with sendfile() from a memfd so that the
+// client's copy cost does not hide the router's limit.
+//
 
 #define _GNU_SOURCE
 
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <time.h>
+#include <linux/errqueue.h>  // after time.h, needs struct timespec
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
 
 
 // Buffer size: currently the router uses 4K buffers and the raw connection supports up to 16 receive buffers. Attempt
@@ -40,6 +52,34 @@
 //
 #define BUFFER_SIZE (4096 * 32)
 
+typedef enum {
+    MODE_SEND,
+    MODE_ZEROCOPY,
+    MODE_SENDFILE,
+} send_mode_t;
+
+static const char * const mode_names[] = {"send", "zerocopy", "sendfile"};
+
+typedef struct stream {
+    pthread_t        thread;
+    int              id;
+    int              sock;
+    unsigned long    sent;
+    struct timespec  start;
+    struct timespec  end;
+    unsigned long    zc_completions;  // MSG_ZEROCOPY sends completed by the kernel
+    unsigned long    zc_copied;       // ...of which the kernel had to copy anyway
+    bool             failed;
+} stream_t;
+
+static unsigned long      amount;
+static unsigned long      rate_limit;  // octets/sec per stream, 0 == unlimited
+static bool               half_close = false;
+static send_mode_t        mode = MODE_SEND;
+static char              *buffer;
+static int                memfd = -1;
+static pthread_barrier_t  start_barrier;
+
 static long double humanize_rate(long double rate, const char **suffix)
 {
     static const char * const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
@@ -59,58 +99,188 @@ static long double humanize_rate(long double rate, const char **suffix)
     return rate;
 }
 
+static long double elapsed_secs(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9L;
+}
+
 
-static int run_sender(int sock, unsigned long amount, bool half_close)
+// Reap MSG_ZEROCOPY completion notifications from the socket error queue. If wait is true block until at least one
+// notification arrives.
+//
+static int reap_zerocopy(stream_t *stream, bool wait)
 {
+    while (true) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        if (recvmsg(stream->sock, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!wait)
+                    return 0;
+                struct pollfd pfd = {.fd = stream->sock, .events = 0};
+                poll(&pfd, 1, 100);  // POLLERR is always reported
+                wait = false;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // ee_info..ee_data is the (inclusive) range of completed sends
+            unsigned long count = serr->ee_data - serr->ee_info + 1;
+            stream->zc_completions += count;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stream->zc_copied += count;
+        }
+        wait = false;
+    }
+}
+
+
+static ssize_t send_chunk(stream_t *stream, size_t length)
+{
+    switch (mode) {
+        case MODE_ZEROCOPY: {
+            // the buffer content never changes so it is safe to reuse it before the completion arrives
+            ssize_t sent = send(stream->sock, buffer, length, MSG_ZEROCOPY);
+            if (sent < 0 && errno == ENOBUFS) {
+                // too many outstanding zero copy sends (optmem limit)
+                if (reap_zerocopy(stream, true) < 0)
+                    return -1;
+                errno = EINTR;
+            } else if (reap_zerocopy(stream, false) < 0) {
+                return -1;
+            }
+            return sent;
+        }
+        case MODE_SENDFILE: {
+            off_t offset = 0;
+            return sendfile(stream->sock, memfd, &offset, length);
+        }
+        default:
+            return send(stream->sock, buffer, length, 0);
+    }
+}
+
+
+static void *run_sender(void *data)
+{
+    stream_t *stream = (stream_t *) data;
     unsigned long remaining = amount;
-    char *buffer = (char*) malloc(BUFFER_SIZE);
-    memset(buffer, 'x', BUFFER_SIZE);
+
+    // limit the chunk size so rate limited streams are paced smoothly (at least 100 chunks per second)
+    size_t chunk = BUFFER_SIZE;
+    if (rate_limit && rate_limit / 100 < chunk)
+        chunk = rate_limit / 100 ? rate_limit / 100 : 1;
 
     if (half_close) {
-        shutdown(sock, SHUT_RD);
+        shutdown(stream->sock, SHUT_RD);
     }
 
-    struct timespec start = {0};
-    int rc = clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    pthread_barrier_wait(&start_barrier);
+
+    int rc = clock_gettime(CLOCK_MONOTONIC_RAW, &stream->start);
     if (rc) {
         fprintf(stderr, "client: clock_gettime() ERROR! %s\n", strerror(errno));
-        return -1;
+        stream->failed = true;
+        return NULL;
     }
 
+    struct timespec pace_start;
+    clock_gettime(CLOCK_MONOTONIC, &pace_start);
+
     while (remaining > 0) {
-        ssize_t sent = send(sock, buffer,
-                            (remaining > BUFFER_SIZE) ? BUFFER_SIZE : remaining,
-                            0);
+        ssize_t sent = send_chunk(stream, (remaining > chunk) ? chunk : remaining);
         if (sent < 0) {
-            fprintf(stderr, "client: ERROR! %s\n", strerror(errno));
-            return -1;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "client: stream %d ERROR! %s\n", stream->id, strerror(errno));
+            stream->failed = true;
+            break;
         }
         remaining -= sent;
+        stream->sent += sent;
+
+        if (rate_limit) {
+            // sleep until the time at which the octets sent so far are due
+            long double due = (long double) stream->sent / rate_limit;
+            struct timespec wakeup = pace_start;
+            wakeup.tv_sec += (time_t) due;
+            wakeup.tv_nsec += (long) ((due - (time_t) due) * 1e9L);
+            if (wakeup.tv_nsec >= 1000000000L) {
+                wakeup.tv_sec += 1;
+                wakeup.tv_nsec -= 1000000000L;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR)
+                ;
+        }
     }
 
-    struct timespec end = {0};
-    rc = clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    if (mode == MODE_ZEROCOPY) {
+        // wait for the outstanding completions so the copied count is accurate
+        unsigned long sends = 0;
+        int tries = 10;
+        while (stream->zc_completions != sends && tries-- > 0) {
+            sends = stream->zc_completions;
+            reap_zerocopy(stream, true);
+        }
+    }
+
+    rc = clock_gettime(CLOCK_MONOTONIC_RAW, &stream->end);
     if (rc) {
         fprintf(stderr, "client: clock_gettime() ERROR! %s\n", strerror(errno));
-        return -1;
+        stream->failed = true;
+        return NULL;
     }
 
-    long long msecs = (end.tv_sec - start.tv_sec) * 1000LL;
-    end.tv_nsec /= 1000000L;
-    start.tv_nsec /= 1000000L;
-    msecs = (msecs + end.tv_nsec) - start.tv_nsec;
-
-    long double secs = msecs / 1000.0L;
-    long double rate = secs != 0.0L ? ((long double) amount / secs) : 0.0L;
+    long double secs = elapsed_secs(&stream->start, &stream->end);
+    long double rate = secs != 0.0L ? ((long double) stream->sent / secs) : 0.0L;
     const char *suffix = "";
     rate = humanize_rate(rate, &suffix);
-    fprintf(stdout, "client: sent %lu octets in %.3Lf secs, send rate=%.3Lf %s/sec\n",
-            amount, secs, rate, suffix);
+    fprintf(stdout, "client: stream %d sent %lu octets in %.6Lf secs, send rate=%.3Lf %s/sec\n",
+            stream->id, stream->sent, secs, rate, suffix);
+    if (mode == MODE_ZEROCOPY) {
+        fprintf(stdout, "client: stream %d zerocopy completions %lu, copied by kernel %lu\n",
+                stream->id, stream->zc_completions, stream->zc_copied);
+    }
+
+    return NULL;
+}
+
 
-    free(buffer);
+static int parse_octets(char *arg, unsigned long *value)
+{
+    unsigned long scale = 1;
+    char *ptr = strpbrk(arg, "KMG");
+    if (ptr) {
+        switch (*ptr) {
+            case 'K':
+                scale = 1024;
+                break;
+            case 'M':
+                scale = 1024 * 1024;
+                break;
+            case 'G':
+                scale = 1024 * 1024 * 1024;
+                break;
+        }
+        *ptr = 0;
+    }
+    if (sscanf(arg, "%lu", value) != 1)
+        return -1;
+    *value *= scale;
     return 0;
 }
 
+
 #define DEFAULT_PORT 9999U
 #define DEFAULT_OCTETS (1024UL * 1024UL * 1024UL)
 
@@ -118,7 +288,10 @@ static void usage(const char *prog)
 {
     printf("Usage: %s <options>\n", prog);
     printf("-p \tThe TCP port to connect to [%u]\n", DEFAULT_PORT);
-    printf("-c \t# of octets to transfer [%lu (K|M|G)]\n", DEFAULT_OCTETS);
+    printf("-c \t# of octets to transfer per stream [%lu (K|M|G)]\n", DEFAULT_OCTETS);
+    printf("-n \t# of parallel streams [1]\n");
+    printf("-r \tLimit each stream to this many octets/sec, 0 == unlimited [0 (K|M|G)]\n");
+    printf("-m \tSend mode: send, zerocopy (MSG_ZEROCOPY) or sendfile (from a memfd) [send]\n");
     printf("-H \tUse half-close transfer [off]\n");
     exit(1);
 }
@@ -127,13 +300,13 @@ static void usage(const char *prog)
 int main(int argc, char *argv[])
 {
     unsigned int port = DEFAULT_PORT;
-    unsigned long amount = DEFAULT_OCTETS;
-    bool half_close = false;
+    int stream_count = 1;
+    amount = DEFAULT_OCTETS;
 
     /* command line options */
     opterr = 0;
     int c;
-    while ((c = getopt(argc, argv, "p:c:Hh")) != -1) {
+    while ((c = getopt(argc, argv, "p:c:n:r:m:Hh")) != -1) {
         switch(c) {
             case 'h':
                 usage(argv[0]);
@@ -144,28 +317,36 @@ int main(int argc, char *argv[])
                     usage(argv[0]);
                 }
                 break;
-            case 'c': {
-                unsigned long scale = 1;
-                char *ptr = strpbrk(optarg, "KMG");
-                if (ptr) {
-                    switch (*ptr) {
-                        case 'K':
-                            scale = 1024;
-                            break;
-                        case 'M':
-                            scale = 1024 * 1024;
-                            break;
-                        case 'G':
-                            scale = 1024 * 1024 * 1024;
-                            break;
+            case 'c':
+                if (parse_octets(optarg, &amount) != 0) {
+                    fprintf(stderr, "Invalid count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                if (sscanf(optarg, "%d", &stream_count) != 1 || stream_count <= 0) {
+                    fprintf(stderr, "Invalid stream count %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (parse_octets(optarg, &rate_limit) != 0) {
+                    fprintf(stderr, "Invalid rate %s\n", optarg);
+                    usage(argv[0]);
+                }
+                break;
+            case 'm': {
+                bool found = false;
+                for (int i = 0; i < 3 && !found; ++i) {
+                    if (strcmp(optarg, mode_names[i]) == 0) {
+                        mode = (send_mode_t) i;
+                        found = true;
                     }
-                    *ptr = 0;
                 }
-                if (sscanf(optarg, "%lu", &amount) != 1) {
-                    fprintf(stderr, "Invalid count %s\n", optarg);
+                if (!found) {
+                    fprintf(stderr, "Invalid send mode %s\n", optarg);
                     usage(argv[0]);
                 }
-                amount *= scale;
                 break;
             }
             case 'H':
@@ -177,8 +358,22 @@ int main(int argc, char *argv[])
         }
     }
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) goto egress;
+    buffer = (char*) malloc(BUFFER_SIZE);
+    memset(buffer, 'x', BUFFER_SIZE);
+
+    if (mode == MODE_SENDFILE) {
+        memfd = memfd_create("spout-client", 0);
+        if (memfd < 0 || write(memfd, buffer, BUFFER_SIZE) != BUFFER_SIZE) {
+            fprintf(stderr, "client: memfd ERROR! %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    stream_t *streams = calloc(stream_count, sizeof(stream_t));
+    for (int i = 0; i < stream_count; ++i) {
+        streams[i].id = i;
+        streams[i].sock = -1;
+    }
 
     struct sockaddr_in addr = (struct sockaddr_in) {
         0,
@@ -187,14 +382,53 @@ int main(int argc, char *argv[])
         .sin_port = htons(port)
     };
 
-    printf("client: Connecting to port %d\n", port);
+    printf("client: Connecting %d stream(s) to port %d\n", stream_count, port);
 
-    int err = connect(sock, (const struct sockaddr*) &addr, sizeof(addr));
-    if (err) goto egress;
+    for (int i = 0; i < stream_count; ++i) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) goto egress;
+        streams[i].sock = sock;
 
-    printf("client: Connected, sending %lu octets\n", amount);
+        if (mode == MODE_ZEROCOPY) {
+            int opt = 1;
+            if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt))) goto egress;
+        }
+
+        int err = connect(sock, (const struct sockaddr*) &addr, sizeof(addr));
+        if (err) goto egress;
+    }
+
+    printf("client: Connected, sending %lu octets per stream using %s\n", amount, mode_names[mode]);
+    fflush(stdout);
+
+    // start all streams at once so the aggregate rate covers the time they run in parallel
+    pthread_barrier_init(&start_barrier, NULL, stream_count);
+    for (int i = 0; i < stream_count; ++i) {
+        pthread_create(&streams[i].thread, NULL, &run_sender, (void*) &streams[i]);
+    }
 
-    run_sender(sock, amount, half_close);
+    unsigned long total = 0;
+    int failed = 0;
+    struct timespec first = {0}, last = {0};
+    for (int i = 0; i < stream_count; ++i) {
+        pthread_join(streams[i].thread, NULL);
+        total += streams[i].sent;
+        failed += streams[i].failed ? 1 : 0;
+        if (i == 0 || elapsed_secs(&streams[i].start, &first) > 0)
+            first = streams[i].start;
+        if (i == 0 || elapsed_secs(&last, &streams[i].end) > 0)
+            last = streams[i].end;
+    }
+
+    if (stream_count > 1) {
+        long double secs = elapsed_secs(&first, &last);
+        long double rate = secs != 0.0L ? ((long double) total / secs) : 0.0L;
+        const char *suffix = "";
+        rate = humanize_rate(rate, &suffix);
+        fprintf(stdout, "client: %d streams sent %lu octets in %.6Lf secs, aggregate send rate=%.3Lf %s/sec\n",
+                stream_count, total, secs, rate, suffix);
+    }
+    errno = failed ? EIO : 0;
 
 egress:
 
@@ -202,6 +436,8 @@ egress:
         fprintf(stderr, "client: ERROR! %s\n", strerror(errno));
     }
 
-    if (sock > 0) close(sock);
+    for (int i = 0; i < stream_count; ++i) {
+        if (streams[i].sock >= 0) close(streams[i].sock);
+    }
     exit(errno);
 }
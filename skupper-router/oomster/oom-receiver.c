@@ -27,6 +27,7 @@
 #include "proton/transport.h"
 #include "proton/version.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
@@ -38,9 +39,15 @@
 
 /* Out-of-memory (OOM) receiver
  *
- * Attempt to overload a routers memory by back pressuring incoming data
+ * Attempt to overload a routers memory by back pressuring incoming data.
+ * By default all links are stalled. Optionally links can drain slowly (at a
+ * fixed byte rate and/or following a run/pause pattern) and some links can
+ * drain as fast as possible in order to check flow control fairness.
  */
 
+#define MIN(X,Y) ((X) > (Y) ? (Y) : (X))
+#define DRAIN_TICK_MSECS 10
+
 
 bool stop = false;
 bool debug_mode = false;
@@ -58,6 +65,42 @@ char *host_address = _addr;
 char *container_name = "OOMReceiver";
 char proactor_address[1024];
 
+// periodic byte counter snapshot for oom-monitor
+char *stats_file = 0;
+int stats_interval = 100;  // msecs
+uint64_t total_bytes;      // octets that have arrived at this client
+
+// slow consumer configuration
+uint64_t drain_rate = 0;        // per link bytes/sec, 0 == no rate limit
+int run_msecs = 0;              // pause pattern: drain for run_msecs...
+int pause_msecs = 0;            // ...then stop draining for pause_msecs
+unsigned int fast_links = 0;    // # of links that drain as fast as possible
+int report_interval = 0;        // secs between per-link drain reports, 0 == off
+char *sender_stats_file = 0;    // oom-sender -S file, for comparing rates
+bool verbose = false;
+
+typedef struct link_context_t {
+    pn_link_t *pn_link;
+    unsigned int index;
+    bool       fast;          // drain without limit
+    uint64_t   budget;        // octets that may be drained now
+    uint64_t   drained;       // total octets consumed
+    uint64_t   last_drained;  // drained at last report
+    uint64_t   messages;      // completed deliveries
+} link_context_t;
+
+link_context_t *link_contexts;
+uint64_t drained_bytes;     // octets consumed over all links
+int64_t  start_msecs;
+int64_t  last_tick_msecs;
+int64_t  next_stats_msecs;
+int64_t  next_report_msecs;
+int64_t  last_report_msecs;
+uint64_t last_sender_bytes;
+
+char rx_buffer[65536];
+
+pn_connection_t *pn_conn;
 pn_proactor_t *proactor;
 
 
@@ -74,6 +117,290 @@ __attribute__((format(printf, 1, 2))) void debug(const char *format, ...)
 }
 
 
+// Overwrite the stats file with the current byte counter. The file is
+// replaced via rename() so a reader never sees a partial update.
+//
+static void write_stats(void)
+{
+    char tmp_file[1024];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", stats_file);
+    FILE *fp = fopen(tmp_file, "w");
+    if (!fp) {
+        fprintf(stderr, "ERROR: cannot open stats file %s: %s\n", tmp_file, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%"PRIu64".%09ld %"PRIu64" %u\n",
+            (uint64_t) ts.tv_sec, ts.tv_nsec, total_bytes, links);
+    fclose(fp);
+    rename(tmp_file, stats_file);
+}
+
+
+static int64_t now_msecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000L);
+}
+
+
+static double humanize_rate(double rate, const char **suffix)
+{
+    static const char * const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    const int units_ct = 5;
+    const double base = 1024.0;
+
+    for (int i = 0; i < units_ct; ++i) {
+        if (rate < base) {
+            if (suffix)
+                *suffix = units[i];
+            return rate;
+        }
+        rate /= base;
+    }
+    if (suffix)
+        *suffix = units[units_ct - 1];
+    return rate;
+}
+
+
+static bool slow_links_drain(void)
+{
+    return drain_rate || run_msecs;
+}
+
+
+static bool draining(void)
+{
+    return slow_links_drain() || fast_links;
+}
+
+
+// True if a slow link is in the drain part of its pause pattern. The
+// pattern is staggered across the links so they do not all pause at once.
+//
+static bool slow_link_active(const link_context_t *ctx, int64_t now)
+{
+    if (!slow_links_drain())
+        return false;
+    if (!run_msecs)
+        return true;
+    const int64_t period = run_msecs + pause_msecs;
+    const int64_t offset = (period * ctx->index) / links;
+    return ((now + offset) % period) < run_msecs;
+}
+
+
+// Consume up to limit octets from the link's incoming deliveries. Completed
+// deliveries are accepted and the credit is replenished.
+//
+static uint64_t drain_link(link_context_t *ctx, uint64_t limit)
+{
+    uint64_t total = 0;
+
+    while (total < limit) {
+        pn_delivery_t *dlv = pn_link_current(ctx->pn_link);
+        if (!dlv || !pn_delivery_readable(dlv))
+            break;
+
+        ssize_t rc = 0;
+        if (!pn_delivery_aborted(dlv))
+            rc = pn_link_recv(ctx->pn_link, rx_buffer, MIN(limit - total, sizeof(rx_buffer)));
+        if (rc > 0) {
+            total += rc;
+        } else if (rc == PN_EOS || pn_delivery_aborted(dlv)) {
+            debug("Link %s delivery complete\n", pn_link_name(ctx->pn_link));
+            if (!pn_delivery_aborted(dlv)) {
+                pn_delivery_update(dlv, PN_ACCEPTED);
+                ctx->messages += 1;
+            }
+            pn_delivery_settle(dlv);
+            pn_link_flow(ctx->pn_link, 1);
+        } else {
+            break;  // no data available yet
+        }
+    }
+
+    ctx->drained += total;
+    drained_bytes += total;
+    return total;
+}
+
+
+static void service_link(link_context_t *ctx, int64_t now)
+{
+    if (ctx->fast) {
+        drain_link(ctx, UINT64_MAX);
+    } else if (slow_link_active(ctx, now) && ctx->budget) {
+        ctx->budget -= drain_link(ctx, ctx->budget);
+    }
+}
+
+
+// Called every DRAIN_TICK_MSECS: refill the budget of each slow link
+//
+static void drain_tick(int64_t now)
+{
+    const int64_t elapsed = now - last_tick_msecs;
+    last_tick_msecs = now;
+
+    // allow at most two ticks worth of burst (but at least one frame) so a
+    // link cannot save up its budget and drain in large spikes
+    const uint64_t max_budget = (drain_rate * 2 * DRAIN_TICK_MSECS) / 1000 + in_max_frame;
+
+    for (unsigned int i = 0; i < links; ++i) {
+        link_context_t *ctx = &link_contexts[i];
+        if (!ctx->pn_link)
+            continue;
+        if (!ctx->fast) {
+            if (!slow_link_active(ctx, now)) {
+                ctx->budget = 0;
+                continue;
+            }
+            if (drain_rate) {
+                ctx->budget = MIN(max_budget, ctx->budget + (drain_rate * elapsed) / 1000);
+            } else {
+                ctx->budget = UINT64_MAX;
+            }
+        }
+        service_link(ctx, now);
+    }
+}
+
+
+// Returns the sender's total bytes from its stats file, or 0 if not available
+//
+static uint64_t read_sender_bytes(void)
+{
+    uint64_t bytes = 0;
+    if (sender_stats_file) {
+        FILE *fp = fopen(sender_stats_file, "r");
+        if (fp) {
+            if (fscanf(fp, "%*s %"SCNu64, &bytes) != 1)
+                bytes = 0;
+            fclose(fp);
+        }
+    }
+    return bytes;
+}
+
+
+typedef struct rate_summary_t {
+    unsigned int count;
+    double min;
+    double max;
+    double sum;
+    double sum_sq;
+} rate_summary_t;
+
+static void summary_add(rate_summary_t *rs, double rate)
+{
+    if (rs->count == 0 || rate < rs->min) rs->min = rate;
+    if (rs->count == 0 || rate > rs->max) rs->max = rate;
+    rs->count += 1;
+    rs->sum += rate;
+    rs->sum_sq += rate * rate;
+}
+
+// Jain's fairness index: 1.0 == all links get the same share
+static double summary_fairness(const rate_summary_t *rs)
+{
+    return rs->sum_sq > 0.0 ? (rs->sum * rs->sum) / (rs->count * rs->sum_sq) : 1.0;
+}
+
+static void summary_print(const char *name, const rate_summary_t *rs)
+{
+    const char *s_min, *s_avg, *s_max;
+    if (rs->count == 0)
+        return;
+    double r_min = humanize_rate(rs->min, &s_min);
+    double r_avg = humanize_rate(rs->sum / rs->count, &s_avg);
+    double r_max = humanize_rate(rs->max, &s_max);
+    fprintf(stdout, "  %s links (%u): min %.3f %s/sec avg %.3f %s/sec max %.3f %s/sec fairness %.3f\n",
+            name, rs->count, r_min, s_min, r_avg, s_avg, r_max, s_max, summary_fairness(rs));
+}
+
+
+// Print the per-link drain rates since the last report (or since start if final)
+//
+static void report(int64_t now, bool final)
+{
+    const int64_t since = final ? start_msecs : last_report_msecs;
+    const double secs = (now - since) / 1000.0;
+    if (secs <= 0.0)
+        return;
+
+    rate_summary_t slow = {0}, fast = {0}, all = {0};
+    uint64_t interval_drained = 0;
+    for (unsigned int i = 0; i < links; ++i) {
+        link_context_t *ctx = &link_contexts[i];
+        const uint64_t bytes = final ? ctx->drained : ctx->drained - ctx->last_drained;
+        const double rate = bytes / secs;
+        summary_add(ctx->fast ? &fast : &slow, rate);
+        summary_add(&all, rate);
+        interval_drained += bytes;
+        if (verbose) {
+            const char *suffix;
+            double hr = humanize_rate(rate, &suffix);
+            fprintf(stdout, "    link OOMReceiver%u (%s): %.3f %s/sec messages=%"PRIu64"\n",
+                    ctx->index, ctx->fast ? "fast" : "slow", hr, suffix, ctx->messages);
+        }
+        ctx->last_drained = ctx->drained;
+    }
+
+    const char *d_suffix;
+    double d_rate = humanize_rate(interval_drained / secs, &d_suffix);
+    fprintf(stdout, "%s[%.3f secs] drained %.3f %s/sec", final ? "TOTAL " : "",
+            (now - start_msecs) / 1000.0, d_rate, d_suffix);
+    if (sender_stats_file) {
+        const uint64_t sender_bytes = read_sender_bytes();
+        const uint64_t sent = final ? sender_bytes : sender_bytes - MIN(last_sender_bytes, sender_bytes);
+        const char *s_suffix;
+        double s_rate = humanize_rate(sent / secs, &s_suffix);
+        fprintf(stdout, " sender %.3f %s/sec (drained/sent %.3f)", s_rate, s_suffix,
+                sent ? (double) interval_drained / sent : 0.0);
+        last_sender_bytes = sender_bytes;
+    }
+    fprintf(stdout, "\n");
+    summary_print("slow", &slow);
+    summary_print("fast", &fast);
+    fprintf(stdout, "  all links fairness %.3f, max/min rate %.3f\n", summary_fairness(&all),
+            all.min > 0.0 ? all.max / all.min : 0.0);
+    fflush(stdout);
+    last_report_msecs = now;
+}
+
+
+// Count the octets that have arrived over all links: the data consumed so
+// far plus the data pending in each link's current delivery.
+//
+static void update_total_bytes(void)
+{
+    uint64_t bytes = drained_bytes;
+    for (pn_link_t *pn_link = pn_link_head(pn_conn, 0); pn_link; pn_link = pn_link_next(pn_link, 0)) {
+        pn_delivery_t *dlv = pn_link_current(pn_link);
+        if (dlv)
+            bytes += pn_delivery_pending(dlv);
+    }
+    total_bytes = bytes;
+}
+
+
+static bool timer_needed(void)
+{
+    return stats_file || draining() || report_interval;
+}
+
+
+static int timer_interval(void)
+{
+    return draining() ? DRAIN_TICK_MSECS : (report_interval ? MIN(stats_interval, 100) : stats_interval);
+}
+
+
 static void signal_handler(int signum)
 {
     signal(signum, SIG_IGN);
@@ -94,7 +421,6 @@ static bool event_handler(pn_event_t *event)
     case PN_CONNECTION_BOUND: {
         // Create and open all the endpoints needed to receive messages
         //
-        pn_connection_t *pn_conn = pn_event_connection(event);
         pn_transport_t *tport = pn_connection_transport(pn_conn);
         if (in_max_frame) {
             pn_transport_set_max_frame(tport, in_max_frame);
@@ -115,18 +441,60 @@ static bool event_handler(pn_event_t *event)
 #endif
         pn_session_open(pn_ssn);
 
+        link_contexts = calloc(links, sizeof(link_context_t));
         for (int i = 0; i < links; ++i) {
             char namebuf[32];
             snprintf(namebuf, 32, "OOMReceiver%d", i);
             pn_link_t *pn_link = pn_receiver(pn_ssn, namebuf);
             pn_terminus_set_address(pn_link_source(pn_link), source_address);
+            link_contexts[i].pn_link = pn_link;
+            link_contexts[i].index = i;
+            link_contexts[i].fast = i < fast_links;
+            pn_link_set_context(pn_link, &link_contexts[i]);
             pn_link_open(pn_link);
             pn_link_flow(pn_link, credit_window);
         }
     } break;
 
     case PN_DELIVERY: {
-        // Do nothing!  Let link buffers fill until the session backpressures the router.
+        // Stalled links do nothing!  Let link buffers fill until the session
+        // backpressures the router.
+        link_context_t *ctx = (link_context_t *) pn_link_get_context(pn_event_link(event));
+        if (ctx && draining())
+            service_link(ctx, now_msecs());
+    } break;
+
+    case PN_CONNECTION_WAKE: {
+        // woken by the timer
+        const int64_t now = now_msecs();
+        if (draining())
+            drain_tick(now);
+        if (stats_file && now >= next_stats_msecs) {
+            update_total_bytes();
+            write_stats();
+            next_stats_msecs = now + stats_interval;
+        }
+        if (report_interval && now >= next_report_msecs) {
+            report(now, false);
+            next_report_msecs = now + (report_interval * 1000LL);
+        }
+    } break;
+
+    case PN_PROACTOR_TIMEOUT: {
+        // link state can only be accessed from the connection's own event batch
+        if (pn_conn) {
+            pn_connection_wake(pn_conn);
+            pn_proactor_set_timeout(proactor, timer_interval());
+        }
+    } break;
+
+    case PN_TRANSPORT_CLOSED: {
+        // the proactor frees the connection and its links after this batch, stop the timer so the proactor can go
+        // inactive and the client exits
+        pn_conn = NULL;
+        for (unsigned int i = 0; link_contexts && i < links; ++i)
+            link_contexts[i].pn_link = NULL;
+        pn_proactor_cancel_timeout(proactor);
     } break;
 
     case PN_TRANSPORT_ERROR: {
@@ -155,14 +523,23 @@ static void usage(const char *progname)
 {
     printf("Usage: %s <options>\n", progname);
     printf("-a \tThe address:port of the server [%s]\n", host_address);
-    printf("-l \tOpen N stalled receiver links [%u]\n", links);
+    printf("-l \tOpen N receiver links [%u]\n", links);
     printf("-i \tContainer name [%s]\n", container_name);
     printf("-s \tSource address [%s]\n", source_address);
     printf("-w \tCredit window [%d]\n", credit_window);
     printf("-F \tSet Incoming Max Frame (minimum 512) [%"PRIu32" bytes]\n", in_max_frame);
     printf("-W \tSet total allowed incoming frames per link (minimum 2 per link) [%"PRIu32" frames]\n", per_link_session_frames);
+    printf("-S \tWrite total bytes received to this file for oom-monitor [off]\n");
+    printf("-T \tStats file update interval [%d msecs]\n", stats_interval);
+    printf("-r \tDrain each slow link at this rate, 0 == no limit [%"PRIu64" bytes/sec (K|M|G)]\n", drain_rate);
+    printf("-P \tSlow link pause pattern <run-msecs>:<pause-msecs> [off]\n");
+    printf("-f \t# of fast links that drain without limit [%u]\n", fast_links);
+    printf("-R \tPrint per-link drain rates every N seconds, 0 == off [%d]\n", report_interval);
+    printf("-x \toom-sender stats file (-S), report sender rate against drain rate [off]\n");
+    printf("-v \tPrint the drain rate of every link in the report [off]\n");
     printf("-D \tPrint debug info [off]\n");
     printf("\n");
+    printf("Links are stalled unless -r, -P or -f is given.\n");
     printf("Runs until ^C hit (SIGQUIT)\n");
     exit(1);
 }
@@ -173,7 +550,7 @@ int main(int argc, char** argv)
     /* command line options */
     opterr = 0;
     int c;
-    while((c = getopt(argc, argv, "i:a:s:hDw:l:F:W:")) != -1) {
+    while((c = getopt(argc, argv, "i:a:s:hDw:l:F:W:S:T:r:P:f:R:x:v")) != -1) {
         switch(c) {
         case 'h': usage(argv[0]); break;
         case 'a': host_address = optarg; break;
@@ -196,6 +573,40 @@ int main(int argc, char** argv)
             if (sscanf(optarg, "%"SCNu32, &per_link_session_frames) != 1 || per_link_session_frames < 2)
                 usage(argv[0]);
             break;
+        case 'S': stats_file = optarg; break;
+        case 'T':
+            if (sscanf(optarg, "%d", &stats_interval) != 1 || stats_interval <= 0)
+                usage(argv[0]);
+            break;
+        case 'r': {
+            uint64_t scale = 1;
+            char *ptr = strpbrk(optarg, "KMG");
+            if (ptr) {
+                switch (*ptr) {
+                case 'K': scale = 1024; break;
+                case 'M': scale = 1024 * 1024; break;
+                case 'G': scale = 1024 * 1024 * 1024; break;
+                }
+                *ptr = 0;
+            }
+            if (sscanf(optarg, "%"SCNu64, &drain_rate) != 1)
+                usage(argv[0]);
+            drain_rate *= scale;
+        } break;
+        case 'P':
+            if (sscanf(optarg, "%d:%d", &run_msecs, &pause_msecs) != 2 || run_msecs <= 0 || pause_msecs < 0)
+                usage(argv[0]);
+            break;
+        case 'f':
+            if (sscanf(optarg, "%u", &fast_links) != 1)
+                usage(argv[0]);
+            break;
+        case 'R':
+            if (sscanf(optarg, "%d", &report_interval) != 1 || report_interval < 0)
+                usage(argv[0]);
+            break;
+        case 'x': sender_stats_file = optarg; break;
+        case 'v': verbose = true; break;
 
         default:
             usage(argv[0]);
@@ -203,6 +614,11 @@ int main(int argc, char** argv)
         }
     }
 
+    if (fast_links > links) {
+        fprintf(stderr, "More fast links (%u) than links (%u)\n", fast_links, links);
+        usage(argv[0]);
+    }
+
     signal(SIGQUIT, signal_handler);
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
@@ -217,13 +633,19 @@ int main(int argc, char** argv)
         port = "5672";
     }
 
-    pn_connection_t *pn_conn = pn_connection();
+    pn_conn = pn_connection();
     // the container name should be unique for each client
     pn_connection_set_container(pn_conn, container_name);
     pn_connection_set_hostname(pn_conn, host);
     proactor = pn_proactor();
     pn_proactor_addr(proactor_address, sizeof(proactor_address), host, port);
     pn_proactor_connect2(proactor, pn_conn, 0, proactor_address);
+    start_msecs = last_tick_msecs = last_report_msecs = now_msecs();
+    next_report_msecs = start_msecs + (report_interval * 1000LL);
+    if (stats_file)
+        write_stats();
+    if (timer_needed())
+        pn_proactor_set_timeout(proactor, timer_interval());
 
     bool done = false;
     while (!done) {
@@ -243,6 +665,10 @@ int main(int argc, char** argv)
         pn_proactor_done(proactor, events);
     }
 
+    if (link_contexts && (report_interval || draining()))
+        report(now_msecs(), true);
+
     pn_proactor_free(proactor);
+    free(link_contexts);
     return 0;
 }
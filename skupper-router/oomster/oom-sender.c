@@ -63,6 +63,10 @@ char proactor_address[1024];
 
 uint64_t total_bytes;
 
+// periodic byte counter snapshot for oom-monitor
+char *stats_file = 0;
+int stats_interval = 100;  // msecs
+
 pn_connection_t *pn_conn;
 pn_proactor_t *proactor;
 
@@ -115,6 +119,28 @@ __attribute__((format(printf, 1, 2))) void debug(const char *format, ...)
 }
 
 
+// Overwrite the stats file with the current byte counter. The file is
+// replaced via rename() so a reader never sees a partial update.
+//
+static void write_stats(void)
+{
+    char tmp_file[1024];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", stats_file);
+    FILE *fp = fopen(tmp_file, "w");
+    if (!fp) {
+        fprintf(stderr, "ERROR: cannot open stats file %s: %s\n", tmp_file, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%"PRIu64".%09ld %"PRIu64" %d\n",
+            (uint64_t) ts.tv_sec, ts.tv_nsec, total_bytes, links);
+    fclose(fp);
+    rename(tmp_file, stats_file);
+}
+
+
 static void signal_handler(int signum)
 {
     signal(signum, SIG_IGN);
@@ -168,7 +194,7 @@ static bool event_handler(pn_event_t *event)
             assert(dlv);
             pn_link_send(sender, (const char *)msg_header, sizeof(msg_header));
             pn_delivery_set_context(dlv, (void *) 0);  // context is the body octet sent counter
-            total_bytes = sizeof(msg_header);
+            total_bytes += sizeof(msg_header);
         }
 
         uintptr_t bytes_sent = (uintptr_t) pn_delivery_get_context(dlv);
@@ -232,6 +258,19 @@ static bool event_handler(pn_event_t *event)
         }
     } break;
 
+    case PN_PROACTOR_TIMEOUT: {
+        write_stats();
+        if (pn_conn)
+            pn_proactor_set_timeout(proactor, stats_interval);
+    } break;
+
+    case PN_TRANSPORT_CLOSED: {
+        // stop the stats timer so the proactor can go inactive and the client exits
+        pn_conn = NULL;
+        pn_proactor_cancel_timeout(proactor);
+        write_stats();
+    } break;
+
     case PN_PROACTOR_INTERRUPT:
         assert(stop);  // expect: due to stopping
         // fall through
@@ -256,6 +295,8 @@ static void usage(const char *progname)
     printf("-t \tTarget address [%s]\n", target_address);
     printf("-D \tPrint debug info [off]\n");
     printf("-v \tPrint total bytes sent [off]\n");
+    printf("-S \tWrite total bytes sent to this file for oom-monitor [off]\n");
+    printf("-T \tStats file update interval [%d msecs]\n", stats_interval);
     printf("\n");
     printf("Sends continually until ^C hit (SIGQUIT)\n");
     exit(1);
@@ -267,7 +308,7 @@ int main(int argc, char** argv)
     /* command line options */
     opterr = 0;
     int c;
-    while ((c = getopt(argc, argv, "ha:l:i:t:Dv")) != -1) {
+    while ((c = getopt(argc, argv, "ha:l:i:t:DvS:T:")) != -1) {
         switch(c) {
         case 'h': usage(argv[0]); break;
         case 'a': host_address = optarg; break;
@@ -279,6 +320,11 @@ int main(int argc, char** argv)
         case 't': target_address = optarg; break;
         case 'D': debug_mode = true; break;
         case 'v': verbose = true; break;
+        case 'S': stats_file = optarg; break;
+        case 'T':
+            if (sscanf(optarg, "%d", &stats_interval) != 1 || stats_interval <= 0)
+                usage(argv[0]);
+            break;
 
         default:
             usage(argv[0]);
@@ -307,6 +353,10 @@ int main(int argc, char** argv)
     proactor = pn_proactor();
     pn_proactor_addr(proactor_address, sizeof(proactor_address), host, port);
     pn_proactor_connect2(proactor, pn_conn, 0, proactor_address);
+    if (stats_file) {
+        write_stats();
+        pn_proactor_set_timeout(proactor, stats_interval);
+    }
 
     bool done = false;
     while (!done) {
@@ -331,6 +381,8 @@ int main(int argc, char** argv)
         }
     }
 
+    if (stats_file)
+        write_stats();
     pn_proactor_free(proactor);
     return 0;
 }
@@ -24,12 +24,16 @@ ulimit -S -n $FMAX_LIMIT
 
 podman start nginx-perf
 
+# one physical core per router, clients and servers get the rest
+# (see ../../../tools/cpu-place topology)
+PLACE="../../../tools/cpu-place -q -g ingress:1 -g egress:1 -g clients:rest"
+
 rm -f skrouterd-ingress-log.txt
-numactl --physcpubind=3 skrouterd -c skrouterd-ingress.conf &
+$PLACE exec ingress -- skrouterd -c skrouterd-ingress.conf &
 ROUTER_PIDS="$! "
 
 rm -f skrouterd-egress-log.txt
-numactl --physcpubind=5 skrouterd -c skrouterd-egress.conf &
+$PLACE exec egress -- skrouterd -c skrouterd-egress.conf &
 ROUTER_PIDS+="$! "
 
 echo "Waiting servers to establish"
@@ -44,11 +48,11 @@ HP_CALLS=1
 HP_TIMEOUT=5
 
 echo -e "\nBaseline:"
-httperf --hog --server $NGINX_HOST --port $NGINX_PORT --uri /index.html --rate $HP_RATE --num-conns $HP_CONNS --num-calls $HP_CALLS --timeout $HP_TIMEOUT -v
+$PLACE exec clients -- httperf --hog --server $NGINX_HOST --port $NGINX_PORT --uri /index.html --rate $HP_RATE --num-conns $HP_CONNS --num-calls $HP_CALLS --timeout $HP_TIMEOUT -v
 
 echo -e "\nBegin load..."
 for (( iteration=0 ; iteration<$TEST_RUNS ; iteration+=1 )) ; do
-    httperf --hog --server $ROUTER_HOST --port $ROUTER_PORT --uri /index.html --rate $HP_RATE --num-conns $HP_CONNS --num-calls $HP_CALLS --timeout $HP_TIMEOUT -v
+    $PLACE exec clients -- httperf --hog --server $ROUTER_HOST --port $ROUTER_PORT --uri /index.html --rate $HP_RATE --num-conns $HP_CONNS --num-calls $HP_CALLS --timeout $HP_TIMEOUT -v
     sleep 3
 done
 
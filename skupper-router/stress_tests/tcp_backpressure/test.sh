@@ -3,9 +3,15 @@
 
 set -x
 
-TEST_RUNS=10
-CLIENT_COUNT=20
-REQ_COUNT=500
+TEST_RUNS=${TEST_RUNS:-10}
+CLIENT_COUNT=${CLIENT_COUNT:-20}
+REQ_COUNT=${REQ_COUNT:-500}
+
+# slow-origin settings (see ../../clients/slow-origin -h)
+SERVER_DELAY=${SERVER_DELAY:-100}
+SERVER_SIZE=${SERVER_SIZE:-0}
+SERVER_READ_RATE=${SERVER_READ_RATE:-0}
+SERVER_WRITE_RATE=${SERVER_WRITE_RATE:-0}
 
 # fire up the routers
 
@@ -21,9 +27,14 @@ rm -f skrouterd-egress-log.txt
 skrouterd -c skrouterd-egress.conf &
 ROUTER_PIDS+="$! "
 
-# fire up the server
+# fire up the server: the event driven slow-origin if it is installed
+# (make install in ../../clients), otherwise the python slow-server
 
-./slow-server 0.0.0.0 8800 &
+if command -v slow-origin > /dev/null; then
+    slow-origin -p 8800 -d $SERVER_DELAY -s $SERVER_SIZE -r $SERVER_READ_RATE -w $SERVER_WRITE_RATE -v > server_results.txt &
+else
+    ./slow-server 0.0.0.0 8800 &
+fi
 SERVER_PID="$! "
 
 echo "Waiting for routers to establish"
@@ -36,6 +47,16 @@ skstat -m -r RouterTcpInterior >> interior_results.txt
 echo -e "PRE-TEST MEMORY PROFILE:\n" > egress_results.txt
 skstat -m -r RouterTcpEgress >> egress_results.txt
 
+# per iteration pool dumps for ../pool-trend
+function dump_pools {
+    skstat -m > pools/ingress-$1.txt
+    skstat -m -r RouterTcpInterior > pools/interior-$1.txt
+    skstat -m -r RouterTcpEgress > pools/egress-$1.txt
+}
+rm -rf pools
+mkdir pools
+dump_pools 000
+
 echo "Begin load..."
 for (( iteration=0 ; iteration<$TEST_RUNS ; iteration+=1 )) ; do
     CLIENT_PIDS=
@@ -45,6 +66,7 @@ for (( iteration=0 ; iteration<$TEST_RUNS ; iteration+=1 )) ; do
     done
     wait $CLIENT_PIDS
     echo "Iteration $iteration done"
+    dump_pools $(printf %03d $((iteration + 1)))
 done
 
 echo "... test complete"
@@ -68,3 +90,8 @@ skmanage query -r RouterTcpEgress --type tcpListener >> egress_results.txt
 kill $ROUTER_PIDS $SERVER_PID
 wait $ROUTER_PIDS $SERVER_PID
 
+for router in ingress interior egress; do
+    echo -e "\nPOOL TREND ($router):\n" >> ${router}_results.txt
+    ../pool-trend pools/${router}-*.txt >> ${router}_results.txt
+done
+
@@ -20,12 +20,16 @@ MAX_CONNS=10000
 FMAX_LIMIT=$(ulimit -H -n)
 ulimit -S -n $FMAX_LIMIT
 
+# one physical core per router, clients and servers get the rest
+# (see ../../../tools/cpu-place topology)
+PLACE="../../../tools/cpu-place -q -g ingress:1 -g egress:1 -g clients:rest"
+
 rm -f skrouterd-ingress-log.txt
-numactl --physcpubind=3 skrouterd -c skrouterd-ingress.conf &
+$PLACE exec ingress -- skrouterd -c skrouterd-ingress.conf &
 ROUTER_PIDS="$! "
 
 rm -f skrouterd-egress-log.txt
-numactl --physcpubind=5 skrouterd -c skrouterd-egress.conf &
+$PLACE exec egress -- skrouterd -c skrouterd-egress.conf &
 ROUTER_PIDS+="$! "
 
 echo "Waiting servers to establish"
@@ -33,7 +37,7 @@ sleep 5
 
 echo -e "\nBegin test..."
 for (( iteration=0 ; iteration<$TEST_RUNS ; iteration+=1 )) ; do
-    ./tcp-conn-scale $MAX_CONNS $ROUTER_HOST $CLIENT_PORT $SERVER_PORT
+    $PLACE exec clients -- ./tcp-conn-scale $MAX_CONNS $ROUTER_HOST $CLIENT_PORT $SERVER_PORT
     sleep 5
 done
 
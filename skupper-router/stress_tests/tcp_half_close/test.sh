@@ -15,27 +15,44 @@ SERVER_PORT=8800
 # Enable 1/2 close idle timeout (default is 
 export SKUPPER_ROUTER_ENABLE_1152=ON
 
+# one physical core per router, clients and servers get the rest
+# (see ../../../tools/cpu-place topology)
+PLACE="../../../tools/cpu-place -q -g ingress:1 -g egress:1 -g clients:rest"
+
 rm -f skrouterd-ingress-log.txt
-numactl --physcpubind=3 skrouterd -c skrouterd-ingress.conf &
+$PLACE exec ingress -- skrouterd -c skrouterd-ingress.conf &
 ROUTER_PIDS="$! "
 
 rm -f skrouterd-egress-log.txt
-numactl --physcpubind=5 skrouterd -c skrouterd-egress.conf &
+$PLACE exec egress -- skrouterd -c skrouterd-egress.conf &
 ROUTER_PIDS+="$! "
 
-./server-idle $ROUTER_HOST $SERVER_PORT &
+$PLACE exec clients -- ./server-idle $ROUTER_HOST $SERVER_PORT &
 SERVER_PID="$! "
 
 echo "Waiting servers to establish"
 sleep 5
 
 echo -e "\nBegin test..."
-./client-half-close $ROUTER_HOST $CLIENT_PORT
+$PLACE exec clients -- ./client-half-close $ROUTER_HOST $CLIENT_PORT
 echo -e "\n... test complete"
 
 skstat -c -r RouterTcpIngress
 skstat -c -r RouterTcpEgress
 
-kill $SERVER_PID $ROUTER_PIDS
-wait $SERVER_PID $ROUTER_PIDS
+kill $SERVER_PID
+wait $SERVER_PID || true
+
+# Measure half-close propagation and router memory with many flows using
+# half-close from ../../clients (make install) if it is available.
+# It accepts the tcpConnector's connections itself so server-idle is stopped first.
+if command -v half-close > /dev/null; then
+    for ORDER in client server both; do
+        echo -e "\nHalf-close benchmark, $ORDER shuts down first..."
+        half-close -p $CLIENT_PORT -l $SERVER_PORT -c ${FLOW_COUNT:-500} -o $ORDER -H ${HOLD_TIME:-5} || true
+    done
+fi
+
+kill $ROUTER_PIDS
+wait $ROUTER_PIDS
 
@@ -5,19 +5,23 @@
 
 TEST_RUNS=10
 
-iperf3 -s -p 5002 &
+# one physical core per router, clients and servers get the rest
+# (see ../../../tools/cpu-place topology)
+PLACE="../../../tools/cpu-place -q -g ingress:1 -g egress:1 -g clients:rest"
+
+$PLACE exec clients -- iperf3 -s -p 5002 &
 SERVER_PIDS="$! "
-iperf3 -s -p 5003 &
+$PLACE exec clients -- iperf3 -s -p 5003 &
 SERVER_PIDS+="$! "
-iperf3 -s -p 5004 &
+$PLACE exec clients -- iperf3 -s -p 5004 &
 SERVER_PIDS+="$! "
 
 rm -f skrouterd-ingress-log.txt
-numactl --physcpubind=3 skrouterd -c skrouterd-ingress.conf &
+$PLACE exec ingress -- skrouterd -c skrouterd-ingress.conf &
 ROUTER_PIDS="$! "
 
 rm -f skrouterd-egress-log.txt
-numactl --physcpubind=5 skrouterd -c skrouterd-egress.conf &
+$PLACE exec egress -- skrouterd -c skrouterd-egress.conf &
 ROUTER_PIDS+="$! "
 
 echo "Waiting servers to establish"
@@ -26,11 +30,11 @@ sleep 10
 echo "Begin load..."
 for (( iteration=0 ; iteration<$TEST_RUNS ; iteration+=1 )) ; do
     TEST_PIDS=
-    iperf3 -c 0.0.0.0 -p 6002 -t 10 -P 5 &
+    $PLACE exec clients -- iperf3 -c 0.0.0.0 -p 6002 -t 10 -P 5 &
     TEST_PIDS+="$! "
-    iperf3 -c 0.0.0.0 -p 6003 -t 10 -P 5 &
+    $PLACE exec clients -- iperf3 -c 0.0.0.0 -p 6003 -t 10 -P 5 &
     TEST_PIDS+="$! "
-    iperf3 -c 0.0.0.0 -p 6004 -t 10 -P 5 &
+    $PLACE exec clients -- iperf3 -c 0.0.0.0 -p 6004 -t 10 -P 5 &
     TEST_PIDS+="$! "
 
     sleep 4
@@ -14,7 +14,10 @@
 # 4) execute the test scenario
 # 5) press <ENTER> to finish collection
 #
-# outputs a flamegraph for each thread
+# outputs a flamegraph for each thread and one for all worker threads
+#
+# For a non-interactive capture driven by a benchmark run, and for
+# differential flamegraphs between two runs, see qdr-flamegraph.sh
 #
 # Dependencies: on fedora 31:
 #  dnf install perf flamegraph-stackcollapse-perf flamegraph
@@ -63,26 +66,30 @@ for QDRPID in $ROUTERPIDS; do
             TMPFILE=$(mktemp)
             perf report -i ./qdr_perf_${QDRPID}_${tid}.pdata --header -g --call-graph --stdio > $TMPFILE
 
-            # Detect the core/worker threads. Concatenate all worker thread stacks
+            # Detect the core/worker threads
             if grep -q router_core_thread $TMPFILE; then
                 TYPE=core
             else
                 TYPE=worker
-                cat $TMPFILE >> $ALLWORKERS
             fi
 
             # Generate per-thread stack-collapse
             perf script -i ./qdr_perf_${QDRPID}_${tid}.pdata | stackcollapse-perf.pl --tid > $TMPFILE
 
+            # Concatenate all worker thread stacks without the thread id so
+            # flamegraph.pl merges identical stacks from different threads
+            if [ $TYPE == worker ]; then
+                sed 's/^[^;]*;//' $TMPFILE >> $ALLWORKERS
+            fi
+
             # Generate flamegraph
             title="qdrouterd $QDRPID thread $tid ($TYPE)"
             flamegraph.pl  --hash --title "${title}" --height 48 --width 1600 $TMPFILE > ./qdr_perf_${TYPE}_${QDRPID}_${tid}.svg
             rm $TMPFILE
         done
-    # this does not work:
-    # title="qdrouterd $QDRPID all worker threads"
-    # flamegraph.pl           --title "${title}" --height 48 --width 1600 $ALLWORKERS > ./qdr_perf_${QDRPID}_workers.svg
-    # flamegraph.pl --reverse --title "${title} (reversed)" --height 48 --width 1600 $ALLWORKERS > ../qdr_perf_${QDRPID}_workers.svg
+    title="qdrouterd $QDRPID all worker threads"
+    sort $ALLWORKERS | flamegraph.pl           --title "${title}" --height 48 --width 1600 > ./qdr_perf_${QDRPID}_workers.svg
+    sort $ALLWORKERS | flamegraph.pl --reverse --title "${title} (reversed)" --height 48 --width 1600 > ./qdr_perf_${QDRPID}_workers_reversed.svg
     rm $ALLWORKERS
 done
 
@@ -0,0 +1,228 @@
+#!/bin/bash
+#
+# Non-interactive flamegraph capture for skrouterd/qdrouterd driven by a
+# benchmark run, and differential flamegraphs between two captures.
+#
+# record: profile all routers for a fixed duration once the benchmark's
+#   warm-up has finished. The warm-up ends either after -w seconds or when
+#   the file given by -s appears (touch it from the benchmark script). If a
+#   benchmark command follows "--" it is started first and waited for.
+#
+#   qdr-flamegraph.sh record -w 5 -d 20 -o base -- rtt-client -p 20001 -d 30 -w 5
+#
+# diff: compare two captures, e.g. two router builds on the same workload
+#
+#   qdr-flamegraph.sh diff base new
+#
+# A capture directory holds the perf data for each router plus folded
+# stacks and flamegraphs for each thread role, summed over all routers:
+#   core.folded     - the router core thread
+#   workers.folded  - all proactor worker threads merged into one graph
+#   other.folded    - any remaining threads
+#   all.folded      - every thread
+#
+# Worker threads are merged by removing the thread id from the collapsed
+# stacks so identical call chains from different threads add up.
+#
+# Dependencies: on fedora:
+#  dnf install perf flamegraph-stackcollapse-perf flamegraph
+#
+
+## for older intel CPUs that do not support --call-graph=lbr you must use -fno-omit-frame-pointer
+## Example:
+## cmake .. -DCMAKE_INSTALL_PREFIX=/opt/kgiusti -DCMAKE_BUILD_TYPE=RelWithDebInfo -DCMAKE_C_FLAGS_RELWITHDEBINFO="-O2 -g -DNDEBUG -fno-omit-frame-pointer"
+##
+
+ROLES="all core workers other"
+
+function usage {
+    echo "Usage: $0 record [-p <pid>]... [-w <warmup secs>] [-s <start file>] [-d <duration secs>]"
+    echo "                 [-F <frequency>] [-g <dwarf|lbr|fp>] [-o <dir>] [-- <benchmark command>]"
+    echo "       $0 diff [-o <dir>] <base dir> <new dir>"
+    exit 1
+}
+
+# Split the per-thread collapsed stacks from stackcollapse-perf.pl --tid
+# into one file per thread role. The "comm-pid/tid;" prefix is dropped and
+# the counts of identical stacks are summed, which merges the threads.
+# A thread is the core thread if any of its stacks reach
+# router_core_thread, a worker if any reach the proactor.
+function split_roles {
+    local folded=$1
+    local dir=$2
+    awk -v dir="$dir" '
+        {
+            key = substr($0, 1, index($0, ";") - 1)
+            if ($0 ~ /router_core_thread/) core[key] = 1
+            else if ($0 ~ /pn_proactor_wait|thread_run/) worker[key] = 1
+            lines[NR] = $0
+        }
+        END {
+            nworkers = length(worker)
+            for (i = 1; i <= NR; i++) {
+                key = substr(lines[i], 1, index(lines[i], ";") - 1)
+                split_at = match(lines[i], / [0-9]+$/)
+                stack = substr(lines[i], length(key) + 2, split_at - length(key) - 2)
+                count = substr(lines[i], split_at + 1)
+                if (key in core) role = "core"
+                else if (key in worker || nworkers == 0) role = "workers"
+                else role = "other"
+                samples[role, stack] += count
+                samples["all", stack] += count
+            }
+            for (k in samples) {
+                split(k, part, SUBSEP)
+                print part[2], samples[k] > (dir "/" part[1] ".folded")
+            }
+        }' "$folded"
+}
+
+function render {
+    local dir=$1
+    local title=$2
+    for role in $ROLES; do
+        [ -s "$dir/$role.folded" ] || continue
+        flamegraph.pl --hash --title "${title} ${role}" --height 48 --width 1600 \
+                      "$dir/$role.folded" > "$dir/$role.svg"
+        flamegraph.pl --hash --reverse --title "${title} ${role} (reversed)" --height 48 --width 1600 \
+                      "$dir/$role.folded" > "$dir/${role}_reversed.svg"
+    done
+}
+
+function record {
+    local PIDS=""
+    local WARMUP=0
+    local START_FILE=""
+    local DURATION=10
+    local FREQ=999
+    local CALLGRAPH=dwarf
+    local OUT=qdr_flamegraph_$(date +%Y%m%d-%H%M%S)
+    local BENCH_PID=""
+
+    OPTIND=1
+    while getopts ":p:w:s:d:F:g:o:" opt; do
+        case $opt in
+            p) PIDS+="$OPTARG " ;;
+            w) WARMUP=$OPTARG ;;
+            s) START_FILE=$OPTARG ;;
+            d) DURATION=$OPTARG ;;
+            F) FREQ=$OPTARG ;;
+            g) CALLGRAPH=$OPTARG ;;
+            o) OUT=$OPTARG ;;
+            *) usage ;;
+        esac
+    done
+    shift $((OPTIND - 1))
+    [ "$1" == "--" ] && shift
+
+    if [ -z "$PIDS" ]; then
+        PIDS=$(pidof skrouterd qdrouterd)
+        if [ -z "$PIDS" ]; then
+            echo "No running skrouterd or qdrouterd found"
+            exit 1
+        fi
+    fi
+    if [ -e "$OUT" ]; then
+        echo "$OUT already exists"
+        exit 1
+    fi
+    mkdir -p "$OUT"
+    [ -n "$START_FILE" ] && rm -f "$START_FILE"
+
+    if [ $# -gt 0 ]; then
+        echo "Starting benchmark: $*"
+        "$@" > >(tee "$OUT/benchmark.log") 2>&1 &
+        BENCH_PID=$!
+    fi
+
+    # wait for the warm-up to finish
+    if [ -n "$START_FILE" ]; then
+        echo "Waiting for $START_FILE"
+        while [ ! -e "$START_FILE" ]; do
+            if [ -n "$BENCH_PID" ] && ! kill -0 $BENCH_PID 2>/dev/null; then
+                echo "Benchmark exited before $START_FILE appeared"
+                exit 1
+            fi
+            sleep 0.1
+        done
+    else
+        sleep $WARMUP
+    fi
+
+    echo "Recording routers $PIDS for $DURATION seconds"
+    local PERF_PIDS=""
+    for QDRPID in $PIDS; do
+        perf record -F $FREQ --call-graph=$CALLGRAPH -p $QDRPID -o "$OUT/perf_${QDRPID}.data" -- sleep $DURATION \
+             2> "$OUT/perf_${QDRPID}.log" &
+        PERF_PIDS+="$! "
+    done
+    wait $PERF_PIDS
+
+    if [ -n "$BENCH_PID" ]; then
+        echo "Waiting for the benchmark to finish"
+        wait $BENCH_PID
+    fi
+
+    # fold the stacks, merging threads by role across all routers
+    for QDRPID in $PIDS; do
+        mkdir -p "$OUT/$QDRPID"
+        perf script -i "$OUT/perf_${QDRPID}.data" 2> /dev/null | stackcollapse-perf.pl --tid > "$OUT/$QDRPID/threads.folded"
+        split_roles "$OUT/$QDRPID/threads.folded" "$OUT/$QDRPID"
+        render "$OUT/$QDRPID" "router $QDRPID"
+    done
+    for role in $ROLES; do
+        cat "$OUT"/*/$role.folded 2> /dev/null |\
+            awk '{n = $NF; $NF = ""; sub(/ $/, ""); s[$0] += n} END {for (k in s) print k, s[k]}' > "$OUT/$role.folded"
+    done
+    render "$OUT" "$(basename $OUT)"
+
+    for role in $ROLES; do
+        [ -s "$OUT/$role.folded" ] && echo "$role: $(awk '{s += $NF} END {print s}' "$OUT/$role.folded") samples"
+    done
+    echo "Flamegraphs written to $OUT"
+}
+
+# Differential flamegraphs. diff_<role>.svg has the shape of the new
+# profile colored by the change from base (red == more samples).
+# diff_<role>_negated.svg has the shape of the base profile, showing what
+# the new build no longer does. Sample counts are normalized so runs of
+# different length compare.
+function diff {
+    local OUT=""
+
+    OPTIND=1
+    while getopts ":o:" opt; do
+        case $opt in
+            o) OUT=$OPTARG ;;
+            *) usage ;;
+        esac
+    done
+    shift $((OPTIND - 1))
+    [ $# -eq 2 ] || usage
+    local BASE=$1
+    local NEW=$2
+    [ -z "$OUT" ] && OUT="$NEW/diff_$(basename $BASE)"
+    mkdir -p "$OUT"
+
+    for role in $ROLES; do
+        if [ ! -s "$BASE/$role.folded" ] || [ ! -s "$NEW/$role.folded" ]; then
+            continue
+        fi
+        title="$(basename $BASE) -> $(basename $NEW) ${role}"
+        difffolded.pl -n "$BASE/$role.folded" "$NEW/$role.folded" |\
+            flamegraph.pl --title "${title}" --height 48 --width 1600 > "$OUT/diff_${role}.svg"
+        difffolded.pl -n "$NEW/$role.folded" "$BASE/$role.folded" |\
+            flamegraph.pl --negate --title "${title} (base shape)" --height 48 --width 1600 > "$OUT/diff_${role}_negated.svg"
+    done
+    echo "Differential flamegraphs written to $OUT"
+}
+
+COMMAND=$1
+shift
+case "$COMMAND" in
+    record) record "$@" ;;
+    diff) diff "$@" ;;
+    *) usage ;;
+esac
+
+exit 0
@@ -0,0 +1,298 @@
+#!/bin/bash
+#
+# eBPF mutex profiler for skrouterd/qdrouterd. Replaces the systemtap
+# scripts, which hard code /lib64/libpthread.so.0 and need glibc
+# debuginfo. Only needs bpftrace and the router's symbol tables.
+#
+# Modes:
+#
+#   contention (default) - low overhead. Traces the futex waits taken by
+#     contended pthread mutexes (FUTEX_WAIT / FUTEX_LOCK_PI, condition
+#     variables use FUTEX_WAIT_BITSET and are ignored). Reports a wait
+#     time histogram per mutex, the top contended call sites, and the
+#     wait time per thread so the core thread and the workers can be
+#     compared. Time spent spinning before the futex wait is not seen.
+#
+#   hold - uprobes pthread_mutex_lock/unlock. Reports lock wait and hold
+#     time histograms per mutex, the call sites holding locks longest and
+#     the stack of the longest hold of each mutex. Every lock operation is
+#     traced so this slows the router down noticeably.
+#
+#   nested - uprobes pthread_mutex_lock/unlock. Reports the call sites
+#     that take a lock while holding another, the lock ordering pairs and
+#     any pair of mutexes taken in both orders (potential deadlock).
+#
+# Mutexes are identified by address. The call site stacks identify what
+# the mutex protects. Pipe through c++filt for readable C++ names.
+#
+# Dependencies: on fedora:
+#  dnf install bpftrace
+#
+
+function usage {
+    echo "Usage: $0 [-p <pid>] [-m contention|hold|nested] [-d <duration secs>] [-s <stack depth>] [-n <top N>]"
+    exit 1
+}
+
+QDRPID=""
+MODE=contention
+DURATION=10
+DEPTH=10
+TOP=20
+
+while getopts ":p:m:d:s:n:" opt; do
+    case $opt in
+        p) QDRPID=$OPTARG ;;
+        m) MODE=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        s) DEPTH=$OPTARG ;;
+        n) TOP=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+if [ -z "$QDRPID" ]; then
+    QDRPID=$(pidof -s skrouterd || pidof -s qdrouterd)
+    if [ -z "$QDRPID" ]; then
+        echo "No running skrouterd or qdrouterd found"
+        exit 1
+    fi
+fi
+
+# Since glibc 2.34 pthread lives in libc. Use whichever the router maps.
+LIB=$(awk '$6 ~ /\/libpthread[.-]/ {print $6; exit}' /proc/$QDRPID/maps)
+if [ -z "$LIB" ]; then
+    LIB=$(awk '$6 ~ /\/libc[.-]/ {print $6; exit}' /proc/$QDRPID/maps)
+fi
+if [ -z "$LIB" ]; then
+    echo "Cannot find libpthread or libc in /proc/$QDRPID/maps"
+    exit 1
+fi
+
+case $MODE in
+contention)
+    PROGRAM=$(cat <<'EOF'
+BEGIN { printf("Tracing contended mutexes in pid %d for %d secs...\n", PID, DURATION); }
+
+tracepoint:syscalls:sys_enter_futex
+/pid == PID && ((args->op & 0x7f) == 0 || (args->op & 0x7f) == 6)/
+{
+    @start[tid] = nsecs;
+    @mutex[tid] = args->uaddr;
+}
+
+tracepoint:syscalls:sys_exit_futex
+/@start[tid]/
+{
+    $us = (nsecs - @start[tid]) / 1000;
+    $m = @mutex[tid];
+    @wait_us[$m] = hist($us);
+    @wait_total_us[$m] = sum($us);
+    @wait_count[$m] = count();
+    @site_wait_us[ustack(DEPTH)] = sum($us);
+    @thread_wait_us[comm, tid] = sum($us);
+    delete(@start[tid]);
+    delete(@mutex[tid]);
+}
+
+interval:s:DURATION { exit(); }
+
+END
+{
+    clear(@start);
+    clear(@mutex);
+    printf("\n=== Mutexes by total wait (usecs) ===\n");
+    print(@wait_total_us, TOP);
+    printf("\n=== Mutexes by # of contended locks ===\n");
+    print(@wait_count, TOP);
+    printf("\n=== Top contended call sites by total wait (usecs) ===\n");
+    print(@site_wait_us, TOP);
+    printf("\n=== Wait per thread (usecs) ===\n");
+    print(@thread_wait_us);
+    printf("\n=== Wait time histograms per mutex (usecs) ===\n");
+    print(@wait_us);
+    clear(@wait_total_us);
+    clear(@wait_count);
+    clear(@site_wait_us);
+    clear(@thread_wait_us);
+    clear(@wait_us);
+}
+EOF
+)
+    ;;
+hold)
+    PROGRAM=$(cat <<'EOF'
+BEGIN { printf("Tracing mutex hold times in pid %d (LIB) for %d secs...\n", PID, DURATION); }
+
+uprobe:LIB:pthread_mutex_lock
+/pid == PID/
+{
+    @lock_start[tid] = nsecs;
+    @lock_mutex[tid] = arg0;
+}
+
+uretprobe:LIB:pthread_mutex_lock
+/@lock_start[tid]/
+{
+    $m = @lock_mutex[tid];
+    @wait_us[$m] = hist((nsecs - @lock_start[tid]) / 1000);
+    @locked[$m] = nsecs;
+    delete(@lock_start[tid]);
+    delete(@lock_mutex[tid]);
+}
+
+uprobe:LIB:pthread_mutex_unlock
+/pid == PID && @locked[arg0]/
+{
+    $us = (nsecs - @locked[arg0]) / 1000;
+    delete(@locked[arg0]);
+    @hold_us[arg0] = hist($us);
+    @hold_total_us[arg0] = sum($us);
+    @site_hold_us[ustack(DEPTH)] = sum($us);
+    @thread_hold_us[comm, tid] = sum($us);
+    if ($us > @hold_max_us[arg0]) {
+        @hold_max_us[arg0] = $us;
+        @hold_max_stack[arg0] = ustack(DEPTH);
+    }
+}
+
+interval:s:DURATION { exit(); }
+
+END
+{
+    clear(@lock_start);
+    clear(@lock_mutex);
+    clear(@locked);
+    printf("\n=== Mutexes by total hold time (usecs) ===\n");
+    print(@hold_total_us, TOP);
+    printf("\n=== Longest single hold per mutex (usecs) ===\n");
+    print(@hold_max_us, TOP);
+    printf("\n=== Stack at the longest hold per mutex ===\n");
+    print(@hold_max_stack);
+    printf("\n=== Top call sites by total hold time (usecs, stack at unlock) ===\n");
+    print(@site_hold_us, TOP);
+    printf("\n=== Hold time per thread (usecs) ===\n");
+    print(@thread_hold_us);
+    printf("\n=== Hold time histograms per mutex (usecs) ===\n");
+    print(@hold_us);
+    printf("\n=== Lock wait time histograms per mutex (usecs) ===\n");
+    print(@wait_us);
+    clear(@hold_total_us);
+    clear(@hold_max_us);
+    clear(@hold_max_stack);
+    clear(@site_hold_us);
+    clear(@thread_hold_us);
+    clear(@hold_us);
+    clear(@wait_us);
+}
+EOF
+)
+    ;;
+nested)
+    PROGRAM=$(cat <<'EOF'
+BEGIN { printf("Tracing nested mutexes in pid %d (LIB) for %d secs...\n", PID, DURATION); }
+
+uprobe:LIB:pthread_mutex_lock
+/pid == PID/
+{
+    @lock_mutex[tid] = arg0;
+}
+
+uretprobe:LIB:pthread_mutex_lock
+/pid == PID && @lock_mutex[tid]/
+{
+    $m = @lock_mutex[tid];
+    $depth = @depth[tid];
+    if ($depth > 0) {
+        // the most recently taken lock still held is the outer lock
+        @order[@held[tid, $depth - 1], $m] = count();
+        @nested_sites[ustack(DEPTH)] = count();
+    }
+    @held[tid, $depth] = $m;
+    @depth[tid] = $depth + 1;
+    delete(@lock_mutex[tid]);
+}
+
+uprobe:LIB:pthread_mutex_unlock
+/pid == PID && @depth[tid] > 0/
+{
+    // unlocks are not always LIFO (hand-over-hand locking): find this
+    // mutex among the 8 most recently taken and close the gap above it.
+    // Mutexes locked before tracing started are not found and ignored.
+    $depth = (int64) @depth[tid];
+    $i = $depth - 1;
+    $found = 0;
+    unroll(8) {
+        if (!$found && $i >= 0) {
+            if (@held[tid, $i] == arg0) {
+                $found = 1;
+            } else {
+                $i = $i - 1;
+            }
+        }
+    }
+    if ($found) {
+        unroll(8) {
+            if ($i < $depth - 1) {
+                @held[tid, $i] = @held[tid, $i + 1];
+                $i = $i + 1;
+            }
+        }
+        delete(@held[tid, $depth - 1]);
+        @depth[tid] = $depth - 1;
+    }
+}
+
+interval:s:DURATION { exit(); }
+
+END
+{
+    clear(@lock_mutex);
+    clear(@depth);
+    clear(@held);
+    printf("\n=== Call sites taking a lock while holding another ===\n");
+    print(@nested_sites, TOP);
+    printf("\n=== Lock ordering [outer, inner] ===\n");
+    print(@order);
+    clear(@nested_sites);
+    clear(@order);
+}
+EOF
+)
+    ;;
+*)
+    usage
+    ;;
+esac
+
+PROGRAM=$(echo "$PROGRAM" | sed -e "s#\bPID\b#$QDRPID#g" -e "s#\bDURATION\b#$DURATION#g" \
+                                -e "s#\bDEPTH\b#$DEPTH#g" -e "s#\bTOP\b#$TOP#g" -e "s#\bLIB\b#$LIB#g")
+
+if [ $MODE != nested ]; then
+    bpftrace -p $QDRPID -e "$PROGRAM"
+    exit $?
+fi
+
+# flag mutex pairs taken in both orders
+OUTPUT=$(mktemp)
+trap "rm -f $OUTPUT" EXIT
+bpftrace -p $QDRPID -e "$PROGRAM" | tee $OUTPUT
+echo
+echo "=== Lock order inversions ==="
+awk -F'[][, :]+' '/^@order\[/ {
+        pair[$2 " " $3] = $4
+    }
+    END {
+        found = 0
+        for (p in pair) {
+            split(p, m, " ")
+            r = m[2] " " m[1]
+            if (m[1] < m[2] && r in pair) {
+                printf("mutex %s -> %s %d times, %s -> %s %d times\n", m[1], m[2], pair[p], m[2], m[1], pair[r])
+                found = 1
+            }
+        }
+        if (!found) print "none"
+    }' $OUTPUT
+
+exit 0
@@ -0,0 +1,169 @@
+#!/bin/bash
+#
+# Hardware counter cost per message for skrouterd/qdrouterd threads
+#
+# Counts cycles, instructions, LLC misses, branch misses and context
+# switches on every router thread with perf stat over a measurement
+# window, sums them for the core thread and the worker threads, and
+# divides by the number of messages the clients moved in that window.
+#
+# The core thread is found the same way qdr-callgraph.sh does it: each
+# thread is sampled briefly and the one whose stacks reach
+# router_core_thread is the core. Everything else is a worker. Run this
+# while the benchmark is in steady state.
+#
+# The message count for the window comes from one of:
+#   -m <count>    messages sent during the window
+#   -r <rate>     steady state msgs/sec reported by the clients
+#   -c <command>  command printing the clients' cumulative message count,
+#                 run at the start and the end of the window
+#
+# Example:
+#   qdr-msgcost.sh -d 20 -r 41000 -l main -o msgcost.csv
+#
+# Append the results of several builds to the same -o file to track
+# instructions/msg and misses/msg across builds.
+#
+# Dependencies: on fedora:
+#  dnf install perf
+#
+
+EVENTS="cycles,instructions,LLC-load-misses,branch-misses,context-switches"
+
+function usage {
+    echo "Usage: $0 [-p <pid>]... [-d <duration secs>] [-w <warmup secs>]"
+    echo "          (-m <msg count> | -r <msgs/sec> | -c <count command>) [-l <label>] [-o <csv file>]"
+    exit 1
+}
+
+ROUTERPIDS=""
+DURATION=10
+WARMUP=0
+MSGS=""
+RATE=""
+COUNT_CMD=""
+LABEL=$(date +%Y%m%d-%H%M%S)
+CSV=""
+
+while getopts ":p:d:w:m:r:c:l:o:" opt; do
+    case $opt in
+        p) ROUTERPIDS+="$OPTARG " ;;
+        d) DURATION=$OPTARG ;;
+        w) WARMUP=$OPTARG ;;
+        m) MSGS=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        c) COUNT_CMD=$OPTARG ;;
+        l) LABEL=$OPTARG ;;
+        o) CSV=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+if [ -z "$MSGS" ] && [ -z "$RATE" ] && [ -z "$COUNT_CMD" ]; then
+    echo "One of -m, -r or -c is required"
+    usage
+fi
+
+if [ -z "$ROUTERPIDS" ]; then
+    ROUTERPIDS=$(pidof skrouterd qdrouterd)
+    if [ -z "$ROUTERPIDS" ]; then
+        echo "No running skrouterd or qdrouterd found"
+        exit 1
+    fi
+fi
+
+WORKDIR=$(mktemp -d)
+trap "rm -rf $WORKDIR" EXIT
+
+sleep $WARMUP
+
+# Find the core thread of each router
+for QDRPID in $ROUTERPIDS; do
+    for tid in $(ps -L --pid $QDRPID -o tid=); do
+        perf record -F 999 --call-graph=dwarf --per-thread -q --tid=$tid \
+             --output=$WORKDIR/classify_${tid}.pdata -- sleep 1 2> /dev/null &
+    done
+done
+wait
+for QDRPID in $ROUTERPIDS; do
+    for tid in $(ps -L --pid $QDRPID -o tid=); do
+        if perf script -i $WORKDIR/classify_${tid}.pdata 2> /dev/null | grep -q router_core_thread; then
+            echo "$tid core" >> $WORKDIR/roles
+        else
+            echo "$tid worker" >> $WORKDIR/roles
+        fi
+    done
+done
+if ! grep -q core $WORKDIR/roles; then
+    echo "WARNING: no core thread found (is the router busy?), all threads counted as workers"
+fi
+
+# Count over the measurement window
+[ -n "$COUNT_CMD" ] && START_COUNT=$(eval "$COUNT_CMD")
+for QDRPID in $ROUTERPIDS; do
+    perf stat -e $EVENTS --per-thread -x, -p $QDRPID -o $WORKDIR/stat_${QDRPID}.csv -- sleep $DURATION &
+done
+wait
+if [ -n "$COUNT_CMD" ]; then
+    END_COUNT=$(eval "$COUNT_CMD")
+    MSGS=$((END_COUNT - START_COUNT))
+elif [ -n "$RATE" ]; then
+    MSGS=$(awk -v r=$RATE -v d=$DURATION 'BEGIN {printf "%.0f", r * d}')
+fi
+if [ "$MSGS" -le 0 ]; then
+    echo "No messages counted during the window"
+    exit 1
+fi
+
+# perf stat --per-thread -x, lines look like:
+#   skrouterd-1234,5678901,,cycles,1000000000,100.00,,
+# the thread id is the suffix of the first field
+cat $WORKDIR/stat_*.csv | awk -F, -v roles=$WORKDIR/roles -v msgs=$MSGS -v label="$LABEL" -v secs=$DURATION -v csv="$CSV" '
+    BEGIN {
+        while ((getline line < roles) > 0) {
+            split(line, f, " ")
+            role[f[1]] = f[2]
+        }
+        nevents = split("cycles instructions LLC-load-misses branch-misses context-switches", events, " ")
+    }
+    /^#/ || NF < 4 { next }
+    {
+        tid = $1
+        sub(/.*-/, "", tid)
+        if (!(tid in role)) next
+        value = ($2 ~ /^[0-9.]+$/) ? $2 : 0
+        event = $4
+        sub(/:.*/, "", event)
+        total[role[tid], event] += value
+        total["all", event] += value
+        if (!((role[tid], tid) in seen)) {
+            seen[role[tid], tid] = 1
+            nthreads[role[tid]] += 1
+            nthreads["all"] += 1
+        }
+    }
+    END {
+        printf("%s: %d msgs in %d secs (%.1f msgs/sec)\n", label, msgs, secs, msgs / secs)
+        printf("%-7s %8s %14s %14s %14s %14s %14s %8s\n", "threads", "count", "cycles/msg", "instr/msg",
+               "LLC-miss/msg", "br-miss/msg", "ctx-sw/msg", "IPC")
+        if (csv != "" && (getline tmp < csv) <= 0)
+            print "label,threads,count,msgs,secs,cycles,instructions,llc_misses,branch_misses,context_switches," \
+                  "cycles_per_msg,instructions_per_msg,llc_misses_per_msg,branch_misses_per_msg,context_switches_per_msg,ipc" > csv
+        split("core worker all", order, " ")
+        for (o = 1; o <= 3; o++) {
+            r = order[o]
+            n = nthreads[r]
+            if (n == 0) continue
+            cyc = total[r, "cycles"]; ins = total[r, "instructions"]
+            llc = total[r, "LLC-load-misses"]; br = total[r, "branch-misses"]; cs = total[r, "context-switches"]
+            ipc = cyc > 0 ? ins / cyc : 0
+            printf("%-7s %8d %14.1f %14.1f %14.3f %14.3f %14.4f %8.2f\n", r, n,
+                   cyc / msgs, ins / msgs, llc / msgs, br / msgs, cs / msgs, ipc)
+            if (csv != "")
+                printf("%s,%s,%d,%d,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%.3f,%.3f,%.5f,%.5f,%.6f,%.3f\n",
+                       label, r, n, msgs, secs, cyc, ins, llc, br, cs,
+                       cyc / msgs, ins / msgs, llc / msgs, br / msgs, cs / msgs, ipc) >> csv
+        }
+    }'
+
+exit 0
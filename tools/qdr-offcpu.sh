@@ -0,0 +1,247 @@
+#!/bin/bash
+#
+# Off-CPU and wakeup latency analysis for skrouterd/qdrouterd threads
+#
+# On-CPU profiles (qdr-callgraph.sh, qdr-flamegraph.sh) do not show the
+# time router threads spend blocked or waiting to run. During the
+# measurement window this records, for each router thread:
+#
+#  - off-CPU time broken down by what the thread blocked in: futex
+#    (mutexes, condition variables), epoll_wait, write (write, writev,
+#    sendmsg, sendto), read (read, readv, recvmsg, recvfrom), other, and
+#    preempted (runnable but descheduled, from sched_switch prev_state;
+#    kernels since 4.14 flag preemption with the 0x100 bit, which is
+#    masked off, so preempted means no blocked state in the low byte)
+#  - off-CPU stacks for each category
+#  - wakeup-to-run latency: time from sched_wakeup until the thread
+#    actually runs
+#
+# Threads are enumerated with ps -L like qdr-callgraph.sh. The core thread
+# is the one whose off-CPU stacks reach router_core_thread. Blocked time
+# is divided by the number of messages the clients moved in the window
+# (see qdr-msgcost.sh for -m, -r and -c).
+#
+# The raw bpftrace output, including the wakeup latency histograms and
+# all off-CPU stacks, is kept in qdr_offcpu_<pid>.txt.
+#
+# Dependencies: on fedora:
+#  dnf install bpftrace
+#
+
+function usage {
+    echo "Usage: $0 [-p <pid>] [-d <duration secs>] [-w <warmup secs>] [-s <stack depth>] [-n <top N stacks>]"
+    echo "          [-m <msg count> | -r <msgs/sec> | -c <count command>]"
+    exit 1
+}
+
+QDRPID=""
+DURATION=10
+WARMUP=0
+DEPTH=16
+TOP=10
+MSGS=""
+RATE=""
+COUNT_CMD=""
+
+while getopts ":p:d:w:s:n:m:r:c:" opt; do
+    case $opt in
+        p) QDRPID=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        w) WARMUP=$OPTARG ;;
+        s) DEPTH=$OPTARG ;;
+        n) TOP=$OPTARG ;;
+        m) MSGS=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        c) COUNT_CMD=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+if [ -z "$QDRPID" ]; then
+    QDRPID=$(pidof -s skrouterd || pidof -s qdrouterd)
+    if [ -z "$QDRPID" ]; then
+        echo "No running skrouterd or qdrouterd found"
+        exit 1
+    fi
+fi
+
+OUTPUT=qdr_offcpu_${QDRPID}.txt
+THREADS=$(mktemp)
+trap "rm -f $THREADS" EXIT
+
+PROGRAM=$(cat <<'EOF'
+BEGIN { printf("Tracing off-CPU time of pid %d for %d secs...\n", PID, DURATION); }
+
+// remember which blocking syscall each router thread is in
+tracepoint:syscalls:sys_enter_futex /pid == PID/ { @in[tid] = "futex"; }
+tracepoint:syscalls:sys_enter_epoll_*wait* /pid == PID/ { @in[tid] = "epoll_wait"; }
+tracepoint:syscalls:sys_enter_write,
+tracepoint:syscalls:sys_enter_writev,
+tracepoint:syscalls:sys_enter_sendmsg,
+tracepoint:syscalls:sys_enter_sendto /pid == PID/ { @in[tid] = "write"; }
+tracepoint:syscalls:sys_enter_read,
+tracepoint:syscalls:sys_enter_readv,
+tracepoint:syscalls:sys_enter_recvmsg,
+tracepoint:syscalls:sys_enter_recvfrom /pid == PID/ { @in[tid] = "read"; }
+tracepoint:raw_syscalls:sys_exit /pid == PID/ { delete(@in[tid]); }
+
+tracepoint:sched:sched_switch
+{
+    // the current task is the one being switched out
+    if (pid == PID) {
+        @router[tid] = 1;
+        @off_start[tid] = nsecs;
+        @off_stack[tid] = ustack(DEPTH);
+        // since 4.14 a preempted task has TASK_REPORT_MAX (0x100, "R+")
+        // set, only the low bits give the blocked state
+        if ((args->prev_state & 0xff) == 0) {
+            @off_cat[tid] = "preempted";
+        } else if (@in[tid] == "") {
+            @off_cat[tid] = "other";
+        } else {
+            @off_cat[tid] = @in[tid];
+        }
+    }
+
+    $next = args->next_pid;
+    if (@off_start[$next]) {
+        $us = (nsecs - @off_start[$next]) / 1000;
+        @offcpu_us[$next, @off_cat[$next]] = sum($us);
+        @offcpu_stacks[$next, @off_cat[$next], @off_stack[$next]] = sum($us);
+        delete(@off_start[$next]);
+        delete(@off_cat[$next]);
+        delete(@off_stack[$next]);
+    }
+    if (@woken[$next]) {
+        $lat = (nsecs - @woken[$next]) / 1000;
+        @wakeup_latency_us[$next] = hist($lat);
+        @wakeup_total_us[$next] = sum($lat);
+        @wakeup_max_us[$next] = max($lat);
+        @wakeups[$next] = count();
+        delete(@woken[$next]);
+    }
+}
+
+tracepoint:sched:sched_wakeup,
+tracepoint:sched:sched_wakeup_new
+/@router[args->pid]/
+{
+    @woken[args->pid] = nsecs;
+}
+
+interval:s:DURATION { exit(); }
+
+END
+{
+    clear(@in);
+    clear(@router);
+    clear(@off_start);
+    clear(@off_cat);
+    clear(@off_stack);
+    clear(@woken);
+}
+EOF
+)
+
+PROGRAM=$(echo "$PROGRAM" | sed -e "s#\bPID\b#$QDRPID#g" -e "s#\bDURATION\b#$DURATION#g" -e "s#\bDEPTH\b#$DEPTH#g")
+
+sleep $WARMUP
+
+# enumerate the router threads
+ps -L --pid $QDRPID -o tid=,comm= > $THREADS
+
+[ -n "$COUNT_CMD" ] && START_COUNT=$(eval "$COUNT_CMD")
+bpftrace -p $QDRPID -e "$PROGRAM" > $OUTPUT
+if [ -n "$COUNT_CMD" ]; then
+    END_COUNT=$(eval "$COUNT_CMD")
+    MSGS=$((END_COUNT - START_COUNT))
+elif [ -n "$RATE" ]; then
+    MSGS=$(awk -v r=$RATE -v d=$DURATION 'BEGIN {printf "%.0f", r * d}')
+fi
+
+# bpftrace prints maps as
+#   @offcpu_us[1234, futex]: 5678
+#   @offcpu_stacks[1234, futex,
+#           frame+12
+#           ...
+#   ]: 5678
+awk -v threads=$THREADS -v msgs="$MSGS" -v top=$TOP -v secs=$DURATION '
+    BEGIN {
+        while ((getline line < threads) > 0) {
+            split(line, f, " ")
+            comm[f[1]] = f[2]
+            order[++nthreads] = f[1]
+        }
+        ncats = split("futex epoll_wait write read other preempted", cats, " ")
+    }
+    /^@offcpu_us\[/ {
+        split($0, f, /[][, :]+/)
+        offcpu[f[2], f[3]] += f[4]
+        next
+    }
+    /^@wakeups\[/ { split($0, f, /[][, :]+/); wakeups[f[2]] = f[3]; next }
+    /^@wakeup_total_us\[/ { split($0, f, /[][, :]+/); wakeup_total[f[2]] = f[3]; next }
+    /^@wakeup_max_us\[/ { split($0, f, /[][, :]+/); wakeup_max[f[2]] = f[3]; next }
+    /^@offcpu_stacks\[/ {
+        split($0, f, /[][, :]+/)
+        stack_tid = f[2]
+        stack = "tid " f[2] " (" f[3] ")"
+        in_stack = 1
+        next
+    }
+    in_stack && /^\]: / {
+        value = $2
+        if (stack ~ /router_core_thread/) core[stack_tid] = 1
+        stacks[++nstacks] = stack
+        stack_us[nstacks] = value
+        in_stack = 0
+        next
+    }
+    in_stack { stack = stack "\n" $0; next }
+    END {
+        printf("\nOff-CPU msecs per thread:\n%-8s %-16s %-7s", "tid", "comm", "role")
+        for (c = 1; c <= ncats; c++) printf(" %11s", cats[c])
+        printf(" %9s %12s %12s\n", "wakeups", "avg-lat-us", "max-lat-us")
+        for (i = 1; i <= nthreads; i++) {
+            t = order[i]
+            r = (t in core) ? "core" : "worker"
+            printf("%-8s %-16s %-7s", t, comm[t], r)
+            for (c = 1; c <= ncats; c++) {
+                us = offcpu[t, cats[c]]
+                printf(" %11.1f", us / 1000)
+                role_us[r, cats[c]] += us
+            }
+            avg = wakeups[t] ? wakeup_total[t] / wakeups[t] : 0
+            printf(" %9d %12.1f %12d\n", wakeups[t], avg, wakeup_max[t])
+            role_threads[r] += 1
+        }
+
+        if (msgs > 0) {
+            printf("\nBlocked usecs per message (%d msgs in %d secs):\n", msgs, secs)
+            printf("%-7s %7s", "role", "threads")
+            for (c = 1; c <= ncats; c++) printf(" %11s", cats[c])
+            printf("\n")
+            split("core worker", roles, " ")
+            for (i = 1; i <= 2; i++) {
+                r = roles[i]
+                if (!role_threads[r]) continue
+                printf("%-7s %7d", r, role_threads[r])
+                for (c = 1; c <= ncats; c++) printf(" %11.3f", role_us[r, cats[c]] / msgs)
+                printf("\n")
+            }
+        }
+
+        # top off-CPU stacks, largest first
+        printf("\nTop %d off-CPU stacks (usecs):\n", top)
+        for (n = 0; n < top && n < nstacks; n++) {
+            best = 0
+            for (i = 1; i <= nstacks; i++)
+                if (!(i in shown) && (best == 0 || stack_us[i] > stack_us[best])) best = i
+            shown[best] = 1
+            printf("\n%s\n    %d usecs\n", stacks[best], stack_us[best])
+        }
+    }' $OUTPUT
+
+echo
+echo "Wakeup latency histograms and all off-CPU stacks are in $OUTPUT"
+exit 0
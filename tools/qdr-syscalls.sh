@@ -0,0 +1,331 @@
+#!/bin/bash
+#
+# Syscalls per message and bytes per read/write for skrouterd/qdrouterd
+#
+# Counts the router's I/O system calls during a measurement window with
+# bpftrace syscall tracepoints:
+#
+#   read:   read, readv, recvfrom, recvmsg, recvmmsg
+#   write:  write, writev, sendto, sendmsg, sendmmsg
+#   epoll:  epoll_wait, epoll_pwait, epoll_pwait2
+#
+# and reports for each call: count, calls per message, bytes per call,
+# errors (mostly EAGAIN) and time spent in the kernel, plus histograms
+# of the write sizes, read sizes and events returned per epoll_wait.
+# Many small writes at low load, or reads that never fill the buffer at
+# high load, show up directly in these numbers.
+#
+# 8 byte read()/write() calls are almost always eventfd wakeups (the
+# proactor's wake mechanism) rather than socket I/O, they are counted
+# separately so they do not skew the socket numbers.  recvmmsg/sendmmsg
+# return a message count rather than bytes, they are reported as
+# messages per call and left out of the byte statistics.
+#
+# The message count for the window comes from one of (see
+# qdr-msgcost.sh):
+#   -m <count>    messages sent during the window
+#   -r <rate>     steady state msgs/sec reported by the clients
+#   -c <command>  command printing the clients' cumulative message count,
+#                 run at the start and the end of the window
+#
+# Example:
+#   qdr-syscalls.sh -d 20 -r 41000 -l main -o syscalls.csv
+#
+# The raw bpftrace output is kept in qdr_syscalls_<pid>.txt.
+#
+# Dependencies: on fedora:
+#  dnf install bpftrace
+#
+
+function usage {
+    echo "Usage: $0 [-p <pid>] [-d <duration secs>] [-w <warmup secs>]"
+    echo "          [-m <msg count> | -r <msgs/sec> | -c <count command>] [-l <label>] [-o <csv file>]"
+    exit 1
+}
+
+QDRPID=""
+DURATION=10
+WARMUP=0
+MSGS=""
+RATE=""
+COUNT_CMD=""
+LABEL=$(date +%Y%m%d-%H%M%S)
+CSV=""
+
+while getopts ":p:d:w:m:r:c:l:o:" opt; do
+    case $opt in
+        p) QDRPID=$OPTARG ;;
+        d) DURATION=$OPTARG ;;
+        w) WARMUP=$OPTARG ;;
+        m) MSGS=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        c) COUNT_CMD=$OPTARG ;;
+        l) LABEL=$OPTARG ;;
+        o) CSV=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+if [ -z "$QDRPID" ]; then
+    QDRPID=$(pidof -s skrouterd || pidof -s qdrouterd)
+    if [ -z "$QDRPID" ]; then
+        echo "No running skrouterd or qdrouterd found"
+        exit 1
+    fi
+fi
+
+OUTPUT=qdr_syscalls_${QDRPID}.txt
+THREADS=$(mktemp)
+trap "rm -f $THREADS" EXIT
+
+PROGRAM=$(cat <<'EOF'
+BEGIN { printf("Tracing I/O syscalls of pid %d for %d secs...\n", PID, DURATION); }
+
+tracepoint:syscalls:sys_enter_read,
+tracepoint:syscalls:sys_enter_readv,
+tracepoint:syscalls:sys_enter_recvfrom,
+tracepoint:syscalls:sys_enter_recvmsg,
+tracepoint:syscalls:sys_enter_recvmmsg,
+tracepoint:syscalls:sys_enter_write,
+tracepoint:syscalls:sys_enter_writev,
+tracepoint:syscalls:sys_enter_sendto,
+tracepoint:syscalls:sys_enter_sendmsg,
+tracepoint:syscalls:sys_enter_sendmmsg,
+tracepoint:syscalls:sys_enter_epoll_*wait*
+/pid == PID/
+{
+    @start[tid] = nsecs;
+}
+
+tracepoint:syscalls:sys_exit_read,
+tracepoint:syscalls:sys_exit_readv,
+tracepoint:syscalls:sys_exit_recvfrom,
+tracepoint:syscalls:sys_exit_recvmsg
+/pid == PID && @start[tid]/
+{
+    $ret = args->ret;
+    @calls[probe] = count();
+    @kernel_us[probe] = sum((nsecs - @start[tid]) / 1000);
+    @thread_calls[tid, "read"] = count();
+    if ($ret == 8) {
+        @eventfd[probe] = count();
+    } else if ($ret > 0) {
+        @bytes[probe] = sum($ret);
+        @read_bytes = hist($ret);
+    } else if ($ret == 0) {
+        @zero[probe] = count();
+    } else {
+        @errors[probe] = count();
+    }
+    delete(@start[tid]);
+}
+
+tracepoint:syscalls:sys_exit_write,
+tracepoint:syscalls:sys_exit_writev,
+tracepoint:syscalls:sys_exit_sendto,
+tracepoint:syscalls:sys_exit_sendmsg
+/pid == PID && @start[tid]/
+{
+    $ret = args->ret;
+    @calls[probe] = count();
+    @kernel_us[probe] = sum((nsecs - @start[tid]) / 1000);
+    @thread_calls[tid, "write"] = count();
+    if ($ret == 8) {
+        @eventfd[probe] = count();
+    } else if ($ret > 0) {
+        @bytes[probe] = sum($ret);
+        @write_bytes = hist($ret);
+    } else if ($ret == 0) {
+        @zero[probe] = count();
+    } else {
+        @errors[probe] = count();
+    }
+    delete(@start[tid]);
+}
+
+// recvmmsg/sendmmsg return the number of messages transferred, not bytes
+tracepoint:syscalls:sys_exit_recvmmsg
+/pid == PID && @start[tid]/
+{
+    $ret = args->ret;
+    @calls[probe] = count();
+    @kernel_us[probe] = sum((nsecs - @start[tid]) / 1000);
+    @thread_calls[tid, "read"] = count();
+    if ($ret > 0) {
+        @msgs[probe] = sum($ret);
+    } else if ($ret == 0) {
+        @zero[probe] = count();
+    } else {
+        @errors[probe] = count();
+    }
+    delete(@start[tid]);
+}
+
+tracepoint:syscalls:sys_exit_sendmmsg
+/pid == PID && @start[tid]/
+{
+    $ret = args->ret;
+    @calls[probe] = count();
+    @kernel_us[probe] = sum((nsecs - @start[tid]) / 1000);
+    @thread_calls[tid, "write"] = count();
+    if ($ret > 0) {
+        @msgs[probe] = sum($ret);
+    } else if ($ret == 0) {
+        @zero[probe] = count();
+    } else {
+        @errors[probe] = count();
+    }
+    delete(@start[tid]);
+}
+
+tracepoint:syscalls:sys_exit_epoll_*wait*
+/pid == PID && @start[tid]/
+{
+    $ret = args->ret;
+    @calls[probe] = count();
+    @kernel_us[probe] = sum((nsecs - @start[tid]) / 1000);
+    @thread_calls[tid, "epoll"] = count();
+    if ($ret > 0) {
+        @bytes[probe] = sum($ret);    // events, not bytes
+        @epoll_events = hist($ret);
+    } else if ($ret == 0) {
+        @zero[probe] = count();
+    } else {
+        @errors[probe] = count();
+    }
+    delete(@start[tid]);
+}
+
+interval:s:DURATION { exit(); }
+
+END
+{
+    clear(@start);
+}
+EOF
+)
+
+PROGRAM=$(echo "$PROGRAM" | sed -e "s#\bPID\b#$QDRPID#g" -e "s#\bDURATION\b#$DURATION#g")
+
+sleep $WARMUP
+
+ps -L --pid $QDRPID -o tid=,comm= > $THREADS
+
+[ -n "$COUNT_CMD" ] && START_COUNT=$(eval "$COUNT_CMD")
+bpftrace -p $QDRPID -e "$PROGRAM" > $OUTPUT
+if [ -n "$COUNT_CMD" ]; then
+    END_COUNT=$(eval "$COUNT_CMD")
+    MSGS=$((END_COUNT - START_COUNT))
+elif [ -n "$RATE" ]; then
+    MSGS=$(awk -v r=$RATE -v d=$DURATION 'BEGIN {printf "%.0f", r * d}')
+fi
+
+# bpftrace prints maps as
+#   @calls[tracepoint:syscalls:sys_exit_write]: 1234
+#   @thread_calls[5678, write]: 1234
+#   @write_bytes:
+#   [64, 128)     1234 |@@@@@@@@@@     |
+awk -v threads=$THREADS -v msgs="$MSGS" -v secs=$DURATION -v label="$LABEL" -v csv="$CSV" '
+    function kind(call) {
+        if (call ~ /epoll/) return "epoll"
+        if (call ~ /^(read|readv|recv)/) return "read"
+        return "write"
+    }
+    BEGIN {
+        while ((getline line < threads) > 0) {
+            split(line, f, " ")
+            comm[f[1]] = f[2]
+            order[++nthreads] = f[1]
+        }
+        split("read write epoll", kinds, " ")
+    }
+    /^@(calls|bytes|msgs|errors|zero|eventfd|kernel_us)\[tracepoint/ {
+        split($0, f, /[][ :]+/)
+        map = substr(f[1], 2)
+        call = f[4]
+        sub(/^sys_exit_/, "", call)
+        value = $NF
+        stat[map, call] = value
+        if (!(call in seen)) { seen[call] = 1; calls[++ncalls] = call }
+        next
+    }
+    /^@thread_calls\[/ {
+        split($0, f, /[][, :]+/)
+        tcalls[f[2], f[3]] = f[4]
+        next
+    }
+    /^@(write_bytes|read_bytes|epoll_events):/ { hist = $0; hists = hists "\n" $0 "\n"; next }
+    hist != "" && /^\[/ { hists = hists $0 "\n"; next }
+    hist != "" && /^$/ { hist = ""; next }
+    END {
+        printf("\n%-14s %10s %10s %9s %12s %10s %8s %8s %9s\n",
+               "syscall", "calls", "calls/sec", "calls/msg", "bytes/call", "eventfd", "errors", "zero", "usec/call")
+        for (i = 1; i <= ncalls; i++) {
+            c = calls[i]
+            n = stat["calls", c]
+            k = kind(c)
+            io = n - stat["eventfd", c] - stat["errors", c] - stat["zero", c]
+            mmsg = c ~ /mmsg$/
+            per_call = mmsg ? "-" : sprintf("%.1f", io > 0 ? stat["bytes", c] / io : 0)
+            printf("%-14s %10d %10.0f %9s %12s %10d %8d %8d %9.2f\n", c, n, n / secs,
+                   msgs > 0 ? sprintf("%.3f", n / msgs) : "-", per_call,
+                   stat["eventfd", c], stat["errors", c], stat["zero", c],
+                   n ? stat["kernel_us", c] / n : 0)
+            total[k] += n
+            if (mmsg) {
+                mmsg_calls += io
+                mmsg_msgs += stat["msgs", c]
+            } else {
+                total_io[k] += io
+                total_bytes[k] += stat["bytes", c]
+            }
+            total_eventfd += (k != "epoll") ? stat["eventfd", c] : 0
+            all += n
+        }
+
+        printf("\nPer thread:\n%-8s %-16s %10s %10s %10s\n", "tid", "comm", "read", "write", "epoll")
+        for (i = 1; i <= nthreads; i++) {
+            t = order[i]
+            if (!tcalls[t, "read"] && !tcalls[t, "write"] && !tcalls[t, "epoll"]) continue
+            printf("%-8s %-16s %10d %10d %10d\n", t, comm[t], tcalls[t, "read"], tcalls[t, "write"], tcalls[t, "epoll"])
+        }
+
+        bytes_write = total_io["write"] ? total_bytes["write"] / total_io["write"] : 0
+        bytes_read = total_io["read"] ? total_bytes["read"] / total_io["read"] : 0
+        events = total_io["epoll"] ? total_bytes["epoll"] / total_io["epoll"] : 0
+        printf("\nSummary (%d secs):\n", secs)
+        if (msgs > 0)
+            printf("  client throughput:   %d msgs, %.0f msgs/sec\n", msgs, msgs / secs)
+        printf("  syscalls:            %d (%.0f/sec)", all, all / secs)
+        if (msgs > 0) printf(", %.3f per message", all / msgs)
+        printf("\n")
+        for (i = 1; i <= 3; i++) {
+            k = kinds[i]
+            printf("  %-20s %d", k ":", total[k])
+            if (msgs > 0) printf(" (%.3f/msg)", total[k] / msgs)
+            printf("\n")
+        }
+        printf("  eventfd wakeups:     %d\n", total_eventfd)
+        printf("  bytes per write:     %.1f\n", bytes_write)
+        printf("  bytes per read:      %.1f\n", bytes_read)
+        printf("  events per epoll:    %.2f\n", events)
+        if (mmsg_calls)
+            printf("  msgs per [rs]mmsg:   %.2f\n", mmsg_msgs / mmsg_calls)
+        printf("%s", hists)
+
+        if (csv != "") {
+            if ((getline line < csv) <= 0)
+                print "label,secs,msgs,msgs_per_sec,syscalls_per_msg,reads_per_msg,writes_per_msg,epoll_per_msg,eventfd_per_msg,bytes_per_read,bytes_per_write,events_per_epoll" > csv
+            close(csv)
+            printf("%s,%d,%d,%.1f,%.4f,%.4f,%.4f,%.4f,%.4f,%.1f,%.1f,%.2f\n", label, secs, msgs,
+                   msgs > 0 ? msgs / secs : 0,
+                   msgs > 0 ? all / msgs : 0, msgs > 0 ? total["read"] / msgs : 0,
+                   msgs > 0 ? total["write"] / msgs : 0, msgs > 0 ? total["epoll"] / msgs : 0,
+                   msgs > 0 ? total_eventfd / msgs : 0,
+                   bytes_read, bytes_write, events) >> csv
+        }
+    }' $OUTPUT
+
+echo
+echo "Raw bpftrace output is in $OUTPUT"
+exit 0